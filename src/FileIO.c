@@ -1,7 +1,10 @@
 
+#define   _FILE_OFFSET_BITS   64             // 64-bit off_t for the files larger than 2 GiB, it must be before any system header
+
 #include "FileIO.h"
 
 #include <stdio.h>
+#include <string.h>
 
 
 
@@ -23,35 +26,36 @@ static int loadLittleEndian (int len, FILE *fp) {
 
 
 
+static int getLittleEndian (const unsigned char *p_data, int len) {
+    int i, value=0;
+    for (i=0; i<len; i++)
+        value |= ((int)p_data[i] << (8*i));
+    return value;
+}
+
+
+
 // return:
 //     -1             : failed
 //     positive value : file length
-int loadBytesFromFile (const char *p_filename, unsigned char *p_buf, int len_limit) {
-    FILE *fp;
-    int   len;
+int64_t loadBytesFromFile (const char *p_filename, unsigned char *p_buf, int64_t len_limit) {
+    FILE   *fp;
+    int64_t len;
     
     if ( (fp = fopen(p_filename, "rb")) == NULL )
         return -1;
     
-    fseek(fp, 0, SEEK_END);
-    len = ftell(fp);
-    
-    if (len > len_limit) {
-        fclose(fp);
-        return -1;
-    }
-    
-    fseek(fp, 0, SEEK_SET);
-    len_limit = fread(p_buf, sizeof(unsigned char), len, fp);
+    // read until EOF instead of getting the length with ftell, which is 32-bit on some platforms
+    len = fread(p_buf, sizeof(unsigned char), (size_t)len_limit, fp);
     
-    if (fgetc(fp) != EOF) {             // there are still some data in the file
+    if (ferror(fp) || fgetc(fp) != EOF) {   // failed, or there are still some data in the file
         fclose(fp);
         return -1;
     }
     
     fclose(fp);
     
-    return (len != len_limit) ? -1 : len;
+    return len;
 }
 
 
@@ -59,16 +63,17 @@ int loadBytesFromFile (const char *p_filename, unsigned char *p_buf, int len_lim
 // return:
 //     -1 : failed
 //      0 : success
-int writeBytesToFile (const char *p_filename, const unsigned char *p_buf, int len) {
-    FILE *fp;
-    int   len_actual;
+int writeBytesToFile (const char *p_filename, const unsigned char *p_buf, int64_t len) {
+    FILE   *fp;
+    int64_t len_actual;
     
     if ( (fp = fopen(p_filename, "wb")) == NULL )
         return -1;
     
-    len_actual = fwrite(p_buf, sizeof(unsigned char), len, fp);
+    len_actual = fwrite(p_buf, sizeof(unsigned char), (size_t)len, fp);
     
-    fclose(fp);
+    if (fclose(fp))
+        return -1;
     
     return (len != len_actual) ? -1 : 0;
 }
@@ -78,9 +83,10 @@ int writeBytesToFile (const char *p_filename, const unsigned char *p_buf, int le
 // return:
 //     -1 : failed
 //      0 : success
-int loadPGMImageFile (const char *p_filename, unsigned char *p_img, int *p_height, int *p_width) {
-    FILE *fp;
-    int   len, len_actual, maxval=0;
+int loadPGMImageFile (const char *p_filename, unsigned char *p_img, int64_t size_limit, int *p_height, int *p_width) {
+    FILE   *fp;
+    int64_t len, len_actual;
+    int     maxval=0;
 
     (*p_height) = (*p_width) = -1;
     
@@ -122,11 +128,16 @@ int loadPGMImageFile (const char *p_filename, unsigned char *p_img, int *p_heigh
         return -1;
     }
     
-    fgetc(fp);                               // skip a white char
+    len = (int64_t)(*p_width) * (*p_height);
     
-    len = ((*p_width)*(*p_height));
+    if (len > size_limit) {                  // larger than the buffer
+        fclose(fp);
+        return -1;
+    }
+    
+    fgetc(fp);                               // skip a white char
     
-    len_actual = fread(p_img, sizeof(unsigned char), len, fp);
+    len_actual = fread(p_img, sizeof(unsigned char), (size_t)len, fp);
     
     fclose(fp);
     
@@ -139,9 +150,9 @@ int loadPGMImageFile (const char *p_filename, unsigned char *p_img, int *p_heigh
 //     -1 : failed
 //      0 : success
 int writePGMImageFile (const char *p_filename, const unsigned char *p_img, int height, int width) {
-    FILE *fp;
-    int   len = width*height;
-    int   len_actual;
+    FILE   *fp;
+    int64_t len = (int64_t)width * height;
+    int64_t len_actual;
     
     if (width < 1 || height < 1)
         return -1;
@@ -149,11 +160,16 @@ int writePGMImageFile (const char *p_filename, const unsigned char *p_img, int h
     if ( (fp = fopen(p_filename, "wb")) == NULL )
         return -1;
     
-    fprintf(fp, "P5\n%d %d\n255\n", width, height);
+    {
+        unsigned char header [PGM_MAX_HEADER_LEN];
+        int header_len = putPGMHeader(header, height, width);
+        fwrite(header, sizeof(unsigned char), header_len, fp);
+    }
     
-    len_actual = fwrite(p_img, sizeof(unsigned char), len, fp);
+    len_actual = fwrite(p_img, sizeof(unsigned char), (size_t)len, fp);
     
-    fclose(fp);
+    if (fclose(fp))
+        return -1;
     
     return (len != len_actual) ? -1 : 0;
 }
@@ -167,7 +183,7 @@ int writePGMImageFile (const char *p_filename, const unsigned char *p_img, int h
 // return:
 //     -1 : failed
 //      0 : success
-int loadBMPGrayImageFile (const char *p_filename, unsigned char *p_img, int *p_height, int *p_width) {
+int loadBMPGrayImageFile (const char *p_filename, unsigned char *p_img, int64_t size_limit, int *p_height, int *p_width) {
     int   bm, offset, color_plane, bpp, cmprs_method, align_skip, i;
     FILE *fp;
     
@@ -187,7 +203,7 @@ int loadBMPGrayImageFile (const char *p_filename, unsigned char *p_img, int *p_h
     bpp         = loadLittleEndian(2, fp);      // bits per pixel
     cmprs_method= loadLittleEndian(4, fp);      // compress method
     
-    if (bm != 0x4D42 || color_plane != 1 || bpp != 8 || cmprs_method != 0 || (*p_width) < 1 || (*p_height) < 1) {
+    if (bm != 0x4D42 || color_plane != 1 || bpp != 8 || cmprs_method != 0 || (*p_width) < 1 || (*p_height) < 1 || (int64_t)(*p_width) * (*p_height) > size_limit) {
         fclose(fp);
         return -1;
     }
@@ -213,7 +229,7 @@ int loadBMPGrayImageFile (const char *p_filename, unsigned char *p_img, int *p_h
     
     // load pixel data, note that the scan order of BMP is from down to up, from left to right --------
     for (i=(*p_height)-1; i>=0; i--) {
-        unsigned char *p_row = p_img + (i * (*p_width));
+        unsigned char *p_row = p_img + ((int64_t)i * (*p_width));
         if ((*p_width) != (int)fread(p_row, sizeof(unsigned char), (*p_width), fp)) {
             fclose(fp);
             return -1;
@@ -233,11 +249,11 @@ int loadBMPGrayImageFile (const char *p_filename, unsigned char *p_img, int *p_h
 int writeBMPGrayImageFile (const char *p_filename, const unsigned char *p_img, int height, int width) {
     const int align_width = ((width + BMP_ROW_ALIGN - 1) / BMP_ROW_ALIGN) * BMP_ROW_ALIGN;
     const int align_skip  = align_width - width;
-    const int file_size = 14 + 40 + 1024 + height * align_width;  // 14B BMP file header + 40B DIB header + 1024B palette + pixels
-    int   i;
+    const int64_t file_size = 14 + 40 + 1024 + (int64_t)height * align_width;  // 14B BMP file header + 40B DIB header + 1024B palette + pixels
+    int   i, failed = 0;
     FILE *fp;
     
-    if (width < 1 || height < 1)
+    if (width < 1 || height < 1 || file_size > 0xFFFFFFFF)     // the BMP file size field is 32-bit
         return -1;
     
     if ( (fp = fopen(p_filename, "wb")) == NULL )
@@ -245,7 +261,7 @@ int writeBMPGrayImageFile (const char *p_filename, const unsigned char *p_img, i
     
     // write 14B BMP file header -----------------------------------------------------------------------
     writeLittleEndian(    0x4D42, 2, fp);   // 'BM'
-    writeLittleEndian( file_size, 4, fp);   // whole file size
+    writeLittleEndian((int)file_size, 4, fp); // whole file size
     writeLittleEndian(0x00000000, 4, fp);   // reserved
     writeLittleEndian(0x00000436, 4, fp);   // start position of pixel data
     
@@ -272,16 +288,347 @@ int writeBMPGrayImageFile (const char *p_filename, const unsigned char *p_img, i
     
     // write pixel data, note that the scan order of BMP is from down to up, from left to right --------
     for (i=height-1; i>=0; i--) {
-        const unsigned char *p_row = p_img + (i * width);
-        fwrite(p_row, sizeof(unsigned char), width, fp);
+        const unsigned char *p_row = p_img + ((int64_t)i * width);
+        if (width != (int)fwrite(p_row, sizeof(unsigned char), width, fp))
+            failed = 1;
         writeLittleEndian(0x00000000, align_skip, fp);
     }
     
-    if (ftell(fp) < file_size) {
-        fclose(fp);
+    if (fclose(fp) || failed)                 // instead of checking ftell, which is 32-bit on some platforms
+        return -1;
+    
+    return 0;
+}
+
+
+
+#if defined(_WIN32)
+
+
+// return:
+//     -1 : failed (also for an empty file)
+//      0 : success
+int mapFileForRead (const char *p_filename, MappedFile_t *p_map, int64_t min_len) {
+    LARGE_INTEGER size;
+    
+    p_map->p_data = NULL;
+    p_map->h_map  = NULL;
+    p_map->h_file = CreateFileA(p_filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    
+    if (p_map->h_file == INVALID_HANDLE_VALUE)
+        return -1;
+    
+    if (!GetFileSizeEx(p_map->h_file, &size) || size.QuadPart <= 0 || (uint64_t)size.QuadPart > SIZE_MAX || (uint64_t)min_len > SIZE_MAX) {
+        CloseHandle(p_map->h_file);
+        return -1;
+    }
+    
+    p_map->len     = size.QuadPart;
+    p_map->map_len = (min_len > p_map->len) ? min_len : p_map->len;
+    
+    if (p_map->map_len > p_map->len) {                  // a view cannot be larger than the file, so read the file to a zeroed buffer
+        int64_t pos;
+        DWORD   n_read = 0;
+        p_map->p_data = (unsigned char*)VirtualAlloc(NULL, (size_t)p_map->map_len, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        for (pos=0; p_map->p_data != NULL && pos < p_map->len; pos+=n_read) {
+            DWORD n = (DWORD)(((p_map->len - pos) < 0x40000000) ? (p_map->len - pos) : 0x40000000);
+            if (!ReadFile(p_map->h_file, p_map->p_data + pos, n, &n_read, NULL) || n_read == 0) {
+                VirtualFree(p_map->p_data, 0, MEM_RELEASE);
+                p_map->p_data = NULL;
+            }
+        }
+        if (p_map->p_data == NULL) {
+            CloseHandle(p_map->h_file);
+            return -1;
+        }
+        return 0;
+    }
+    
+    p_map->h_map = CreateFileMappingA(p_map->h_file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    
+    if (p_map->h_map != NULL)
+        p_map->p_data = (unsigned char*)MapViewOfFile(p_map->h_map, FILE_MAP_COPY, 0, 0, 0);
+    
+    if (p_map->p_data == NULL) {
+        if (p_map->h_map != NULL)
+            CloseHandle(p_map->h_map);
+        CloseHandle(p_map->h_file);
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+// return:
+//     -1 : failed
+//      0 : success
+int mapFileForWrite (const char *p_filename, MappedFile_t *p_map, int64_t len) {
+    p_map->p_data  = NULL;
+    p_map->h_map   = NULL;
+    p_map->len     = len;
+    p_map->map_len = len;
+    
+    if (len <= 0 || (uint64_t)len > SIZE_MAX)
+        return -1;
+    
+    p_map->h_file = CreateFileA(p_filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    
+    if (p_map->h_file == INVALID_HANDLE_VALUE)
+        return -1;
+    
+    p_map->h_map = CreateFileMappingA(p_map->h_file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)len >> 32), (DWORD)len, NULL);
+    
+    if (p_map->h_map != NULL)
+        p_map->p_data = (unsigned char*)MapViewOfFile(p_map->h_map, FILE_MAP_WRITE, 0, 0, 0);
+    
+    if (p_map->p_data == NULL) {
+        if (p_map->h_map != NULL)
+            CloseHandle(p_map->h_map);
+        CloseHandle(p_map->h_file);
         return -1;
     }
     
-    fclose(fp);
     return 0;
 }
+
+
+// return:
+//     -1 : failed
+//      0 : success
+int unmapFile (MappedFile_t *p_map, int64_t file_len) {
+    int failed = 0;
+    
+    if (p_map->h_map == NULL) {                          // read to a buffer by mapFileForRead
+        VirtualFree(p_map->p_data, 0, MEM_RELEASE);
+    } else {
+        if (!UnmapViewOfFile(p_map->p_data))
+            failed = 1;
+        CloseHandle(p_map->h_map);
+    }
+    
+    if (file_len >= 0) {
+        LARGE_INTEGER pos;
+        pos.QuadPart = file_len;
+        if (!SetFilePointerEx(p_map->h_file, pos, NULL, FILE_BEGIN) || !SetEndOfFile(p_map->h_file))
+            failed = 1;
+    }
+    
+    if (!CloseHandle(p_map->h_file))
+        failed = 1;
+    
+    p_map->p_data = NULL;
+    
+    return failed ? -1 : 0;
+}
+
+
+#else
+
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+#if !defined(MAP_ANONYMOUS)
+#define   MAP_ANONYMOUS   MAP_ANON
+#endif
+
+#if !defined(MAP_NORESERVE)
+#define   MAP_NORESERVE   0
+#endif
+
+
+// return:
+//     -1 : failed (also for an empty file)
+//      0 : success
+int mapFileForRead (const char *p_filename, MappedFile_t *p_map, int64_t min_len) {
+    struct stat st;
+    void *p_data;
+    
+    p_map->p_data = NULL;
+    
+    if ( (p_map->fd = open(p_filename, O_RDONLY)) < 0 )
+        return -1;
+    
+    if (fstat(p_map->fd, &st) || st.st_size <= 0 || (uint64_t)st.st_size > SIZE_MAX || (uint64_t)min_len > SIZE_MAX) {
+        close(p_map->fd);
+        return -1;
+    }
+    
+    p_map->len     = st.st_size;
+    p_map->map_len = (min_len > p_map->len) ? min_len : p_map->len;
+    
+    // reserve zero pages of map_len bytes, and map the file over the start of them.
+    // the rest of the last page of the file is zero-filled by mmap, and the zero pages after it take no memory until read
+    p_data = mmap(NULL, (size_t)p_map->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    
+    if (p_data == MAP_FAILED) {
+        close(p_map->fd);
+        return -1;
+    }
+    
+    if (mmap(p_data, (size_t)p_map->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, p_map->fd, 0) == MAP_FAILED) {
+        munmap(p_data, (size_t)p_map->map_len);
+        close(p_map->fd);
+        return -1;
+    }
+    
+    p_map->p_data = (unsigned char*)p_data;
+    return 0;
+}
+
+
+// return:
+//     -1 : failed
+//      0 : success
+int mapFileForWrite (const char *p_filename, MappedFile_t *p_map, int64_t len) {
+    void *p_data;
+    
+    p_map->p_data  = NULL;
+    p_map->len     = len;
+    p_map->map_len = len;
+    
+    if (len <= 0 || (uint64_t)len > SIZE_MAX)
+        return -1;
+    
+    if ( (p_map->fd = open(p_filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 )
+        return -1;
+    
+    if (ftruncate(p_map->fd, (off_t)len)) {      // the file is sparse until the pages are written (on the file systems which support it)
+        close(p_map->fd);
+        return -1;
+    }
+    
+    p_data = mmap(NULL, (size_t)len, PROT_READ | PROT_WRITE, MAP_SHARED, p_map->fd, 0);
+    
+    if (p_data == MAP_FAILED) {
+        close(p_map->fd);
+        return -1;
+    }
+    
+    p_map->p_data = (unsigned char*)p_data;
+    return 0;
+}
+
+
+// return:
+//     -1 : failed
+//      0 : success
+int unmapFile (MappedFile_t *p_map, int64_t file_len) {
+    int failed = 0;
+    
+    if (munmap(p_map->p_data, (size_t)p_map->map_len))
+        failed = 1;
+    
+    if (file_len >= 0 && ftruncate(p_map->fd, (off_t)file_len))
+        failed = 1;
+    
+    if (close(p_map->fd))
+        failed = 1;
+    
+    p_map->p_data = NULL;
+    
+    return failed ? -1 : 0;
+}
+
+
+#endif
+
+
+
+// read a decimal number after the white chars, like fscanf("%d")
+// return:
+//     -1 : failed
+//      0 : success
+static int parseNumber (const unsigned char *p_data, int64_t len, int64_t *p_pos, int *p_value) {
+    int64_t value = 0;
+    
+    for (; *p_pos < len && (p_data[*p_pos] == ' ' || (p_data[*p_pos] >= '\t' && p_data[*p_pos] <= '\r')); (*p_pos)++);
+    
+    if (*p_pos >= len || p_data[*p_pos] < '0' || p_data[*p_pos] > '9')
+        return -1;
+    
+    for (; *p_pos < len && p_data[*p_pos] >= '0' && p_data[*p_pos] <= '9'; (*p_pos)++) {
+        value = value * 10 + (p_data[*p_pos] - '0');
+        if (value > 0x7FFFFFFF)
+            return -1;
+    }
+    
+    *p_value = (int)value;
+    return 0;
+}
+
+
+// return:
+//     -1             : failed
+//     positive value : the offset of the pixels
+int64_t parsePGMHeader (const unsigned char *p_data, int64_t len, int *p_height, int *p_width) {
+    int64_t pos = 2;
+    int     maxval = 0;
+    
+    (*p_height) = (*p_width) = -1;
+    
+    if (len < 2 || p_data[0] != 'P' || p_data[1] != '5')
+        return -1;
+    
+    if (parseNumber(p_data, len, &pos, p_width) || parseNumber(p_data, len, &pos, p_height) || parseNumber(p_data, len, &pos, &maxval))
+        return -1;
+    
+    if (maxval < 1 || maxval > 255)          // PGM pixel depth not support
+        return -1;
+    
+    if ((*p_width) < 1 || (*p_height) < 1)   // PGM size error
+        return -1;
+    
+    pos ++;                                  // skip a white char
+    
+    if (pos + (int64_t)(*p_width) * (*p_height) > len)
+        return -1;
+    
+    return pos;
+}
+
+
+// return:
+//     the header length
+int putPGMHeader (unsigned char *p_buf, int height, int width) {
+    return sprintf((char*)p_buf, "P5\n%d %d\n255\n", width, height);
+}
+
+
+// return:
+//     -1             : failed
+//     positive value : the offset of the pixels
+int64_t parseBMPGrayHeader (const unsigned char *p_data, int64_t len, int *p_height, int *p_width) {
+    int64_t offset, align_width;
+    
+    if (len < 34)                            // 14B BMP file header and the first 20B of DIB header
+        return -1;
+    
+    offset      = (uint32_t)getLittleEndian(p_data+10, 4);  // start position of pixel data
+    (*p_width)  = getLittleEndian(p_data+18, 4);
+    (*p_height) = getLittleEndian(p_data+22, 4);
+    
+    if (getLittleEndian(p_data, 2) != 0x4D42 || getLittleEndian(p_data+26, 2) != 1 || getLittleEndian(p_data+28, 2) != 8 || getLittleEndian(p_data+30, 4) != 0 || (*p_width) < 1 || (*p_height) < 1 || offset < 34)
+        return -1;
+    
+    align_width = (((*p_width) + BMP_ROW_ALIGN - 1) / BMP_ROW_ALIGN) * BMP_ROW_ALIGN;
+    
+    if (offset + align_width * ((*p_height) - 1) + (*p_width) > len)   // the padding of the last row can be omitted
+        return -1;
+    
+    return offset;
+}
+
+
+void copyBMPGrayPixels (unsigned char *p_img, const unsigned char *p_pixels, int height, int width) {
+    const int64_t align_width = ((width + BMP_ROW_ALIGN - 1) / BMP_ROW_ALIGN) * BMP_ROW_ALIGN;
+    int i;
+    
+    // the scan order of BMP is from down to up, from left to right
+    for (i=0; i<height; i++)
+        memcpy(p_img + (int64_t)(height-1-i) * width, p_pixels + align_width * i, width);
+}
@@ -3,22 +3,53 @@
 #define   __FILE_IO_H__
 
 
+#include <stdint.h>
+
+
+#if defined(_WIN32)
+
+#include <Windows.h>
+
+typedef struct {
+    unsigned char *p_data;
+    int64_t        len;                // the file length
+    int64_t        map_len;            // the mapped bytes, at least len
+    HANDLE         h_file;
+    HANDLE         h_map;              // NULL : the file is read into p_data, see mapFileForRead
+} MappedFile_t;
+
+#else
+
+typedef struct {
+    unsigned char *p_data;
+    int64_t        len;                // the file length
+    int64_t        map_len;            // the mapped bytes, at least len
+    int            fd;
+} MappedFile_t;
+
+#endif
+
+
+#define   PGM_MAX_HEADER_LEN   32
+
+
 // return:
 //     -1             : failed
 //     positive value : file length
-extern int loadBytesFromFile    (const char *p_filename,       unsigned char *p_buf, int len_limit);
+extern int64_t loadBytesFromFile (const char *p_filename,      unsigned char *p_buf, int64_t len_limit);
 
 
 // return:
 //     -1 : failed
 //      0 : success
-extern int writeBytesToFile     (const char *p_filename, const unsigned char *p_buf, int len);
+extern int writeBytesToFile     (const char *p_filename, const unsigned char *p_buf, int64_t len);
 
 
+// the image is loaded only if it has no more than size_limit pixels, which is the size of p_img
 // return:
 //     -1 : failed
 //      0 : success
-extern int loadPGMImageFile     (const char *p_filename,       unsigned char *p_img, int *p_height, int *p_width);
+extern int loadPGMImageFile     (const char *p_filename,       unsigned char *p_img, int64_t size_limit, int *p_height, int *p_width);
 
 
 // return:
@@ -27,10 +58,11 @@ extern int loadPGMImageFile     (const char *p_filename,       unsigned char *p_
 extern int writePGMImageFile    (const char *p_filename, const unsigned char *p_img, int height, int width);
 
 
+// the image is loaded only if it has no more than size_limit pixels, which is the size of p_img
 // return:
 //     -1 : failed
 //      0 : success
-extern int loadBMPGrayImageFile (const char *p_filename, unsigned char *p_img, int *p_height, int *p_width);
+extern int loadBMPGrayImageFile (const char *p_filename, unsigned char *p_img, int64_t size_limit, int *p_height, int *p_width);
 
 
 // return:
@@ -39,4 +71,54 @@ extern int loadBMPGrayImageFile (const char *p_filename, unsigned char *p_img, i
 extern int writeBMPGrayImageFile (const char *p_filename, const unsigned char *p_img, int height, int width);
 
 
+// map a whole file to memory, the pages are only read from the file when accessed.
+// the mapping is private (copy-on-write) : p_map->p_data can be written, but the file is not changed.
+// the mapping is at least min_len bytes, the bytes after the end of file are zeros. so that a decoder which reads past the end of
+// a truncated stream reads zeros instead of crashing. (on Windows, the file is read to a zeroed buffer if it is shorter than min_len)
+// return:
+//     -1 : failed (also for an empty file)
+//      0 : success
+extern int mapFileForRead       (const char *p_filename, MappedFile_t *p_map, int64_t min_len);
+
+
+// create (or truncate) a file of len bytes, and map it to memory. what is written to p_map->p_data goes to the file.
+// len can be an upper bound of the data size, see unmapFile. on POSIX the file is sparse until the pages are written,
+// but on Windows the whole len bytes are allocated on the disk until the file is truncated
+// return:
+//     -1 : failed
+//      0 : success
+extern int mapFileForWrite      (const char *p_filename, MappedFile_t *p_map, int64_t len);
+
+
+// unmap a file mapped by mapFileForRead or mapFileForWrite, and close it. if file_len >= 0, the file is truncated to file_len bytes.
+// return:
+//     -1 : failed
+//      0 : success
+extern int unmapFile            (MappedFile_t *p_map, int64_t file_len);
+
+
+// parse the header of a PGM file in memory
+// return:
+//     -1             : failed (not a gray 8-bit PGM, or len is shorter than the pixels)
+//     positive value : the offset of the pixels, which are height*width bytes in raster order
+extern int64_t parsePGMHeader   (const unsigned char *p_data, int64_t len, int *p_height, int *p_width);
+
+
+// put the header of a PGM file (at most PGM_MAX_HEADER_LEN bytes) to p_buf
+// return:
+//     the header length
+extern int putPGMHeader         (unsigned char *p_buf, int height, int width);
+
+
+// parse the header of a gray 8-bit BMP file in memory
+// return:
+//     -1             : failed (not a gray 8-bit BMP, or len is shorter than the pixels)
+//     positive value : the offset of the pixels, use copyBMPGrayPixels to get them in raster order
+extern int64_t parseBMPGrayHeader (const unsigned char *p_data, int64_t len, int *p_height, int *p_width);
+
+
+// copy the pixels of a BMP file (from the offset given by parseBMPGrayHeader), whose rows are from down to up and aligned, to p_img in raster order
+extern void copyBMPGrayPixels   (unsigned char *p_img, const unsigned char *p_pixels, int height, int width);
+
+
 #endif // __FILE_IO_H__
@@ -26,6 +26,7 @@
 #include <stdio.h>
 
 #include "NBLIC.h"
+#include "Thread.h"
 
 const char *title = "NBLIC0.3";
 
@@ -33,19 +34,36 @@ typedef    unsigned char          UI8;
 typedef    uint32_t               U32;
 typedef    int64_t                I64;
 
+// the per-pixel functions are always inlined, so that in the specialized instances of codeRow (see DEFINE_CODE_ROW),
+// the parameters which are compile-time constants there (decode, n, near) are folded, and the branches, loops, and divisions on them are removed.
+#if   defined(_MSC_VER)
+#define    FORCE_INLINE           static __forceinline
+#elif defined(__GNUC__)
+#define    FORCE_INLINE           static inline __attribute__((always_inline))
+#else
+#define    FORCE_INLINE           static inline
+#endif
+
+
+#define    ENABLE_SIMD            1                                                        // 1: the AVP accumulation uses AVX2 kernels when the compiler targets them (e.g. -mavx2)   0: always scalar
 
 #define    SWAP(type,a,b)         {type t; (t)=(a); (a)=(b); (b)=(t);}
 
 #define    ABS(x)                 ( ((x) < 0) ? (-(x)) : (x) )                             // get absolute value
 #define    CLIP(x,a,b)            ( ((x)<(a)) ? (a) : (((x)>(b)) ? (b) : (x)) )            // clip x between a~b
+#define    MIN(a,b)               ( ((a)<(b)) ? (a) : (b) )
+#define    MAX(a,b)               ( ((a)>(b)) ? (a) : (b) )
 
-#define    G2D(ptr,width,i,j)     (*( (ptr) + (width)*(i) + (j) ))
+#define    G2D(ptr,width,i,j)     (*( (ptr) + (I64)(width)*(i) + (j) ))                   // 64-bit offset, since an image can have more than 2^31 pixels
 #define    SPIX(ptr,width,i,j,v0) (((0<=(i)) && (0<=(j)) && ((j)<(width))) ? G2D((ptr),(width),(i),(j)) : (v0))
 
 #define    MAX_N_CHANNEL          1
 
 #define    MIN_EFFORT             1
-#define    MAX_EFFORT             3
+#define    MAX_EFFORT             4                  // the size of the effort tables, including FAST_AVP_EFFORT
+#define    MAX_LEVEL_EFFORT       3                  // the out-of-range efforts are clipped to MIN_EFFORT~MAX_LEVEL_EFFORT, as before the "2.5" level was added
+
+#define    CLIP_EFFORT(e)         (((e) == FAST_AVP_EFFORT) ? FAST_AVP_EFFORT : CLIP((e), MIN_EFFORT, MAX_LEVEL_EFFORT))    // FAST_AVP_EFFORT is only chosen explicitly
 
 #define    MAX_VAL                255
 #define    MID_VAL                ((MAX_VAL+1)/2)
@@ -83,9 +101,21 @@ typedef    int64_t                I64;
 #define    BIAS_MAX               (1024 << FB2)
 #define    BIAS_COEF              21
 
-#define    GET_M(n)               (1+(n)+(n)*(n))
+// the AVP statistics of a pixel (dataset) are : s , b (n items) , A (n x n). A is symmetric, and every operation on the statistics is item-wise,
+// so A[j][k] and A[k][j] always hold the same value, and only the upper triangle (j<=k) is stored, in row-major order.
+// this is exact : the stream is the same as storing the whole A. the items stay 64-bit, since the decayed sums of A over a row exceed 32 bits.
+#define    GET_M(n)               (1+(n)+(n)*((n)+1)/2)
+#define    TRI(n,j,k)             ((j)*(n) - (j)*((j)-1)/2 + ((k)-(j)))                    // the index of A[j][k] (j<=k) in the upper triangle
+
+const static int N_LIST [MAX_EFFORT+1] = {-1, 0, 6, 10, 10};
 
-const static int N_LIST [MAX_EFFORT+1] = {-1, 0, 6, 10};
+// effort=4 is the fast AVP level ("e2.5") : it has the AVP statistics of effort=3, but solves them with AVPpredictFast instead of AVPpredict
+#define    FAST_AVP_EFFORT        4
+#define    FAST_AVP_XB            6                  // the extra fraction bits of the solution x
+#define    FAST_AVP_X_MAX         ((I64)1 << 30)     // x is clipped to this range. it does not bound A*x, since A is only bounded by the pixel statistics
+#define    FAST_AVP_A_SAFE        (((I64)1 << 61) / (MAX_N * FAST_AVP_X_MAX))    // the sweeps cannot overflow if |A[i][j]| (i!=j) <= this and |r| <= 2^61, otherwise they saturate
+#define    FAST_AVP_REFRESH       4                  // x is solved by elimination every FAST_AVP_REFRESH columns
+#define    FAST_AVP_SWEEPS        1                  // Gauss-Seidel sweeps of the other pixels, which start from the solution of the pixel on the left
 
 #define    MAX_N                  10
 
@@ -161,7 +191,7 @@ static int AVPsolveAxb (int n, I64 *p_mat_A, I64 *p_vec_b) {
 }
 
 
-static void AVPgetVecN (I64 *vec_n, int n, int a, int b, int c, int d, int e, int f, int g, int h, int q, int r, int s, int t) {
+FORCE_INLINE void AVPgetVecN (I64 *vec_n, int n, int a, int b, int c, int d, int e, int f, int g, int h, int q, int r, int s, int t) {
     if (n > 0) vec_n[0] = a;
     if (n > 1) vec_n[1] = b;
     if (n > 2) vec_n[2] = c;
@@ -183,39 +213,264 @@ static void AVPgetVecN (I64 *vec_n, int n, int a, int b, int c, int d, int e, in
 }
 
 
-static void AVPprecalcuate (int m, I64 *p_F_row, I64 *p_B_row, int width) {
-    int j, k;
+// AVP accumulation kernels --------------------------------------------------------------------------------
+// all the AVP statistics decay as  v = (v*(ab-1) + ab/2) / ab  before a new item is added, where ab=BETA for item 0 and ab=ALPHA for the others.
+// AVPdecayAdd does this for items k_begin ~ m-1 with ab=ALPHA :  p_dst[k] = AVP_DECAY(p_src[k], ALPHA) + p_add[k]
+#define    AVP_DECAY(v,ab)        (((v) * ((ab)-1) + ((ab)>>1)) / (ab))
+
+#if        ENABLE_SIMD && defined(__AVX2__)
+
+#include <immintrin.h>
+
+// AVX2 has no 64-bit integer multiplication or division, so 4 items are converted to double, computed, and converted back.
+// when |v| < AVX_DECAY_RANGE, v*(ALPHA-1)+ALPHA/2 is exact in double, the correctly-rounded quotient is less than 1/ALPHA away from the exact one,
+// so truncating it gives exactly the integer quotient of C. the conversions add the magic number 1.5*2^52, which is exact for |v| < 2^51.
+// the groups having any item out of range (never seen in practice) use the scalar code.
+#define    AVX_DECAY_RANGE        (((I64)1) << 46)
+#define    AVX_MAGIC              0x4338000000000000LL                                     // bits of double 1.5*2^52
+
+FORCE_INLINE void AVPdecayAdd (I64 *p_dst, const I64 *p_src, const I64 *p_add, int k_begin, int m) {
+    const __m256i v_magic_i = _mm256_set1_epi64x(AVX_MAGIC);
+    const __m256d v_magic_d = _mm256_castsi256_pd(v_magic_i);
+    const __m256d v_mul     = _mm256_set1_pd((double)(ALPHA-1));
+    const __m256d v_rnd     = _mm256_set1_pd((double)(ALPHA>>1));
+    const __m256d v_div     = _mm256_set1_pd((double)ALPHA);
+    const __m256i v_max     = _mm256_set1_epi64x( AVX_DECAY_RANGE);
+    const __m256i v_min     = _mm256_set1_epi64x(-AVX_DECAY_RANGE);
+    int k = k_begin;
+    
+    for (; k+4<=m; k+=4) {
+        __m256i v   = _mm256_loadu_si256((const __m256i*)(p_src+k));
+        __m256i out = _mm256_or_si256(_mm256_cmpgt_epi64(v, v_max), _mm256_cmpgt_epi64(v_min, v));
+        
+        if (_mm256_testz_si256(out, out)) {
+            __m256d d = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_add_epi64(v, v_magic_i)), v_magic_d);
+            d = _mm256_div_pd(_mm256_add_pd(_mm256_mul_pd(d, v_mul), v_rnd), v_div);
+            d = _mm256_round_pd(d, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+            v = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(d, v_magic_d)), v_magic_i);
+            v = _mm256_add_epi64(v, _mm256_loadu_si256((const __m256i*)(p_add+k)));
+            _mm256_storeu_si256((__m256i*)(p_dst+k), v);
+        } else {
+            int kk;
+            for (kk=k; kk<k+4; kk++)
+                p_dst[kk] = AVP_DECAY(p_src[kk], ALPHA) + p_add[kk];
+        }
+    }
+    
+    for (; k<m; k++)
+        p_dst[k] = AVP_DECAY(p_src[k], ALPHA) + p_add[k];
+}
+
+
+// p_sum[k] = p_E[k] + p_F[k] for k = 1 ~ m-1
+FORCE_INLINE void AVPsumEF (int m, I64 *p_E, I64 *p_F, I64 *p_sum) {
+    int k = 1;
+    
+    for (; k+4<=m; k+=4) {
+        __m256i v = _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)(p_E+k)), _mm256_loadu_si256((const __m256i*)(p_F+k)));
+        _mm256_storeu_si256((__m256i*)(p_sum+k), v);
+    }
+    
+    for (; k<m; k++)
+        p_sum[k] = p_E[k] + p_F[k];
+}
+
+#else
+
+FORCE_INLINE void AVPdecayAdd (I64 *p_dst, const I64 *p_src, const I64 *p_add, int k_begin, int m) {
+    int k;
+    for (k=k_begin; k<m; k++)
+        p_dst[k] = AVP_DECAY(p_src[k], ALPHA) + p_add[k];
+}
+
+
+// p_sum[k] = p_E[k] + p_F[k] for k = 1 ~ m-1
+FORCE_INLINE void AVPsumEF (int m, I64 *p_E, I64 *p_F, I64 *p_sum) {
+    int k;
+    for (k=1; k<m; k++)
+        p_sum[k] = p_E[k] + p_F[k];
+}
+
+#endif
+
+
+// F of column j is the decayed sum of B of columns j ~ j_end-1. the normal stream uses j_end=width for the whole row.
+// compute F of columns j_begin ~ j_end-1 into p_F_win, where F of column j is at p_F_win + m*(j-j_begin)
+static void AVPprecalcuate (int m, I64 *p_F_win, I64 *p_B_row, int j_begin, int j_end) {
+    int j;
     
-    for (j=width-1; j>=0; j--) {
+    COPY_ARRAY(p_F_win + m*(j_end-1-j_begin), p_B_row + m*(j_end-1), m);
+    
+    for (j=j_end-2; j>=j_begin; j--) {
         I64 *p_B  = p_B_row + (m * j);
-        I64 *p_F  = p_F_row + (m * j);
-        I64 *p_F2 = p_F_row + (m *(j+1));
-        int ab = BETA;
-        
-        for (k=0; k<m; k++) {
-            if (j == width-1)
-                p_F[k] = 0;
-            else
-                p_F[k] = (p_F2[k] * (ab-1) + ab/2) / ab;
-            p_F[k] += p_B[k];
-            ab = ALPHA;
+        I64 *p_F  = p_F_win + (m * (j-j_begin));
+        I64 *p_F2 = p_F + m;
+        
+        p_F[0] = AVP_DECAY(p_F2[0], BETA) + p_B[0];
+        AVPdecayAdd(p_F, p_F2, p_B, 1, m);
+    }
+}
+
+
+// division by an invariant divisor : in the AVP solver kernels, many dividends are divided by the same pivot.
+// divideBy gives exactly the same quotient as "/" (truncated toward zero), with a multiplication by a magic number (Granlund & Montgomery)
+// which is much faster than a 64-bit division. on the compilers without 128-bit integers, it falls back to "/".
+#if defined(__SIZEOF_INT128__)
+
+typedef struct {
+    uint64_t magic;      // 0 : the divisor is a power of 2
+    int      shift;
+    int      add;        // 1 : the magic number needs 65 bits, its top bit is added back with the "add" fixup
+    int      neg;        // 1 : the divisor is negative
+} Divisor_t;
+
+static void initDivisor (Divisor_t *p_div, I64 d) {
+    uint64_t ud = (d < 0) ? (0 - (uint64_t)d) : (uint64_t)d;
+    int      l  = 63 - __builtin_clzll(ud);                  // floor(log2(ud)), the compilers which have __int128 also have this builtin
+    p_div->neg = (d < 0);
+    p_div->shift = l;
+    p_div->add   = 0;
+    if ((ud & (ud-1)) == 0) {
+        p_div->magic = 0;
+    } else {
+        uint64_t m = (uint64_t)((((unsigned __int128)1) << (64+l)) / ud);
+        uint64_t rem = (uint64_t)0 - m * ud;                     // = 2^(64+l) mod ud
+        if (ud - rem < (((uint64_t)1) << l)) {
+            m ++;
+        } else {
+            uint64_t rem2 = rem + rem;
+            m += m;
+            if (rem2 >= ud || rem2 < rem)
+                m ++;
+            m ++;
+            p_div->add = 1;
         }
+        p_div->magic = m;
+    }
+}
+
+static I64 divideBy (const Divisor_t *p_div, I64 n) {
+    uint64_t un = (n < 0) ? (0 - (uint64_t)n) : (uint64_t)n;
+    uint64_t uq;
+    if (p_div->magic == 0) {
+        uq = un >> p_div->shift;
+    } else {
+        uint64_t hi = (uint64_t)(((unsigned __int128)un * p_div->magic) >> 64);
+        if (p_div->add)
+            uq = (((un - hi) >> 1) + hi) >> p_div->shift;
+        else
+            uq = hi >> p_div->shift;
     }
+    return ((n < 0) != p_div->neg) ? -(I64)uq : (I64)uq;
+}
+
+#else
+
+typedef struct {
+    I64 d;
+} Divisor_t;
+
+static void initDivisor (Divisor_t *p_div, I64 d) {
+    p_div->d = d;
+}
+
+static I64 divideBy (const Divisor_t *p_div, I64 n) {
+    return n / p_div->d;
 }
 
+#endif
 
+
+// AVP solver kernel specialized for a compile-time n=N : solve (A + bias*N*I) x = (b + (bias<<FB3)), then get the prediction.
+// it does exactly the same arithmetic as AVPsolveAxb followed by the prediction in AVPpredict, so the result is bit-identical. the differences are :
+//   - the loops have constant trip counts, so they are unrolled by the compiler.
+//   - b is stored as the column N of the matrix, and the row swaps are done by swapping row pointers instead of copying.
+//   - the "if (Aik != 0)" skips are removed, since subtracting Akj*0/Akk=0 changes nothing.
+//   - the divisions by the pivot use divideBy.
+//   - the elements below the diagonal are not cleared, since they are never read again.
+// p_sum : b and A (= E + F) without bias, in the layout of dataset+1 (A is the upper triangle, and is unpacked to the whole matrix here)
 // return:
 //      0 : failed
 //      1 : success
-static int AVPpredict (int n, int m, I64 *p_E, I64 *p_F, I64 *vec_n, I64 bias, I64 *p_px) {
-    int k;
+#define DEFINE_AVP_SOLVE_KERNEL(N)                                                           \
+static int AVPsolveKernel##N (const I64 *p_sum, const I64 *vec_n, I64 bias, I64 *p_px, I64 *vec_x) {  \
+    I64  mat [N][N+1];                                                                       \
+    I64 *row [N];                                                                            \
+    I64  px = FIT_BASE << FB1;                                                               \
+    Divisor_t div;                                                                           \
+    int  i, j, k, kk;                                                                        \
+                                                                                             \
+    for (i=0, k=N; i<N; i++) {                                                               \
+        for (j=i; j<N; j++, k++)                                                             \
+            mat[i][j] = mat[j][i] = p_sum[k];                                                \
+        mat[i][i] += bias * N;                                                               \
+        mat[i][N]  = p_sum[i] + (bias << FB3);                                               \
+        row[i] = mat[i];                                                                     \
+    }                                                                                        \
+                                                                                             \
+    for (k=0; k<(N-1); k++) {                                                                \
+        I64 *rk;                                                                             \
+        kk = k;                                                                              \
+        for (i=k+1; i<N; i++)                                                                \
+            if (ABS(row[i][k]) > ABS(row[kk][k]))                                            \
+                kk = i;                                                                      \
+        SWAP(I64*, row[k], row[kk]);                                                         \
+        rk = row[k];                                                                         \
+        if (rk[k] == 0) return 0;                                                            \
+        initDivisor(&div, rk[k]);                                                            \
+        for (i=k+1; i<N; i++) {                                                              \
+            I64 *ri  = row[i];                                                               \
+            I64  Aik = ri[k];                                                                \
+            for (j=k+1; j<=N; j++)                                                           \
+                ri[j] -= divideBy(&div, rk[j] * Aik);                                        \
+        }                                                                                    \
+    }                                                                                        \
+                                                                                             \
+    for (k=(N-1); k>0; k--) {                                                                \
+        I64 *rk = row[k];                                                                    \
+        if (rk[k] == 0) return 0;                                                            \
+        initDivisor(&div, rk[k]);                                                            \
+        for (i=0; i<k; i++)                                                                  \
+            row[i][N] -= divideBy(&div, rk[N] * row[i][k]);                                  \
+    }                                                                                        \
+                                                                                             \
+    for (k=0; k<N; k++)                                                                      \
+        px += (((row[k][N] * vec_n[k]) << FB2) + (row[k][k]>>1)) / row[k][k];                \
+                                                                                             \
+    if (vec_x != NULL)                                                                       \
+        for (k=0; k<N; k++)                                                                  \
+            vec_x[k] = ((row[k][N] << FAST_AVP_XB) + (row[k][k]>>1)) / row[k][k];            \
+                                                                                             \
+    *p_px = CLIP(px, 0, (MAX_VAL<<FB1));                                                     \
+                                                                                             \
+    return 1;                                                                                \
+}
+
+DEFINE_AVP_SOLVE_KERNEL(6)      // N_LIST[2]
+DEFINE_AVP_SOLVE_KERNEL(10)     // N_LIST[3]
+
+
+// p_sum : the sum of E and F from AVPsumEF, which is shared by the predictions of both bias candidates. it has the layout of dataset
+// return:
+//      0 : failed
+//      1 : success
+FORCE_INLINE int AVPpredict (int n, const I64 *p_sum, I64 *vec_n, I64 bias, I64 *p_px) {
+    int j, k;
     
-    I64  dataset [GET_M(MAX_N)];
-    I64 *vec_b = dataset + 1;
-    I64 *mat_A = dataset + 1 + n;
+    I64  vec_b [MAX_N];
+    I64  mat_A [MAX_N*MAX_N];
     
-    for (k=1; k<m; k++)
-        dataset[k] = p_E[k] + p_F[k];
+    if (n == 6)
+        return AVPsolveKernel6 (p_sum+1, vec_n, bias, p_px, NULL);
+    else if (n == 10)
+        return AVPsolveKernel10(p_sum+1, vec_n, bias, p_px, NULL);
+    
+    for (k=0; k<n; k++)
+        vec_b[k] = p_sum[1+k];
+    
+    for (j=0; j<n; j++)                                        // unpack the upper triangle
+        for (k=j; k<n; k++)
+            G2D(mat_A, n, j, k) = G2D(mat_A, n, k, j) = p_sum[1+n+TRI(n,j,k)];
     
     for (k=0; k<n; k++) {
         vec_b[k]            += bias << FB3;
@@ -239,9 +494,100 @@ static int AVPpredict (int n, int m, I64 *p_E, I64 *p_F, I64 *vec_n, I64 bias, I
 }
 
 
-static void AVPupdate (int n, int m, I64 *p_E, I64 *p_B, I64 *vec_n, int x, I64 s_curr, I64 s_sum) {
-    int j, k, ab;
+// saturating I64 arithmetic, equal to a*b and a+b when they do not overflow (|a|, |b| <= INT64_MAX)
+static I64 satMul (I64 a, I64 b) {
+    if (a != 0 && ABS(b) > INT64_MAX / ABS(a))
+        return ((a < 0) != (b < 0)) ? -INT64_MAX : INT64_MAX;
+    return a * b;
+}
+
+
+static I64 satAdd (I64 a, I64 b) {
+    if (b > 0 && a > INT64_MAX - b)
+        return INT64_MAX;
+    if (b < 0 && a < -INT64_MAX - b)
+        return -INT64_MAX;
+    return a + b;
+}
+
+
+// the fast AVP solver (effort=FAST_AVP_EFFORT, n=10). the system (A + bias*n*I) x = (b + (bias<<FB3)) of neighbouring pixels differs only slightly,
+// so instead of eliminating it from scratch twice (for bias1 and bias2) :
+//   - x of bias1 starts from the solution of the pixel on the left (vec_x), and is refined by a Gauss-Seidel sweep.
+//     the matrix is symmetric and positive definite, so the sweeps converge, but slowly, since the neighbour pixels are strongly correlated.
+//     so x is refreshed by the elimination (AVPsolveKernel10) every few pixels, which also keeps the drift of the integer sweeps small.
+//   - the solution of bias2 is estimated from x by one Jacobi step, which is enough to tell whether bias2 predicts better than bias1 :
+//         x2 = x + dx ,  where dx[k] = ((bias2-bias1)<<FB3 - (bias2-bias1)*n*x[k]) / (the diagonal of the bias2 system)
+// p_sum   : the sum of E and F from AVPsumEF, which has the layout of dataset
+// refresh : 1 : solve x by the elimination    0 : x starts from vec_x (which is 0 if there is no previous solution)
+// vec_x   : the solution with FAST_AVP_XB extra fraction bits, which is updated to the solution of bias1
+// vec_dx  : returns dx
+// return:
+//      0 : failed (vec_x is not valid)
+//      1 : success
+static int AVPpredictFast (int n, const I64 *p_sum, const I64 *vec_n, I64 bias1, I64 bias2, int refresh, I64 *vec_x, I64 *vec_dx, I64 *p_px1, I64 *p_px2) {
+    I64  mat [MAX_N][MAX_N];
+    I64  vec_r [MAX_N];
+    Divisor_t div [MAX_N];
+    I64  dbias = bias2 - bias1, px1 = 0, px2 = 0;
+    int  i, j, k, n_sweep = FAST_AVP_SWEEPS, safe = 1;
+    
+    if (refresh && AVPsolveKernel10(p_sum+1, vec_n, bias1, &px1, vec_x))    // if the elimination fails, x is still refined from vec_x
+        n_sweep = 0;
+    
+    for (i=0, k=1+n; i<n; i++) {
+        for (j=i; j<n; j++, k++) {
+            mat[i][j] = mat[j][i] = p_sum[k];
+            if (j != i && ABS(p_sum[k]) > FAST_AVP_A_SAFE)
+                safe = 0;
+        }
+        mat[i][i] += bias1 * n;
+        vec_r[i]   = satAdd(p_sum[1+i], (bias1 << FB3));
+        vec_r[i]   = CLIP(vec_r[i], -(INT64_MAX >> FAST_AVP_XB), (INT64_MAX >> FAST_AVP_XB)) << FAST_AVP_XB;   // only clipped if the shift would overflow
+        if (ABS(vec_r[i]) > ((I64)1 << 61))
+            safe = 0;
+        if (mat[i][i] <= 0) return 0;
+        if (n_sweep > 0)
+            initDivisor(&div[i], mat[i][i]);
+    }
+    
+    for (; n_sweep>0; n_sweep--) {
+        for (i=0; i<n; i++) {
+            I64 acc = vec_r[i];
+            if (safe) {
+                for (j=0; j<n; j++)
+                    if (j != i)
+                        acc -= mat[i][j] * vec_x[j];
+            } else {                                           // adversarial statistics : saturate instead of overflow, which gives the same result when nothing overflows
+                for (j=0; j<n; j++)
+                    if (j != i)
+                        acc = satAdd(acc, -satMul(mat[i][j], vec_x[j]));
+            }
+            vec_x[i] = divideBy(&div[i], acc);
+            vec_x[i] = CLIP(vec_x[i], -FAST_AVP_X_MAX, FAST_AVP_X_MAX);
+        }
+    }
+    
+    for (px1=0, i=0; i<n; i++) {
+        vec_dx[i] = ((dbias << (FB3+FAST_AVP_XB)) - dbias * n * vec_x[i]) / (mat[i][i] + dbias * n);
+        px1 += vec_x[i] * vec_n[i];
+        px2 += (vec_x[i] + vec_dx[i]) * vec_n[i];
+    }
+    
+    px1 = (FIT_BASE << FB1) + ((px1 * (1<<FB2) + (1<<FAST_AVP_XB>>1)) >> FAST_AVP_XB);
+    px2 = (FIT_BASE << FB1) + ((px2 * (1<<FB2) + (1<<FAST_AVP_XB>>1)) >> FAST_AVP_XB);
+    
+    *p_px1 = CLIP(px1, 0, (MAX_VAL<<FB1));
+    *p_px2 = CLIP(px2, 0, (MAX_VAL<<FB1));
+    
+    return 1;
+}
+
+
+FORCE_INLINE void AVPupdate (int n, int m, I64 *p_E, I64 *p_B, I64 *vec_n, int x, I64 s_curr, I64 s_sum) {
+    int j, k;
     
+    Divisor_t div;
     I64  s_sum_2;
     I64  dataset [GET_M(MAX_N)];
     I64 *vec_b = dataset + 1;
@@ -254,12 +600,14 @@ static void AVPupdate (int n, int m, I64 *p_E, I64 *p_B, I64 *vec_n, int x, I64
     s_sum = CLIP((s_sum+(1<<FB1)), (1<<FB1), (16<<FB1));
     s_sum_2 = s_sum >> 1;
     
+    initDivisor(&div, s_sum);                                  // all the items are divided by s_sum
+    
     for (k=0; k<n; k++)
-        vec_b[k]                = (((       x * vec_n[k]) << (4+FB1+FB1)) + s_sum_2) / s_sum;   // b = x * n
+        vec_b[k]                = divideBy(&div, ((       x * vec_n[k]) << (4+FB1+FB1)) + s_sum_2);   // b = x * n
     
-    for (j=0; j<n; j++)
-        for (k=0; k<n; k++)
-            G2D(mat_A, n, j, k) = (((vec_n[j] * vec_n[k]) << (4+FB2+FB1)) + s_sum_2) / s_sum;   // A = n * n.T
+    for (j=0; j<n; j++)                                        // A = n * n.T is symmetric, only the upper triangle is stored
+        for (k=j; k<n; k++)
+            mat_A[TRI(n,j,k)]   = divideBy(&div, ((vec_n[j] * vec_n[k]) << (4+FB2+FB1)) + s_sum_2);
     
     //for (k=0; k<n; k++)
     //    vec_b[k]                = ((       x * vec_n[k]) << FB1);   // b = x * n
@@ -267,24 +615,15 @@ static void AVPupdate (int n, int m, I64 *p_E, I64 *p_B, I64 *vec_n, int x, I64
     //    for (k=0; k<n; k++)
     //        G2D(mat_A, n, j, k) = ((vec_n[j] * vec_n[k]) << FB2);   // A = n * n.T
     
-    ab = BETA;
-    
-    for (k=0; k<m; k++) {
-        p_B[k] *= (ab-1);
-        p_B[k] += (ab>>1);
-        p_B[k] /= ab;
-        p_B[k] += dataset[k];
-        p_E[k] *= (ab-1);
-        p_E[k] += (ab>>1);
-        p_E[k] /= ab;
-        p_E[k] += p_B[k];
-        ab = ALPHA;
-    }
+    p_B[0] = AVP_DECAY(p_B[0], BETA) + dataset[0];
+    p_E[0] = AVP_DECAY(p_E[0], BETA) + p_B[0];
+    AVPdecayAdd(p_B, p_B, dataset, 1, m);
+    AVPdecayAdd(p_E, p_E, p_B    , 1, m);
 }
 
 
 
-static void sampleNeighbourPixels (UI8 *p_img, int width, int i, int j, int *p_a, int *p_b, int *p_c, int *p_d, int *p_e, int *p_f, int *p_g, int *p_h, int *p_q, int *p_r, int *p_s, int *p_t) {
+static void sampleNeighbourPixels (const UI8 *p_img, int width, int i, int j, int *p_a, int *p_b, int *p_c, int *p_d, int *p_e, int *p_f, int *p_g, int *p_h, int *p_q, int *p_r, int *p_s, int *p_t) {
     *p_a = (int)SPIX(p_img, width, i   , j-1 , MID_VAL);
     *p_b = (int)SPIX(p_img, width, i-1 , j   , MID_VAL);
     if      (i == 0)
@@ -304,6 +643,26 @@ static void sampleNeighbourPixels (UI8 *p_img, int width, int i, int j, int *p_a
 }
 
 
+
+// line buffer : holds the last 3 rows of the reconstructed image, row i is in line (i%3), each line has ROW_PAD pixels on each side.
+// for the rows>=2, padLines sets the paddings so that the fixed-offset neighbours equal to sampleNeighbourPixels without bounds checks.
+// note that e at j=1 is pc[0] instead of pc[-1], so pc[-1] must be set to x after the pixel j=0 is coded.
+#define    ROW_PAD                2
+#define    LINE_LEN(width)        ((width) + 2*ROW_PAD)
+#define    LINE(p_lines,width,i)  ((p_lines) + ((i)%3) * LINE_LEN(width) + ROW_PAD)
+
+static void padLines (UI8 *p_lines, int width, int i) {
+    UI8 *pc = LINE(p_lines, width, i  );
+    UI8 *p1 = LINE(p_lines, width, i-1);
+    UI8 *p2 = LINE(p_lines, width, i-2);
+    pc[-2] = pc[-1] = p1[0];
+    p1[-2] = p1[-1] = p1[0];
+    p2[-2] = p2[-1] = p2[0];
+    p1[width+1] = p1[width] = p1[width-1];
+    p2[width+1] = p2[width] = p2[width-1];
+}
+
+
 static int simplePredict (int a, int b, int c, int d, int e, int f, int g, int h, int q, int r, int s) {
     const static int c_thresholds [] = {1*(MAX_VAL/8), 3*(MAX_VAL/8), 9*(MAX_VAL/8), 20*(MAX_VAL/8), 50*(MAX_VAL/8), 110*(MAX_VAL/8), 300*(MAX_VAL/8), 800*(MAX_VAL/8)};
     
@@ -418,17 +777,17 @@ static int correctPxByContext (int ctx_item, int px, int *p_sign) {
 }
 
 
-static void updateContext (int *p_ctx_item, int err) {
+static void updateContext (int16_t *p_ctx_item, int err) {
     int v = (*p_ctx_item);
     v  *= ((1<<CTX_COEF)-1);
     v  += (err << CTX_SCALE);
     v  += (1 << (CTX_COEF-1));
     v >>= CTX_COEF;
-    (*p_ctx_item) = v;
+    (*p_ctx_item) = (int16_t)v;                  // |v| <= MAX_PX_INC<<CTX_SCALE, fits 16 bits
 }
 
 
-static int mapXtoY (int x, int px, int sign, int near) {
+FORCE_INLINE int mapXtoY (int x, int px, int sign, int near) {
     const int ty = (CLIP(px, 0, MAX_VAL - px) + near) / (2*near + 1);
     int sy = (x >= px) ? 1 : 0;
     int y  = ABS(x - px);
@@ -444,7 +803,7 @@ static int mapXtoY (int x, int px, int sign, int near) {
 }
 
 
-static int mapYtoX (int z, int px, int sign, int near) {
+FORCE_INLINE int mapYtoX (int z, int px, int sign, int near) {
     const int ty = (CLIP(px, 0, MAX_VAL - px) + near) / (2*near + 1);
     int y, sy;
     
@@ -467,10 +826,16 @@ static int mapYtoX (int z, int px, int sign, int near) {
 
 
 
+// the histogram and z2y of a z are packed in a word : (hist[z] << MAPPER_Y_BITS) | z2y[z] , so a swap of two z moves two words.
+// hist[z] counts the pixels of this mapper in the high 27 bits. a large image can have more pixels, so all the counts of a mapper are halved
+// when one of them would overflow (which never happens to an image of less than 2^27 pixels). halving keeps their order, so no swap is needed.
+#define    MAPPER_Y_BITS          5
+#define    MAPPER_Y_MASK          ((1<<MAPPER_Y_BITS)-1)
+#define    MAPPER_H_MAX           (0xFFFFFFFFU >> MAPPER_Y_BITS)
+
 typedef struct {
-    UI8 y2z  [N_MAPPER];
-    UI8 z2y  [N_MAPPER];
-    int hist [N_MAPPER];
+    UI8 y2z [N_MAPPER];
+    U32 zh  [N_MAPPER];
 } AutoMapper_t;
 
 
@@ -478,8 +843,7 @@ static void initAutoMapper (AutoMapper_t *p_map) {
     int i;
     for (i=0; i<N_MAPPER; i++) {
         p_map->y2z[i] = (UI8)i;
-        p_map->z2y[i] = (UI8)i;
-        p_map->hist[i] = (N_MAPPER - 1 - i) * 2;
+        p_map->zh [i] = ((U32)(N_MAPPER - 1 - i) * 2 << MAPPER_Y_BITS) | (U32)i;
     }
 }
 
@@ -490,33 +854,36 @@ static int mapYtoZ (AutoMapper_t *p_map, int y) {
 
 
 static int mapZtoY (AutoMapper_t *p_map, int z) {
-    return (z < N_MAPPER) ? p_map->z2y[z] : z;
+    return (z < N_MAPPER) ? (int)(p_map->zh[z] & MAPPER_Y_MASK) : z;
 }
 
 
 static void addY (AutoMapper_t *p_map, int y) {
     if (y < N_MAPPER) {
-        UI8 z, z2, y2;
-        int h, h2;
+        UI8 z, z2;
+        U32 h, h2;
         
         z = p_map->y2z[y];
         
-        p_map->hist[z] ++;
+        if ((p_map->zh[z] >> MAPPER_Y_BITS) == MAPPER_H_MAX) {
+            int i;
+            for (i=0; i<N_MAPPER; i++)
+                p_map->zh[i] = ((p_map->zh[i] >> (MAPPER_Y_BITS+1)) << MAPPER_Y_BITS) | (p_map->zh[i] & MAPPER_Y_MASK);
+        }
+        
+        p_map->zh[z] += (1 << MAPPER_Y_BITS);
         
         if (z > 0) {
             z2 = z - 1;
-            y2 = p_map->z2y[z2];
             
-            h  = p_map->hist[z];
-            h2 = p_map->hist[z2];
+            h  = p_map->zh[z];
+            h2 = p_map->zh[z2];
             
-            if (h2 < h) {
-                p_map->hist[z ] = h2;
-                p_map->hist[z2] = h;
-                p_map->z2y [z ] = y2;
-                p_map->z2y [z2] = (UI8)y;
-                p_map->y2z [y ] = z2;
-                p_map->y2z [y2] = z;
+            if ((h2 >> MAPPER_Y_BITS) < (h >> MAPPER_Y_BITS)) {
+                p_map->zh [z ] = h2;
+                p_map->zh [z2] = h;
+                p_map->y2z[y ] = z2;
+                p_map->y2z[h2 & MAPPER_Y_MASK] = z;
             }
         }
     }
@@ -524,17 +891,55 @@ static void addY (AutoMapper_t *p_map, int y) {
 
 
 
+// Pipelined encoder : when encoding, the bins and their probabilities do not depend on the state of the range coder,
+// so the modeling (the calling thread) can send them as records to a coder thread, through a ring of chunks.
+// the coder thread runs binCodec on the records in the same order, so the stream is the same as the direct encoder.
+#define    BQ_CHUNK_LEN           4096                 // records per chunk
+#define    BQ_N_CHUNK             8
+
+typedef struct {
+    uint16_t   *p_rec;                                 // [BQ_N_CHUNK][BQ_CHUNK_LEN], each record is (prob<<1)|bin
+    int         chunk_len [BQ_N_CHUNK];                // the record count of each sent chunk, a chunk shorter than BQ_CHUNK_LEN is the last one
+    int         i_chunk;                               // the chunk being filled by the modeling
+    int         i_rec;
+    Semaphore_t sem_full;                              // the chunks sent to the coder thread
+    Semaphore_t sem_free;                              // the chunks returned by the coder thread
+    Thread_t    thread;
+    UI8        *p_buf;                                 // the start of the stream
+    UI8        *p_buf_end;                             // the end of the stream, set by the coder thread after flushing
+} BinQueue_t;
+
+
+// the callback I/O of the streaming encoder (see NBLICencoder_t) and decoder (see NBLICdecoder_t) : the stream is written to a small chunk buffer,
+// which is sent to the write callback when it is full. or the stream is read from a chunk buffer, which is refilled by the read callback when it is used up.
+#define    STREAM_CHUNK           4096
+
+typedef struct {
+    NBLICwrite_t p_write;     // the encoder
+    NBLICread_t  p_read;      // the decoder
+    void        *p_user;
+    UI8         *p_chunk;     // the start of the chunk buffer
+    I64          n_byte;      // the bytes sent to or got from the callback
+    int          err;         // 1 : the callback failed. the following bytes are dropped when encoding, or are zeros when decoding
+} ChunkIO_t;
+
+
 typedef struct {
     UI8 *p_buf;
     U32  v1;      // Range, initially [0, 1), scaled by 2^32
     U32  v2;
     U32  v;       // last 4 input bytes of compressed stream (only for decode)
     UI8  decode;  // 1:decode    0:encode
+    UI8  fast_prob;       // 1:the division-free probability model (see AriCodecFast)    0:the counters
+    UI8  multi_sym;       // 1:z is coded with multi-symbol frequency tables (see ZcodecMulti)    0:binarized
+    BinQueue_t *p_queue;  // the pipelined encoder : the bins are sent to the coder thread instead of being coded here (NULL : not pipelined)
+    UI8 *p_buf_lim;       // the streaming encoder or decoder : when p_buf reaches it, the chunk buffer is sent to or refilled by p_io (NULL : no limit)
+    ChunkIO_t  *p_io;
 } CODEC_t;
 
 
 static CODEC_t newCodec (int decode, UI8 *p_buf) {
-    CODEC_t codec = {NULL, 0, 0xFFFFFFFF, 0, 0};
+    CODEC_t codec = {NULL, 0, 0xFFFFFFFF, 0, 0, 0, 0, NULL, NULL, NULL};
     codec.decode  = (UI8)decode;
     codec.p_buf   = p_buf;
     
@@ -549,10 +954,76 @@ static CODEC_t newCodec (int decode, UI8 *p_buf) {
 }
 
 
-static void binCodec (CODEC_t *p_co, int *p_bin, U32 prob) {
-    U32 vm = p_co->v1 + ((p_co->v2-p_co->v1)>>12)*prob + (((p_co->v2-p_co->v1)&0xfff)*prob>>12);
+static void binQueueSend (BinQueue_t *p_q);
+
+
+// send the bytes in the chunk buffer to the callback, and restart the chunk buffer
+static void chunkWrite (CODEC_t *p_co) {
+    ChunkIO_t *p_io = p_co->p_io;
+    int n_byte = p_co->p_buf - p_io->p_chunk;
+    if (n_byte > 0 && !p_io->err) {
+        if (p_io->p_write(p_io->p_user, p_io->p_chunk, n_byte))
+            p_io->err = 1;
+        p_io->n_byte += n_byte;
+    }
+    p_co->p_buf = p_io->p_chunk;
+}
+
+
+// fill the chunk buffer (of STREAM_CHUNK bytes) by the read callback, and restart reading from it. the bytes after the end of the input are zeros
+static void chunkRead (CODEC_t *p_co) {
+    ChunkIO_t *p_io = p_co->p_io;
+    int n_byte = 0, n;
+    while (n_byte < STREAM_CHUNK && !p_io->err) {
+        n = p_io->p_read(p_io->p_user, p_io->p_chunk + n_byte, STREAM_CHUNK - n_byte);
+        if (n <= 0) {
+            p_io->err = (n < 0);
+            break;
+        }
+        n_byte += n;
+    }
+    p_io->n_byte += n_byte;
+    for (n=n_byte; n<STREAM_CHUNK; n++)
+        p_io->p_chunk[n] = 0;
+    p_co->p_buf = p_io->p_chunk;
+}
+
+
+// shift out (or in, when decoding) the equal top bytes of v1 and v2
+// the coding functions take decode (= p_co->decode) as a parameter, which is a constant in the specialized instances of codeRow
+FORCE_INLINE void shiftBytes (CODEC_t *p_co, int decode) {
+    while (((p_co->v1^p_co->v2)&0xff000000) == 0) {
+        p_co->v <<= 8;
+        if (decode) {
+            p_co->v += (*(p_co->p_buf++));                // read byte from compressed stream
+            if (p_co->p_buf == p_co->p_buf_lim)
+                chunkRead(p_co);
+        } else {
+            (*(p_co->p_buf++)) = (uint8_t)(p_co->v2>>24); // write byte to compressed stream
+            if (p_co->p_buf == p_co->p_buf_lim)
+                chunkWrite(p_co);
+        }
+        p_co->v1 <<= 8;
+        p_co->v2 <<= 8;
+        p_co->v2  += 0xFF;
+    }
+}
+
+
+FORCE_INLINE void binCodec (CODEC_t *p_co, int decode, int *p_bin, U32 prob) {
+    U32 vm;
     
-    if (p_co->decode)
+    if (p_co->p_queue) {                                  // the pipelined encoder : send to the coder thread
+        BinQueue_t *p_q = p_co->p_queue;
+        p_q->p_rec[p_q->i_chunk * BQ_CHUNK_LEN + p_q->i_rec] = (uint16_t)((prob << 1) | (*p_bin));
+        if ((++p_q->i_rec) == BQ_CHUNK_LEN)
+            binQueueSend(p_q);
+        return;
+    }
+    
+    vm = p_co->v1 + ((p_co->v2-p_co->v1)>>12)*prob + (((p_co->v2-p_co->v1)&0xfff)*prob>>12);
+    
+    if (decode)
         *p_bin = (p_co->v <= vm) ? 1 : 0;
     
     if (*p_bin)
@@ -560,19 +1031,46 @@ static void binCodec (CODEC_t *p_co, int *p_bin, U32 prob) {
     else
         p_co->v1 = vm + 1;
     
-    while (((p_co->v1^p_co->v2)&0xff000000) == 0) {
-        p_co->v <<= 8;
-        if (p_co->decode)
-            p_co->v += (*(p_co->p_buf++));                // read byte from compressed stream
-        else
-            (*(p_co->p_buf++)) = (uint8_t)(p_co->v2>>24); // write byte to compressed stream
-        p_co->v1 <<= 8;
-        p_co->v2 <<= 8;
-        p_co->v2  += 0xFF;
+    shiftBytes(p_co, decode);
+}
+
+
+
+// multi-symbol coding on the same range : a symbol has the cumulative frequency range [cl, cl+f) of the total (total <= SYM_MIN_RANGE)
+// the range is split into total steps of (v2-v1+1)/total, and the last symbol also gets the remainder.
+#define    SYM_MIN_RANGE          (1<<16)
+
+// make sure that the range has at least SYM_MIN_RANGE values, so that each symbol gets a non-empty range.
+// the top bytes of v1 and v2 are different after shiftBytes, so v1|(SYM_MIN_RANGE-1) is still <= v2, and the range is shrunk to it.
+FORCE_INLINE void symPrepare (CODEC_t *p_co, int decode) {
+    if ((p_co->v2 - p_co->v1) < SYM_MIN_RANGE) {
+        p_co->v2 = p_co->v1 | (SYM_MIN_RANGE-1);
+        shiftBytes(p_co, decode);
     }
 }
 
 
+// only for decode, after symPrepare
+// return: the cumulative frequency (0 ~ total-1) which the stream points to
+static U32 symDecodeCount (CODEC_t *p_co, U32 total) {
+    U32 step  = (U32)(((uint64_t)(p_co->v2 - p_co->v1) + 1) / total);
+    U32 count = (p_co->v - p_co->v1) / step;
+    return MIN(count, total-1);
+}
+
+
+// after symPrepare
+FORCE_INLINE void symCodec (CODEC_t *p_co, int decode, U32 cl, U32 f, U32 total) {
+    U32 step = (U32)(((uint64_t)(p_co->v2 - p_co->v1) + 1) / total);
+    
+    if (cl + f < total)
+        p_co->v2 = p_co->v1 + step * (cl + f) - 1;
+    p_co->v1 += step * cl;
+    
+    shiftBytes(p_co, decode);
+}
+
+
 static void flushEncoder (CODEC_t *p_co) {
     if (!p_co->decode) {
         (*(p_co->p_buf++)) = (uint8_t)(p_co->v1>>24);
@@ -586,18 +1084,141 @@ static void flushEncoder (CODEC_t *p_co) {
 }
 
 
+// send the current chunk to the coder thread, and wait for a free chunk
+static void binQueueSend (BinQueue_t *p_q) {
+    p_q->chunk_len[p_q->i_chunk] = p_q->i_rec;
+    semaphorePost(&p_q->sem_full);
+    p_q->i_chunk = (p_q->i_chunk + 1) % BQ_N_CHUNK;
+    p_q->i_rec   = 0;
+    semaphoreWait(&p_q->sem_free);
+}
+
+
+static void binCoderThreadFunc (void *arg) {
+    BinQueue_t *p_q = (BinQueue_t*)arg;
+    CODEC_t codec = newCodec(0, p_q->p_buf);
+    int i_chunk = 0, len, i;
+    
+    do {
+        const uint16_t *p_rec = p_q->p_rec + i_chunk * BQ_CHUNK_LEN;
+        
+        semaphoreWait(&p_q->sem_full);
+        
+        len = p_q->chunk_len[i_chunk];
+        
+        for (i=0; i<len; i++) {
+            int bin = p_rec[i] & 1;
+            binCodec(&codec, 0, &bin, p_rec[i] >> 1);
+        }
+        
+        semaphorePost(&p_q->sem_free);
+        
+        i_chunk = (i_chunk + 1) % BQ_N_CHUNK;
+    } while (len == BQ_CHUNK_LEN);
+    
+    flushEncoder(&codec);
+    
+    p_q->p_buf_end = codec.p_buf;
+}
+
+
+// start the coder thread, which encodes to p_buf
+// return:  -1:failed  0:success
+static int binQueueStart (BinQueue_t *p_q, UI8 *p_buf) {
+    p_q->p_rec   = (uint16_t*)malloc(sizeof(uint16_t) * BQ_N_CHUNK * BQ_CHUNK_LEN);
+    p_q->i_chunk = 0;
+    p_q->i_rec   = 0;
+    p_q->p_buf   = p_buf;
+    
+    if (p_q->p_rec == NULL)
+        return -1;
+    
+    if (semaphoreInit(&p_q->sem_full, 0, BQ_N_CHUNK)) {
+        free(p_q->p_rec);
+        return -1;
+    }
+    
+    if (semaphoreInit(&p_q->sem_free, BQ_N_CHUNK-1, BQ_N_CHUNK)) {     // the modeling owns a chunk to fill
+        semaphoreDestroy(&p_q->sem_full);
+        free(p_q->p_rec);
+        return -1;
+    }
+    
+    if (threadCreate(&p_q->thread, binCoderThreadFunc, (void*)p_q)) {
+        semaphoreDestroy(&p_q->sem_full);
+        semaphoreDestroy(&p_q->sem_free);
+        free(p_q->p_rec);
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+// send the last chunk, wait for the coder thread to flush the stream, and release the queue
+// return: the end of the stream
+static UI8 *binQueueFinish (BinQueue_t *p_q) {
+    p_q->chunk_len[p_q->i_chunk] = p_q->i_rec;                         // always shorter than BQ_CHUNK_LEN, since a full chunk is sent at once
+    semaphorePost(&p_q->sem_full);
+    threadJoin(p_q->thread);
+    semaphoreDestroy(&p_q->sem_full);
+    semaphoreDestroy(&p_q->sem_free);
+    free(p_q->p_rec);
+    return p_q->p_buf_end;
+}
+
+
+// c0+c1 <= N_QW*MAX_COUNTER+N_QW before halving, and the division-free model keeps a 16-bit probability, so the counters are 16-bit
 typedef struct {
-    int c0;
-    int c1;
+    uint16_t c0;
+    uint16_t c1;
 } BIN_CNT_t;
 
 
-static void initBinCounterTree (BIN_CNT_t bc_tree [][256]) {
+// the division-free probability model (the stream option NBLIC_FAST_PROB) uses BIN_CNT_t in another way :
+//   c0 : the probability of bin=1, scaled by 2^FP_BITS
+//   c1 : the total weight W of the bins seen, which starts from 2*N_QW like c0+c1 of the counters, and saturates at FP_MAX_W
+// observing a bin with weight w moves the probability by (bin-p)*w/W, which is what the counters do, so the probability follows the counters.
+// the division is a multiplication by a reciprocal table of W/32, and there is no halving.
+#define    FP_BITS                16
+#define    FP_MAX_W               (N_QW * MAX_COUNTER * 3 / 4)                             // the average c0+c1 of the counters between two halvings
+#define    FP_RECIP_BITS          20
+#define    FP_SHIFT               (FP_BITS - 12 + 5)                                       // PROB_MAX = 2^12 , N_QW = 2^5
+
+// FP_RECIP[k] = 2^FP_RECIP_BITS / (32*k+16) , k=0 and k=1 are not used since W >= 2*N_QW
+static const uint16_t FP_RECIP [(FP_MAX_W>>5)+1] = {
+        0,     0, 13107,  9362,  7282,  5958,  5041,  4369,  3855,  3449,  3121,  2849,
+     2621,  2427,  2260,  2114,  1986,  1872,  1771,  1680,  1598,  1524,  1456,  1394,
+     1337,  1285,  1237,  1192,  1150,  1111,  1074,  1040,  1008,   978,   950,   923,
+      898,   874,   851,   830,   809,   790,   771,   753,   736,   720,   705,   690,
+      676,   662,   649,   636,   624,   612,   601,   590,   580,   570,   560,   551,
+      542,   533,   524,   516,   508,   500,   493,   485,   478,   471,   465,   458,
+      452,   446,   440,   434,   428,   423,   417,   412,   407,   402,   397,   392,
+      388,   383,   379,   374,   370,   366,   362,   358,   354,   350,   347,   343,
+      340,   336,   333,   329,   326,   323,   320,   317,   314,   311,   308,   305,
+      302,   299,   297,   294,   291,   289,   286,   284,   281,   279,   277,   274,
+      272,   270,   267,   265,   263,   261,   259,   257,   255,   253,   251,   249,
+      247,   245,   244,   242,   240,   238,   237,   235,   233,   232,   230,   228,
+      227,   225,   224,   222,   221,   219,   218,   216,   215,   213,   212,   211,
+      209,   208,   207,   205,   204,   203,   202,   200,   199,   198,   197,   196,
+      194,   193,   192,   191,   190,   189,   188,   187,   186,   185,   184,   183,
+      182,   181,   180,   179,   178,   177,   176,   175,   174,   173,   172,   171,
+      170
+};
+
+
+// the bin counter tree is stored as bc_tree[bin index][qd], so the counters of qu and qv for a bin are in the same 64-byte line
+static void initBinCounterTree (BIN_CNT_t bc_tree [][N_QD], int fast_prob) {
     int i, j;
-    for (i=0; i<N_QD; i++) {
-        for (j=0; j<256; j++) {
-            bc_tree[i][j].c0 = N_QW;
-            bc_tree[i][j].c1 = N_QW;
+    for (i=0; i<256; i++) {
+        for (j=0; j<N_QD; j++) {
+            if (fast_prob) {
+                bc_tree[i][j].c0 = 1 << (FP_BITS-1);
+                bc_tree[i][j].c1 = 2 * N_QW;
+            } else {
+                bc_tree[i][j].c0 = N_QW;
+                bc_tree[i][j].c1 = N_QW;
+            }
         }
     }
 }
@@ -625,19 +1246,45 @@ static int getProb1 (BIN_CNT_t *p_bc) {
 }
 
 
-static void AriCodec (CODEC_t *p_co, BIN_CNT_t *p_ubc, BIN_CNT_t *p_vbc, int qw, int *p_bin) {
-    int prob = (getProb1(p_ubc) * (N_QW-qw) + getProb1(p_vbc) * qw + N_QW/2) / N_QW;
+static void probUpdate (BIN_CNT_t *p_bc, int bin, int w) {
+    int delta = (bin ? ((1<<FP_BITS)-1) : 0) - p_bc->c0;
+    p_bc->c1  = MIN(p_bc->c1 + w, FP_MAX_W);
+    p_bc->c0 += (int)(((I64)delta * w * FP_RECIP[p_bc->c1 >> 5]) >> FP_RECIP_BITS);
+}
+
+
+FORCE_INLINE void AriCodecFast (CODEC_t *p_co, int decode, BIN_CNT_t *p_ubc, BIN_CNT_t *p_vbc, int qw, int *p_bin) {
+    int prob = (p_ubc->c0 * (N_QW-qw) + p_vbc->c0 * qw + (1<<FP_SHIFT>>1)) >> FP_SHIFT;
     
     prob = CLIP(prob, 1, (PROB_MAX-1));
     
-    binCodec(p_co, p_bin, (U32)prob);
+    binCodec(p_co, decode, p_bin, (U32)prob);
+    
+    probUpdate(p_ubc, *p_bin, N_QW-qw);
+    probUpdate(p_vbc, *p_bin, qw);
+}
+
+
+FORCE_INLINE void AriCodec (CODEC_t *p_co, int decode, BIN_CNT_t *p_ubc, BIN_CNT_t *p_vbc, int qw, int *p_bin) {
+    int prob;
+    
+    if (p_co->fast_prob) {
+        AriCodecFast(p_co, decode, p_ubc, p_vbc, qw, p_bin);
+        return;
+    }
+    
+    prob = (getProb1(p_ubc) * (N_QW-qw) + getProb1(p_vbc) * qw + N_QW/2) / N_QW;
+    
+    prob = CLIP(prob, 1, (PROB_MAX-1));
+    
+    binCodec(p_co, decode, p_bin, (U32)prob);
     
     counterUpdate(p_ubc, *p_bin, N_QW-qw);
     counterUpdate(p_vbc, *p_bin, qw);
 }
 
 
-static void Zcodec (CODEC_t *p_co, int k_step, BIN_CNT_t bc_tree [][256], int qu, int qv, int qw, int *p_z) {
+FORCE_INLINE void Zcodec (CODEC_t *p_co, int decode, int k_step, BIN_CNT_t bc_tree [][N_QD], int qu, int qv, int qw, int *p_z) {
     const int k_max = (N_QD-1) / k_step;
     int i, k, bin;
     
@@ -647,10 +1294,10 @@ static void Zcodec (CODEC_t *p_co, int k_step, BIN_CNT_t bc_tree [][256], int qu
     for (i=0; ; ) {
         k = qu / k_step;
         
-        if (!p_co->decode)
+        if (!decode)
             bin = (i >> k_max) < ((*p_z) >> k);
         
-        AriCodec(p_co, &bc_tree[qu][i], &bc_tree[qv][i], qw, &bin);
+        AriCodec(p_co, decode, &bc_tree[i][qu], &bc_tree[i][qv], qw, &bin);
         
         if (!bin)
             break;
@@ -662,16 +1309,16 @@ static void Zcodec (CODEC_t *p_co, int k_step, BIN_CNT_t bc_tree [][256], int qu
         }
     }
     
-    if (p_co->decode)
+    if (decode)
         (*p_z) = ((i >> k_max) << k);
     
     for (i++, k--; k>=0; k--) {
-        if (!p_co->decode)
+        if (!decode)
             bin = ((*p_z) >> k) & 1;
         
-        AriCodec(p_co, &bc_tree[qu][i], &bc_tree[qv][i], qw, &bin);
+        AriCodec(p_co, decode, &bc_tree[i][qu], &bc_tree[i][qv], qw, &bin);
         
-        if (p_co->decode)
+        if (decode)
             (*p_z) += bin ? (1<<k) : 0;
         
         i += bin ? (1<<k) : 1;
@@ -679,60 +1326,210 @@ static void Zcodec (CODEC_t *p_co, int k_step, BIN_CNT_t bc_tree [][256], int qu
 }
 
 
-static void putHeader (UI8 **pp_buf, int n_channel, int height, int width, int near, int k_step, int effort) {
-    int i;
-    for (i=0; title[i]!=0; i++)                 // put title
-        *((*pp_buf)++) = (UI8)title[i];
-    *((*pp_buf)++) = (UI8)n_channel;            // put n_channel
-    *((*pp_buf)++) = (UI8)(height >> 8);        // put image height 
-    *((*pp_buf)++) = (UI8)(height >> 0);
-    *((*pp_buf)++) = (UI8)(width >> 8);         // put image width 
-    *((*pp_buf)++) = (UI8)(width >> 0);
-    *((*pp_buf)++) = (UI8)near;                 // put near
-    *((*pp_buf)++) = (UI8)k_step;               // put k_step
-    *((*pp_buf)++) = (UI8)effort;               // put effort
-}
 
+// Multi-symbol z coding (the stream option NBLIC_MULTI_SYM) : z is coded as a bucket symbol, followed by the low bits of z in the bucket with a uniform distribution :
+//   z <  16 : symbol = z , no low bits
+//   z >= 16 : z = 1mmx...x in binary (e+1 bits), symbol = 16 + 4*(e-4) + mm , followed by the e-2 low bits x...x
+// so a pixel takes one or two coder calls, instead of the unary prefix and the k bins of Zcodec.
+// each qu has an adaptive frequency table. like AriCodec, the symbol is coded with the tables of qu and qv blended by qw, and both tables are updated.
+#define    N_ZSYM                 32
+#define    ZSYM_INC               16
+#define    ZSYM_LIMIT             ((SYM_MIN_RANGE >> 2) - 64)                              // halve the frequencies when the total exceeds it, so that the blended total is <= SYM_MIN_RANGE
 
-// return:  -1:failed  0:success
-static int getHeader (UI8 **pp_buf, int *p_n_channel, int *p_height, int *p_width, int *p_near, int *p_k_step, int *p_effort) {
-    int i;
-    for (i=0; title[i]; i++)                    // check title 
-        if ( *((*pp_buf)++) != (UI8)title[i] )
-            return -1;
-    *p_n_channel =   *((*pp_buf)++);            // get n_channel
-    *p_height    = ( *((*pp_buf)++) ) << 8;     // get image height
-    *p_height   +=   *((*pp_buf)++);
-    *p_width     = ( *((*pp_buf)++) ) << 8;     // get image width
-    *p_width    +=   *((*pp_buf)++);
-    *p_near      =   *((*pp_buf)++);            // get near
-    *p_k_step    =   *((*pp_buf)++);            // get k_step
-    *p_effort    =   *((*pp_buf)++);            // get effort
-    return 0;
-}
+typedef struct {
+    uint16_t freq [N_ZSYM];
+    U32      total;
+} ZFREQ_t;
 
-    
 
-// return:  -1:failed  0:success
-static int checkSize (int height, int width) {
-    if (height <= 0)
-        return -1;
-    if (width  <= 0)
-        return -1;
-    if (height > NBLIC_MAX_HEIGHT)
-        return -1;
-    if (width  > NBLIC_MAX_WIDTH)
-        return -1;
-    if ((height*width) > NBLIC_MAX_IMG_SIZE)
-        return -1;
-    return 0;
+static void initZfreqTable (ZFREQ_t ztab []) {
+    int i, s;
+    for (i=0; i<N_QD; i++) {
+        for (s=0; s<N_ZSYM; s++)
+            ztab[i].freq[s] = 1;
+        ztab[i].total = N_ZSYM;
+    }
 }
 
 
-// return:  -1:failed  0:success
-static int checkParam (int height, int width, int n_channel, int near, int k_step, int effort) {
-    if (checkSize(height, width))
-        return -1;
+static void zfreqUpdate (ZFREQ_t *p_zf, int sym) {
+    int s;
+    
+    p_zf->freq[sym] += ZSYM_INC;
+    p_zf->total     += ZSYM_INC;
+    
+    if (p_zf->total > ZSYM_LIMIT) {
+        p_zf->total = 0;
+        for (s=0; s<N_ZSYM; s++) {
+            p_zf->freq[s] = (p_zf->freq[s] + 1) >> 1;
+            p_zf->total  += p_zf->freq[s];
+        }
+    }
+}
+
+
+FORCE_INLINE void ZcodecMulti (CODEC_t *p_co, int decode, ZFREQ_t *p_uzf, ZFREQ_t *p_vzf, int qw, int *p_z) {
+    U32 freq [N_ZSYM], total=0, cl=0, low=0;
+    int sym=0, e=0, s;
+    
+    for (s=0; s<N_ZSYM; s++) {                                         // blend the tables, N_QW=2^5, so the blended frequency has 2 more bits, and is at least 4
+        freq[s] = (p_uzf->freq[s] * (N_QW-qw) + p_vzf->freq[s] * qw) >> 3;
+        total  += freq[s];
+    }
+    
+    if (!decode) {
+        if ((*p_z) < 16) {
+            sym = *p_z;
+        } else {
+            for (e=4; ((*p_z) >> (e+1)) != 0; e++);
+            sym = 16 + 4*(e-4) + (((*p_z) >> (e-2)) & 3);
+            low = (*p_z) & ((1<<(e-2)) - 1);
+        }
+    }
+    
+    symPrepare(p_co, decode);
+    
+    if (decode) {
+        U32 count = symDecodeCount(p_co, total);
+        for (s=0; cl+freq[s]<=count; s++)
+            cl += freq[s];
+        sym = s;
+    } else {
+        for (s=0; s<sym; s++)
+            cl += freq[s];
+    }
+    
+    symCodec(p_co, decode, cl, freq[sym], total);
+    
+    zfreqUpdate(p_uzf, sym);
+    zfreqUpdate(p_vzf, sym);
+    
+    if (sym >= 16) {                                                   // the low bits
+        e = (sym - 16) / 4 + 4;
+        symPrepare(p_co, decode);
+        if (decode)
+            low = symDecodeCount(p_co, 1<<(e-2));
+        symCodec(p_co, decode, low, 1, 1<<(e-2));
+    }
+    
+    if (decode)
+        *p_z = (sym < 16) ? sym : (((4 | (sym & 3)) << (e-2)) | (int)low);
+}
+
+
+
+// the adaptive state of the entropy coding, which is accessed for every pixel. it is about 70 KiB, see NBLICgetWorkingSetSize
+typedef struct {
+    int16_t      ctx_array [N_CONTEXT];
+    BIN_CNT_t    bc_tree   [256][N_QD];
+    ZFREQ_t      ztab      [N_QD];
+    AutoMapper_t maps      [256][2];
+} Model_t;
+
+
+static void initModel (Model_t *p_md, int fast_prob) {
+    int i;
+    
+    SET_ARRAY_ZERO(p_md->ctx_array, N_CONTEXT);
+    
+    initBinCounterTree(p_md->bc_tree, fast_prob);
+    
+    initZfreqTable(p_md->ztab);
+    
+    for (i=0; i<256; i++) {
+        initAutoMapper(&p_md->maps[i][0]);
+        initAutoMapper(&p_md->maps[i][1]);
+    }
+}
+
+
+// the high bits of the effort byte mark the wavefront stream, the tiled stream, and the options of NBLIC.h
+#define    WAVEFRONT_FLAG         0x80
+#define    TILED_FLAG             0x40
+#define    HEADER_FLAGS           (WAVEFRONT_FLAG | TILED_FLAG | NBLIC_OPTIONS)
+
+// the v1 header has 16-bit height and width. an image which is higher or wider than V1_MAX_SIZE has the v2 header,
+// whose 16-bit height and width are 0 (which the v1 decoders reject), followed by the 32-bit height and width.
+#define    V1_MAX_SIZE            65535
+#define    IS_V2_SIZE(h,w)        ((h) > V1_MAX_SIZE || (w) > V1_MAX_SIZE)
+#define    MAX_HEADER_LEN         32                   // the title, and the 16 bytes after it in the v2 header
+
+static void putBytes (UI8 **pp_buf, U32 value, int n_byte) {    // big endian
+    for (n_byte--; n_byte>=0; n_byte--)
+        *((*pp_buf)++) = (UI8)(value >> (8*n_byte));
+}
+
+
+static U32 getBytes (UI8 **pp_buf, int n_byte) {                // big endian
+    U32 value = 0;
+    for (; n_byte>0; n_byte--)
+        value = (value << 8) | *((*pp_buf)++);
+    return value;
+}
+
+
+static void putHeader (UI8 **pp_buf, int n_channel, int height, int width, int near, int k_step, int effort, int flags) {
+    int i;
+    for (i=0; title[i]!=0; i++)                 // put title
+        *((*pp_buf)++) = (UI8)title[i];
+    *((*pp_buf)++) = (UI8)n_channel;            // put n_channel
+    if (IS_V2_SIZE(height, width)) {
+        putBytes(pp_buf, 0, 4);                 // v2 header : 16-bit zero height and width, then 32-bit image height and width
+        putBytes(pp_buf, height, 4);
+        putBytes(pp_buf, width , 4);
+    } else {
+        putBytes(pp_buf, height, 2);            // put image height
+        putBytes(pp_buf, width , 2);            // put image width
+    }
+    *((*pp_buf)++) = (UI8)near;                 // put near
+    *((*pp_buf)++) = (UI8)k_step;               // put k_step
+    *((*pp_buf)++) = (UI8)(effort | flags);     // put effort and flags
+}
+
+
+// return:  -1:failed  0:success
+static int getHeader (UI8 **pp_buf, int *p_n_channel, int *p_height, int *p_width, int *p_near, int *p_k_step, int *p_effort, int *p_flags) {
+    int i;
+    for (i=0; title[i]; i++)                    // check title 
+        if ( *((*pp_buf)++) != (UI8)title[i] )
+            return -1;
+    *p_n_channel =   *((*pp_buf)++);            // get n_channel
+    *p_height    = (int)getBytes(pp_buf, 2);    // get image height
+    *p_width     = (int)getBytes(pp_buf, 2);    // get image width
+    if (*p_height == 0 && *p_width == 0) {      // v2 header
+        U32 height = getBytes(pp_buf, 4);
+        U32 width  = getBytes(pp_buf, 4);
+        if (height > NBLIC_MAX_HEIGHT || width > NBLIC_MAX_WIDTH || !IS_V2_SIZE(height, width))
+            return -1;
+        *p_height = (int)height;
+        *p_width  = (int)width;
+    }
+    *p_near      =   *((*pp_buf)++);            // get near
+    *p_k_step    =   *((*pp_buf)++);            // get k_step
+    *p_effort    =   *((*pp_buf)++);            // get effort and flags
+    *p_flags     = (*p_effort) &  HEADER_FLAGS;
+    *p_effort    = (*p_effort) & ~HEADER_FLAGS;
+    return 0;
+}
+
+// return:  -1:failed  0:success
+static int checkSize (int height, int width) {
+    if (height <= 0)
+        return -1;
+    if (width  <= 0)
+        return -1;
+    if (height > NBLIC_MAX_HEIGHT)
+        return -1;
+    if (width  > NBLIC_MAX_WIDTH)
+        return -1;
+    return 0;
+}
+
+
+// return:  -1:failed  0:success
+static int checkParam (int height, int width, int n_channel, int near, int k_step, int effort) {
+    if (checkSize(height, width))
+        return -1;
     if (n_channel < 0 || n_channel > MAX_N_CHANNEL)
         return -1;
     if (near < 0 || near > MAX_NEAR)
@@ -746,165 +1543,886 @@ static int checkParam (int height, int width, int n_channel, int near, int k_ste
 
 
 
-static int NBLICcodec (int verbose, int decode, UI8 *p_buf, UI8 *p_img, UI8 *p_img_out, int *p_height, int *p_width, int *p_near, int *p_effort) {
-    int n_channel=1, n, m, avp_enable, k_step, i, j;
+// Wavefront stream ---------------------------------------------------------------------------------------
+// in the normal stream, the AVP of a row needs the whole row above (F is a sum over all the columns on the right), and the bias is carried from pixel to pixel.
+// so the rows can only be processed one by one. the wavefront stream changes the model, so that a row only needs the row above up to a few columns on the right :
+//   - F of the columns in a segment of WF_SEG columns only sums up B of this segment and the next segment.
+//   - each row has its own bias, which starts from the bias of the row above after its first segment (row 0 starts from BIAS_INIT).
+// thus the AVP of row i can run as soon as row i-1 has finished two more segments, and the rows form a diagonal wavefront.
+// the pixels are still coded in raster order, the entropy coder and the contexts are shared by the whole image.
+// also, F only has to be kept for two segments instead of the whole row, which halves the AVP row state of a wide image.
+#define    WF_SEG                 32
+#define    WF_F_COLS              (2 * WF_SEG)         // the columns of F in the wavefront stream
+
+#define    F_ROW_COLS(width,wavefront)  ((wavefront) ? MIN((width), WF_F_COLS) : (width))
+
+
+// AVP model state of the row being processed
+typedef struct {
+    int  n, m;
+    I64 *p_B_row;                 // B of all columns
+    I64 *p_F_row;                 // F of all columns of the row. in the wavefront stream, only F of the current segment and the next one
+    int  wavefront;
+    I64 *p_B, *p_F;               // B and F of the current pixel
+    I64  p_E   [GET_M(MAX_N)];
+    I64  p_EF  [GET_M(MAX_N)];
+    I64  vec_n [MAX_N];
+    I64  bias, bias1, bias2, px1f, px2f;
+    int  px1_vld, px2_vld;
+    int  fast;                    // 1 : solved by AVPpredictFast (effort=FAST_AVP_EFFORT)
+    int  x_vld;                   // 1 : vec_x is the solution of the pixel on the left, which is the start point of AVPpredictFast
+    I64  vec_x  [MAX_N];
+    I64  vec_dx [MAX_N];
+} AVPstate_t;
+
+
+// the model of a pixel : everything that the entropy coder needs, except the context correction
+typedef struct {
+    UI8      px0;
+    UI8      qu, qv, qw;
+    uint16_t adr;
+} PixelModel_t;
+
+
+static void AVPstartRow (AVPstate_t *p_avp, I64 bias) {
+    SET_ARRAY_ZERO(p_avp->p_E, p_avp->m);
+    p_avp->bias  = bias;
+    p_avp->x_vld = 0;
+}
+
+
+// predict pixel j with AVP, and fill the model of the pixel
+// n and fast are p_avp->n and p_avp->fast, which are constants in the specialized instances of codeRow
+FORCE_INLINE void modelPixel (AVPstate_t *p_avp, const int n, const int fast, int j, int err, int a, int b, int c, int d, int e, int f, int g, int h, int q, int r, int s, int t, PixelModel_t *p_pm) {
+    const int m = GET_M(n);
+    int px0, qu, qv, qw;
     
-    int ctx_array [N_CONTEXT];
+    p_avp->px1_vld = p_avp->px2_vld = 0;
     
-    BIN_CNT_t bc_tree [N_QD][256];
+    if (n > 0) {
+        I64 bias = p_avp->bias, bias1, bias2;
+        
+        AVPgetVecN(p_avp->vec_n, n, a, b, c, d, e, f, g, h, q, r, s, t);
+        
+        p_avp->p_B = p_avp->p_B_row + (m * j);
+        p_avp->p_F = p_avp->p_F_row + (m * (p_avp->wavefront ? (j % WF_SEG) : j));
+        
+        bias1 = bias * BIAS_COEF / (BIAS_COEF+1);
+        bias2 = bias * (BIAS_COEF+1) / BIAS_COEF;
+        bias1 = CLIP(bias1, -1, bias-1);
+        bias2 = CLIP(bias2, bias+1, BIAS_MAX+1);
+        bias1 = CLIP(bias1, 0, BIAS_MAX);
+        bias2 = CLIP(bias2, 0, BIAS_MAX);
+        
+        AVPsumEF(m, p_avp->p_E, p_avp->p_F, p_avp->p_EF);
+        
+        if (fast) {
+            int refresh    = ((j % FAST_AVP_REFRESH) == 0) || !p_avp->x_vld;
+            if (!p_avp->x_vld)
+                SET_ARRAY_ZERO(p_avp->vec_x, n);
+            p_avp->x_vld   = AVPpredictFast(n, p_avp->p_EF, p_avp->vec_n, bias1, bias2, refresh, p_avp->vec_x, p_avp->vec_dx, &p_avp->px1f, &p_avp->px2f);
+            p_avp->px1_vld = p_avp->px2_vld = p_avp->x_vld;
+        } else {
+            p_avp->px1_vld = AVPpredict(n, p_avp->p_EF, p_avp->vec_n, bias1, &p_avp->px1f);
+            p_avp->px2_vld = AVPpredict(n, p_avp->p_EF, p_avp->vec_n, bias2, &p_avp->px2f);
+        }
+        p_avp->bias1 = bias1;
+        p_avp->bias2 = bias2;
+    }
     
-    AutoMapper_t maps [256][2];
+    if (p_avp->px1_vld) {
+        px0 = (int)((p_avp->px1f + (1<<FB1>>1)) >> FB1);
+    } else {
+        px0 = simplePredict(a, b, c, d, e, f, g, h, q, r, s);
+        p_avp->px1f = px0 << FB1;
+    }
     
-    CODEC_t codec;
+    getQuantizedDelta(a, b, c, d, e, f, g, err, &qu, &qv, &qw);
     
-    UI8 *p_buf_base = p_buf;
+    p_pm->px0 = (UI8)px0;
+    p_pm->qu  = (UI8)qu;
+    p_pm->qv  = (UI8)qv;
+    p_pm->qw  = (UI8)qw;
+    p_pm->adr = (uint16_t)getContextAddress(a, b, c, d, e, f, qu, px0);
+}
+
+
+// update AVP with the pixel x, after modelPixel
+FORCE_INLINE void AVPupdatePixel (AVPstate_t *p_avp, const int n, const int fast, int x) {
+    if (n > 0) {
+        I64 px1f   = p_avp->px1f;
+        I64 px2f   = p_avp->px2f;
+        I64 s_curr = ABS(px1f - (x<<FB1));
+        I64 s_sum  = (p_avp->p_E[0] + p_avp->p_F[0]) + (s_curr * BETA / (BETA-1));
+        
+        AVPupdate(n, GET_M(n), p_avp->p_E, p_avp->p_B, p_avp->vec_n, x, s_curr, s_sum);
+        
+        if (p_avp->px1_vld && p_avp->px2_vld) {
+            px1f = ABS(px1f - (x<<FB1));
+            px2f = ABS(px2f - (x<<FB1));
+            p_avp->bias = (px1f > px2f) ? p_avp->bias2 : p_avp->bias1;
+            if (fast && px1f > px2f) {                         // the next pixel starts from the solution of the chosen bias
+                int k;
+                for (k=0; k<n; k++)
+                    p_avp->vec_x[k] += p_avp->vec_dx[k];
+            }
+        }
+    }
+}
+
+
+// the coding of a pixel : context correction, mapping, and entropy coding. x is the input pixel when encoding (ignored when decoding)
+// return : the reconstructed pixel
+FORCE_INLINE int codePixel (CODEC_t *p_co, const int decode, int k_step, int near, Model_t *p_md, const PixelModel_t *p_pm, int x) {
+    int px, sign, y=0, z=0;
     
-    I64 *p_B_row=NULL, *p_F_row=NULL, *p_B=NULL, *p_F=NULL, p_E[GET_M(MAX_N)], vec_n[MAX_N], bias=BIAS_INIT;
+    px = correctPxByContext(p_md->ctx_array[p_pm->adr], p_pm->px0, &sign);
     
-    if (decode) {
-        if (getHeader(&p_buf, &n_channel, p_height, p_width, p_near, &k_step, p_effort))
-            return -1;
-    } else {
-        *p_near   = CLIP(*p_near, 0, MAX_NEAR);
-        k_step    = CLIP(MIN_K_STEP+2*(*p_near), MIN_K_STEP, N_QD);
-        *p_effort = CLIP(*p_effort, MIN_EFFORT, MAX_EFFORT);
-        putHeader(&p_buf, n_channel, *p_height, *p_width, *p_near, k_step, *p_effort);
+    if (!decode) {
+        y = mapXtoY(x, px, sign, near);
+        z = mapYtoZ(&p_md->maps[px][sign], y);
     }
     
-    if (checkParam(*p_height, *p_width, n_channel, *p_near, k_step, *p_effort))
-        return -1;
+    if (p_co->multi_sym)
+        ZcodecMulti(p_co, decode, &p_md->ztab[p_pm->qu], &p_md->ztab[p_pm->qv], p_pm->qw, &z);
+    else
+        Zcodec(p_co, decode, k_step, p_md->bc_tree, p_pm->qu, p_pm->qv, p_pm->qw, &z);
+    
+    if (decode)
+        y = mapZtoY(&p_md->maps[px][sign], z);
     
+    addY(&p_md->maps[px][sign], y);
     
-    n = N_LIST[ (*p_effort) ];
-    m = GET_M(n);
-    avp_enable = (n > 0) ? 1 : 0;
+    x = mapYtoX(y, px, sign, near);
     
+    updateContext(&p_md->ctx_array[p_pm->adr], CLIP((x-p_pm->px0), MIN_PX_INC, MAX_PX_INC));
     
-    if (avp_enable) {
-        p_B_row = (I64*)malloc((*p_width) * m * 2 * sizeof(I64));
+    return x;
+}
+
+
+static void printProgress (int effort, int decode, int i, int height) {
+    if ((i&0x7) == 0) {
+        printf("\r    effort=%d, %s row %d (%.2lf%%)" , effort, (decode?"decoding":"encoding"), i, (100.0*i)/height);
+        fflush(stdout);
+    }
+}
+
+
+
+// code row i of an image. the rows above are in the line buffer (p_lines), and the first two rows also in a small head buffer after it (see reserveContext)
+// p_row_in  : row i to encode (only read when encoding)
+// p_row_out : to get the reconstructed row i when decoding (NULL : not needed)
+// this is the generic version : decode, n (= N_LIST[effort]), fast (effort == FAST_AVP_EFFORT) and near are compile-time constants
+// in its specialized instances (DEFINE_CODE_ROW), and it is always inlined into them.
+// p_bias_seed : the bias after the first segment of the row, for the next row of the wavefront stream
+FORCE_INLINE void codeRowGeneric (CODEC_t *p_co, Model_t *p_md, AVPstate_t *p_avp, const UI8 *p_row_in, UI8 *p_row_out, UI8 *p_lines, int i, int width, int k_step, int near, int wavefront, I64 *p_bias_seed,
+                                  const int decode, const int n, const int fast) {
+    const int m = GET_M(n);
+    int j, err = 0;
+    UI8 *pc = LINE(p_lines, width, i), *p1 = pc, *p2 = pc;
+    UI8 *p_head = p_lines + 3 * LINE_LEN(width);
+    
+    if (i >= 2) {
+        p1 = LINE(p_lines, width, i-1);
+        p2 = LINE(p_lines, width, i-2);
+        padLines(p_lines, width, i);
+    }
+    
+    if (n > 0) {
+        AVPstartRow(p_avp, wavefront ? (*p_bias_seed) : p_avp->bias);   // the wavefront stream : the bias of each row starts from the row above
+        if (!wavefront)
+            AVPprecalcuate(m, p_avp->p_F_row, p_avp->p_B_row, 0, width);
+    }
+    
+    for (j=0; j<width; j++) {
+        int a, b, c, d, e, f, g, h, q, r, s, t, x=0;
+        PixelModel_t pm;
+        
+        if (i >= 2) {
+            a = pc[j-1];  e = pc[j-2];
+            b = p1[j];    c = p1[j-1];  d = p1[j+1];  q = p1[j-2];  t = p1[j+2];
+            f = p2[j];    g = p2[j+1];  h = p2[j-1];  r = p2[j+2];  s = p2[j-2];
+        } else {                                                       // the first two rows have special border rules
+            sampleNeighbourPixels(p_head, width, i, j, &a, &b, &c, &d, &e, &f, &g, &h, &q, &r, &s, &t);
+        }
+        
+        if (n > 0 && wavefront && (j % WF_SEG) == 0)                   // the wavefront stream : F of a segment only covers this and the next segment
+            AVPprecalcuate(m, p_avp->p_F_row, p_avp->p_B_row, j, MIN(j+WF_F_COLS, width));
+        
+        modelPixel(p_avp, n, fast, j, err, a, b, c, d, e, f, g, h, q, r, s, t, &pm);
         
+        if (!decode)
+            x = p_row_in[j];
+        
+        x = codePixel(p_co, decode, k_step, near, p_md, &pm, x);
+        
+        if (p_row_out)
+            p_row_out[j] = (UI8)x;
+        if (i < 2)
+            G2D(p_head, width, i, j) = (UI8)x;
+        pc[j] = (UI8)x;
+        if (j == 0)
+            pc[-1] = (UI8)x;
+        
+        err = CLIP((x-pm.px0), MIN_PX_INC, MAX_PX_INC);
+        
+        AVPupdatePixel(p_avp, n, fast, x);
+        
+        if (j == MIN(WF_SEG, width)-1)
+            (*p_bias_seed) = p_avp->bias;
+    }
+}
+
+
+typedef void (*CodeRowFunc_t) (CODEC_t *p_co, Model_t *p_md, AVPstate_t *p_avp, const UI8 *p_row_in, UI8 *p_row_out, UI8 *p_lines, int i, int width, int k_step, int near, int wavefront, I64 *p_bias_seed);
+
+// the specialized instance of codeRowGeneric for encoding or decoding (DECODE), an effort (EFFORT, with N = N_LIST[EFFORT]), and the lossless mode (LOSSLESS=1 : near=0 and k_step=MIN_K_STEP).
+// the stream does not depend on the instance.
+#define DEFINE_CODE_ROW(DECODE, EFFORT, N, LOSSLESS)                                                                                                                  \
+static void codeRow_##DECODE##_##EFFORT##_##LOSSLESS (CODEC_t *p_co, Model_t *p_md, AVPstate_t *p_avp, const UI8 *p_row_in, UI8 *p_row_out, UI8 *p_lines,             \
+                                                   int i, int width, int k_step, int near, int wavefront, I64 *p_bias_seed) {                                         \
+    codeRowGeneric(p_co, p_md, p_avp, p_row_in, p_row_out, p_lines, i, width, (LOSSLESS ? MIN_K_STEP : k_step), (LOSSLESS ? 0 : near), wavefront, p_bias_seed,        \
+                   DECODE, N, (EFFORT == FAST_AVP_EFFORT));                                                                                                           \
+}
+
+DEFINE_CODE_ROW(0, 1,  0, 0)    DEFINE_CODE_ROW(0, 1,  0, 1)    DEFINE_CODE_ROW(1, 1,  0, 0)    DEFINE_CODE_ROW(1, 1,  0, 1)
+DEFINE_CODE_ROW(0, 2,  6, 0)    DEFINE_CODE_ROW(0, 2,  6, 1)    DEFINE_CODE_ROW(1, 2,  6, 0)    DEFINE_CODE_ROW(1, 2,  6, 1)
+DEFINE_CODE_ROW(0, 3, 10, 0)    DEFINE_CODE_ROW(0, 3, 10, 1)    DEFINE_CODE_ROW(1, 3, 10, 0)    DEFINE_CODE_ROW(1, 3, 10, 1)
+DEFINE_CODE_ROW(0, 4, 10, 0)    DEFINE_CODE_ROW(0, 4, 10, 1)    DEFINE_CODE_ROW(1, 4, 10, 0)    DEFINE_CODE_ROW(1, 4, 10, 1)
+
+// [effort][decode][lossless]
+static const CodeRowFunc_t CODE_ROW_FUNCS [MAX_EFFORT+1][2][2] = {
+    {{NULL             , NULL             }, {NULL             , NULL             }},
+    {{codeRow_0_1_0    , codeRow_0_1_1    }, {codeRow_1_1_0    , codeRow_1_1_1    }},
+    {{codeRow_0_2_0    , codeRow_0_2_1    }, {codeRow_1_2_0    , codeRow_1_2_1    }},
+    {{codeRow_0_3_0    , codeRow_0_3_1    }, {codeRow_1_3_0    , codeRow_1_3_1    }},
+    {{codeRow_0_4_0    , codeRow_0_4_1    }, {codeRow_1_4_0    , codeRow_1_4_1    }}
+};
+
+
+
+// Codec context -------------------------------------------------------------------------------------------
+// the model and the scratch buffers of codeImage. the buffers only grow, so a context which codes many images of the same size allocates them once,
+// and the model is initialized at the start of each image. the API functions without a context use a temporary one.
+struct NBLICctx_t {
+    Model_t  model;
+    UI8     *p_lines;             // the line buffer and the head buffer
+    int      lines_size;          // in bytes
+    I64     *p_B_row;             // B and F of the AVP rows
+    int      B_row_size;          // in items
+};
+
+
+static void initContext (NBLICctx_t *p_ctx) {
+    p_ctx->p_lines    = NULL;
+    p_ctx->lines_size = 0;
+    p_ctx->p_B_row    = NULL;
+    p_ctx->B_row_size = 0;
+}
+
+
+static void freeContextBuffers (NBLICctx_t *p_ctx) {
+    free(p_ctx->p_lines);
+    free(p_ctx->p_B_row);
+    initContext(p_ctx);
+}
+
+
+// grow the buffers of the context to code an image of this width with n AVP items
+// return:
+//     0 : success
+//    -1 : failed (no memory), the buffers are unchanged
+static int reserveContext (NBLICctx_t *p_ctx, int width, int n, int wavefront) {
+    const int lines_size = 3 * LINE_LEN(width) + 2 * width;
+    const int B_row_size = (n > 0) ? ((width + F_ROW_COLS(width, wavefront)) * GET_M(n)) : 0;
+    
+    if (lines_size > p_ctx->lines_size) {
+        UI8 *p_lines = (UI8*)malloc(lines_size);
+        if (p_lines == NULL)
+            return -1;
+        free(p_ctx->p_lines);
+        p_ctx->p_lines    = p_lines;
+        p_ctx->lines_size = lines_size;
+    }
+    
+    if (B_row_size > p_ctx->B_row_size) {
+        I64 *p_B_row = (I64*)malloc(B_row_size * sizeof(I64));
         if (p_B_row == NULL)
             return -1;
+        free(p_ctx->p_B_row);
+        p_ctx->p_B_row    = p_B_row;
+        p_ctx->B_row_size = B_row_size;
+    }
+    
+    return 0;
+}
+
+
+
+// the state of coding an image row by row : codeImage codes all the rows in one call, and the streaming encoder (NBLICencoder_t) the rows of each push
+typedef struct {
+    NBLICctx_t   *p_ctx;                  // provides the model and the buffers
+    CodeRowFunc_t codeRow;
+    CODEC_t       codec;
+    AVPstate_t    avp;
+    BinQueue_t    queue;
+    I64           bias_seed;
+    int           width, near, k_step, wavefront;
+} ImageCoder_t;
+
+
+// start to code an image (or a tile) with fresh models
+// flags     : the header flags, only WAVEFRONT_FLAG and the options are used here
+// pipelined : 1 : encode with a coder thread (see BinQueue_t), falls back to the direct encoder if the thread cannot be started
+// return:
+//     0 : success
+//    -1 : failed (no memory)
+static int startImage (ImageCoder_t *p_ic, NBLICctx_t *p_ctx, int decode, UI8 *p_buf, int width, int near, int k_step, int effort, int flags, int pipelined) {
+    const int n = N_LIST[effort];
+    const int m = GET_M(n);
+    
+    if (reserveContext(p_ctx, width, n, (flags & WAVEFRONT_FLAG)))
+        return -1;
+    
+    p_ic->p_ctx     = p_ctx;
+    p_ic->codeRow   = CODE_ROW_FUNCS[effort][decode][(near == 0 && k_step == MIN_K_STEP)];   // dispatch once per image
+    p_ic->bias_seed = BIAS_INIT;
+    p_ic->width     = width;
+    p_ic->near      = near;
+    p_ic->k_step    = k_step;
+    p_ic->wavefront = (flags & WAVEFRONT_FLAG) ? 1 : 0;
+    
+    p_ic->avp.n    = n;
+    p_ic->avp.m    = m;
+    p_ic->avp.fast = (effort == FAST_AVP_EFFORT);
+    p_ic->avp.bias = BIAS_INIT;
+    p_ic->avp.wavefront = p_ic->wavefront;
+    
+    if (n > 0) {
+        SET_ARRAY_ZERO(p_ctx->p_B_row, width * m);
         
-        SET_ARRAY_ZERO(p_B_row, (*p_width) * m);
+        p_ic->avp.p_B_row = p_ctx->p_B_row;
+        p_ic->avp.p_F_row = p_ctx->p_B_row + width * m;
+    }
+    
+    p_ic->codec = newCodec(decode, p_buf);
+    
+    p_ic->codec.fast_prob = (flags & NBLIC_FAST_PROB) ? 1 : 0;
+    p_ic->codec.multi_sym = (flags & NBLIC_MULTI_SYM) ? 1 : 0;
+    
+    if (pipelined && !decode && !p_ic->codec.multi_sym && binQueueStart(&p_ic->queue, p_buf) == 0)    // the coder thread only takes bins
+        p_ic->codec.p_queue = &p_ic->queue;
+    
+    initModel(&p_ctx->model, p_ic->codec.fast_prob);
+    
+    return 0;
+}
+
+
+// code row i, the rows are coded in order. p_row_in and p_row_out : see codeRowGeneric
+static void codeImageRow (ImageCoder_t *p_ic, const UI8 *p_row_in, UI8 *p_row_out, int i) {
+    p_ic->codeRow(&p_ic->codec, &p_ic->p_ctx->model, &p_ic->avp, p_row_in, p_row_out, p_ic->p_ctx->p_lines, i, p_ic->width, p_ic->k_step, p_ic->near, p_ic->wavefront, &p_ic->bias_seed);
+}
+
+
+// return: the end of the stream
+static UI8 *finishImage (ImageCoder_t *p_ic) {
+    if (p_ic->codec.p_queue)
+        return binQueueFinish(p_ic->codec.p_queue);
+    flushEncoder(&p_ic->codec);
+    return p_ic->codec.p_buf;
+}
+
+
+// code an image (or a tile) with fresh models, the header is not included
+// p_ctx     : the context, which provides the model and the buffers
+// flags, pipelined : see startImage
+// p_img_out : the reconstructed image when decoding. when encoding it is NULL, and p_img is only read :
+//             the reconstructed rows are kept in the line buffer, and the first two rows (which use sampleNeighbourPixels) in a small head buffer
+// return:
+//    the length of the stream when encoding, or the bytes consumed when decoding
+//    -1 : failed (no memory)
+static I64 codeImage (NBLICctx_t *p_ctx, int verbose, int decode, UI8 *p_buf, const UI8 *p_img, UI8 *p_img_out, int height, int width, int near, int k_step, int effort, int flags, int pipelined) {
+    ImageCoder_t ic;
+    
+    int i;
+    
+    if (startImage(&ic, p_ctx, decode, p_buf, width, near, k_step, effort, flags, pipelined))
+        return -1;
+    
+    for (i=0; i<height; i++) {
+        if (verbose)
+            printProgress(effort, decode, i, height);
         
-        p_F_row = p_B_row + (*p_width) * m;
+        codeImageRow(&ic, decode ? NULL : &G2D(p_img, width, i, 0), decode ? &G2D(p_img_out, width, i, 0) : NULL, i);
     }
     
+    if (verbose)
+        printf("\r                                                                        \r");
     
-    codec = newCodec(decode, p_buf);
+    return finishImage(&ic) - p_buf;
+}
+
+
+
+// Tiled stream -------------------------------------------------------------------------------------------
+// the image is split into tiles of tile_h x tile_w pixels (the tiles on the bottom and the right edge can be smaller).
+// each tile is coded as an independent image with fresh models, so the tiles are encoded and decoded in parallel, at the cost of some compression ratio.
+// after the header, the tiled stream contains :
+//   - tile_h and tile_w (16-bit each)
+//   - the byte offset of each tile stream (in raster order of the tiles), counting from the end of this table.
+//     32-bit each, or 64-bit each in a stream with the v2 header (see IS_V2_SIZE), whose tile streams can exceed 4 GB in total.
+//   - the tile streams
+#define    MIN_TILE_SIZE          16
+#define    MAX_TILE_SIZE          16384                // so that the scratch of a tile stream fits an int
+#define    MAX_N_TILE             (1 << 24)            // the encoder enlarges the tiles of a huge image to keep the offset table under this
+#define    TILE_EXTRA_BYTES       64                   // the scratch of a tile stream when encoding : 2 bytes per pixel, plus this
+
+
+typedef struct {
+    int   decode;
+    const UI8 *p_img;           // the image to encode
+    UI8  *p_img_out;            // the image to decode into
+    int   height;
+    int   width;
+    int   near;
+    int   k_step;
+    int   effort;
+    int   flags;
+    int   tile_h;
+    int   tile_w;
+    int   n_tile_x;
+    UI8 **pp_tile;              // [n_tile] the stream of each tile
+    I64  *p_len;                // [n_tile] the result of codeImage for each tile
+} TileJob_t;
+
+
+static void codeTileTask (void *arg, int k) {
+    TileJob_t *p_job = (TileJob_t*)arg;
+    const int i0 = (k / p_job->n_tile_x) * p_job->tile_h;
+    const int j0 = (k % p_job->n_tile_x) * p_job->tile_w;
+    const int th = MIN(p_job->tile_h, p_job->height - i0);
+    const int tw = MIN(p_job->tile_w, p_job->width  - j0);
+    UI8 *p_tile = (UI8*)malloc((size_t)th * tw);
+    int i, j;
     
-    SET_ARRAY_ZERO(ctx_array, N_CONTEXT);
+    NBLICctx_t ctx;
     
-    initBinCounterTree(bc_tree);
+    initContext(&ctx);
     
-    for (i=0; i<256; i++) {
-        initAutoMapper(&maps[i][0]);
-        initAutoMapper(&maps[i][1]);
+    p_job->p_len[k] = -1;
+    
+    if (p_tile == NULL)
+        return;
+    
+    if (!p_job->decode)
+        for (i=0; i<th; i++)
+            for (j=0; j<tw; j++)
+                G2D(p_tile, tw, i, j) = G2D(p_job->p_img, p_job->width, i0+i, j0+j);
+    
+    p_job->p_len[k] = codeImage(&ctx, 0, p_job->decode, p_job->pp_tile[k], p_tile, (p_job->decode ? p_tile : NULL), th, tw, p_job->near, p_job->k_step, p_job->effort, p_job->flags, 0);
+    
+    if (p_job->decode && p_job->p_len[k] >= 0)
+        for (i=0; i<th; i++)
+            for (j=0; j<tw; j++)
+                G2D(p_job->p_img_out, p_job->width, i0+i, j0+j) = G2D(p_tile, tw, i, j);
+    
+    freeContextBuffers(&ctx);
+    free(p_tile);
+}
+
+
+// code the part of the tiled stream after the header. tile_h and tile_w are only used when encoding.
+// return:
+//    the length of this part when encoding, 0 when decoding
+//    -1 : failed
+static I64 codeTiles (int decode, UI8 *p_buf, const UI8 *p_img, UI8 *p_img_out, int height, int width, int near, int k_step, int effort, int flags, int tile_h, int tile_w, int n_thread) {
+    const int offset_bytes = IS_V2_SIZE(height, width) ? 8 : 4;
+    
+    TileJob_t job;
+    UI8 *p_buf_base = p_buf, *p_scratch = NULL;
+    I64  n_tile, ret = 0;
+    int  k;
+    
+    if (decode) {
+        tile_h  = (*(p_buf++)) << 8;
+        tile_h +=  *(p_buf++);
+        tile_w  = (*(p_buf++)) << 8;
+        tile_w +=  *(p_buf++);
+        if (tile_h < MIN(MIN_TILE_SIZE, height) || tile_w < MIN(MIN_TILE_SIZE, width))
+            return -1;
+    } else {
+        *(p_buf++) = (UI8)(tile_h >> 8);
+        *(p_buf++) = (UI8)(tile_h >> 0);
+        *(p_buf++) = (UI8)(tile_w >> 8);
+        *(p_buf++) = (UI8)(tile_w >> 0);
     }
     
+    job.decode    = decode;
+    job.p_img     = p_img;
+    job.p_img_out = p_img_out;
+    job.height    = height;
+    job.width     = width;
+    job.near      = near;
+    job.k_step    = k_step;
+    job.effort    = effort;
+    job.flags     = flags;
+    job.tile_h    = tile_h;
+    job.tile_w    = tile_w;
+    job.n_tile_x  = (width + tile_w - 1) / tile_w;
+    
+    n_tile = (I64)job.n_tile_x * ((height + tile_h - 1) / tile_h);
+    
+    if (n_tile > MAX_N_TILE)
+        return -1;
+    
+    job.pp_tile = (UI8**)malloc(sizeof(UI8*) * n_tile);
+    job.p_len   = (I64*) malloc(sizeof(I64)  * n_tile);
     
-    for (i=0; i<(*p_height); i++) {
-        int err = 0;
+    if (!decode)
+        p_scratch = (UI8*)malloc((size_t)2 * height * width + (size_t)TILE_EXTRA_BYTES * n_tile);
+    
+    if (job.pp_tile == NULL || job.p_len == NULL || (!decode && p_scratch == NULL)) {
+        free(job.pp_tile);
+        free(job.p_len);
+        free(p_scratch);
+        return -1;
+    }
+    
+    if (decode) {
+        UI8 *p_data = p_buf + offset_bytes * n_tile;
+        for (k=0; k<n_tile; k++) {
+            I64 offset = getBytes(&p_buf, offset_bytes-4);                 // the high 32 bits of a 64-bit offset
+            offset = (offset << 16 << 16) | getBytes(&p_buf, 4);
+            job.pp_tile[k] = p_data + offset;
+        }
+    } else {
+        UI8 *p_slot = p_scratch;
+        for (k=0; k<n_tile; k++) {
+            const int th = MIN(tile_h, height - (k / job.n_tile_x) * tile_h);
+            const int tw = MIN(tile_w, width  - (k % job.n_tile_x) * tile_w);
+            job.pp_tile[k] = p_slot;
+            p_slot += (size_t)2 * th * tw + TILE_EXTRA_BYTES;
+        }
+    }
+    
+    runParallel(n_thread, n_tile, codeTileTask, (void*)&job);
+    
+    for (k=0; k<n_tile; k++)
+        if (job.p_len[k] < 0)
+            ret = -1;
+    
+    if (ret == 0 && !decode) {
+        UI8 *p_data = p_buf + offset_bytes * n_tile;
+        I64  offset = 0;
         
-        if (verbose) {
-            if ((i&0x7) == 0) {
-                printf("\r    effort=%d, %s row %d (%.2lf%%)" , (*p_effort), (decode?"decoding":"encoding"), i, (100.0*i)/(*p_height));
-                fflush(stdout);
-            }
+        for (k=0; k<n_tile; k++) {                                         // put the offset table
+            putBytes(&p_buf, (U32)(offset >> 16 >> 16), offset_bytes-4);
+            putBytes(&p_buf, (U32)offset, 4);
+            offset += job.p_len[k];
         }
         
-        if (avp_enable) {
-            SET_ARRAY_ZERO(p_E, m);
-            AVPprecalcuate(m, p_F_row, p_B_row, (*p_width));
+        for (k=0; k<n_tile; k++) {                                         // concatenate the tile streams
+            I64 l;
+            for (l=0; l<job.p_len[k]; l++)
+                *(p_data++) = job.pp_tile[k][l];
         }
         
-        for (j=0; j<(*p_width); j++) {
-            int a, b, c, d, e, f, g, h, q, r, s, t;
-            int px1_vld=0, px2_vld=0;
-            I64 bias1=0, bias2=0, px1f=0, px2f=0;
-            int px0, px;
-            int qu, qv, qw, adr, sign, x, y=0, z=0;
-            
-            sampleNeighbourPixels(p_img_out, (*p_width), i, j, &a, &b, &c, &d, &e, &f, &g, &h, &q, &r, &s, &t);
+        ret = p_data - p_buf_base;
+    }
+    
+    free(job.pp_tile);
+    free(job.p_len);
+    free(p_scratch);
+    
+    return ret;
+}
+
+
+
+// tile_size : encode to a tiled stream of tile_size x tile_size tiles, 0 : not tiled (only used when encoding)
+// n_thread  : the number of threads that code the tiles. when encoding a stream that is not tiled, n_thread>1 enables the pipelined encoder
+static I64 NBLICcodec (NBLICctx_t *p_ctx, int verbose, int decode, UI8 *p_buf, const UI8 *p_img, UI8 *p_img_out, int *p_height, int *p_width, int *p_near, int *p_effort, int *p_wavefront, int tile_size, int n_thread) {
+    int n_channel=1, k_step, effort, flags=0;
+    
+    I64 len;
+    
+    UI8 *p_buf_base = p_buf;
+    
+    if (decode) {
+        if (getHeader(&p_buf, &n_channel, p_height, p_width, p_near, &k_step, &effort, &flags))
+            return -1;
+        *p_wavefront = (flags & WAVEFRONT_FLAG) ? 1 : 0;
+    } else {
+        *p_near   = CLIP(*p_near, 0, MAX_NEAR);
+        k_step    = CLIP(MIN_K_STEP+2*(*p_near), MIN_K_STEP, N_QD);
+        effort    = CLIP_EFFORT((*p_effort) & ~NBLIC_OPTIONS);
+        flags     = ((*p_wavefront) ? WAVEFRONT_FLAG : 0) | ((tile_size > 0) ? TILED_FLAG : 0) | ((*p_effort) & NBLIC_OPTIONS);
+        putHeader(&p_buf, n_channel, *p_height, *p_width, *p_near, k_step, effort, flags);
+    }
+    
+    *p_effort = effort | (flags & NBLIC_OPTIONS);
+    
+    if (checkParam(*p_height, *p_width, n_channel, *p_near, k_step, effort))
+        return -1;
+    
+    if (flags & TILED_FLAG) {
+        tile_size = CLIP(tile_size, MIN_TILE_SIZE, MAX_TILE_SIZE);
+        while (tile_size < MAX_TILE_SIZE && ((I64)(*p_height + tile_size - 1) / tile_size) * ((*p_width + tile_size - 1) / tile_size) > MAX_N_TILE)
+            tile_size = MIN(2 * tile_size, MAX_TILE_SIZE);
+        len = codeTiles(decode, p_buf, p_img, p_img_out, *p_height, *p_width, *p_near, k_step, effort, flags, MIN(tile_size, *p_height), MIN(tile_size, *p_width), n_thread);
+    } else {
+        NBLICctx_t ctx;
+        if (p_ctx == NULL) {                                   // a temporary context
+            p_ctx = &ctx;
+            initContext(p_ctx);
+        }
+        len = codeImage(p_ctx, verbose, decode, p_buf, p_img, p_img_out, *p_height, *p_width, *p_near, k_step, effort, flags, (n_thread > 1));
+        if (p_ctx == &ctx)
+            freeContextBuffers(p_ctx);
+    }
+    
+    if (len < 0)
+        return -1;
+    else if (decode)
+        return 0;
+    else
+        return (p_buf - p_buf_base) + len;
+}
+
+
+
+// Multithread wavefront encoder --------------------------------------------------------------------------
+// the rows are distributed to the subthreads in turn (row i -> thread i%n_thread), each thread models its rows (AVP, quantized delta, and context address),
+// while the calling thread does the context correction and the entropy coding in raster order.
+// a thread posts sem_seg after each segment for the thread of the next row, and posts sem_out for the calling thread.
+// it only works for the lossless mode, since a lossy reconstructed pixel depends on the context correction, which is done in raster order.
+// the models of all pixels are kept (the subthreads can run ahead of the calling thread), so a larger image is encoded by the single-thread path.
+#define    WF_MT_MAX_IMG_SIZE     100000000
+
+typedef struct {
+    const UI8    *p_img;
+    int           height;
+    int           width;
+    int           n_thread;
+    int           i_thd;
+    int          *p_abort;                 // set by the calling thread if not all the subthreads are started
+    AVPstate_t    avp;
+    I64          *p_bias_seed;             // the bias of each row after its first segment
+    PixelModel_t *p_pm;                    // the models of all pixels
+    Semaphore_t  *p_sem_start;
+    Semaphore_t  *p_sem_seg;               // [n_thread]
+    Semaphore_t  *p_sem_out;               // [n_thread]
+} WavefrontArg_t;
+
+
+static void WavefrontThreadFunc (void *arg) {
+    WavefrontArg_t *p_arg = (WavefrontArg_t*)arg;
+    const int height   = p_arg->height;
+    const int width    = p_arg->width;
+    const int n_thread = p_arg->n_thread;
+    const int i_thd    = p_arg->i_thd;
+    const int n_seg    = (width + WF_SEG - 1) / WF_SEG;
+    AVPstate_t *p_avp  = &p_arg->avp;
+    int i, j;
+    
+    semaphoreWait(p_arg->p_sem_start);
+    
+    if (*(p_arg->p_abort))
+        return;
+    
+    for (i=i_thd; i<height; i+=n_thread) {
+        Semaphore_t *p_sem_above = &p_arg->p_sem_seg[(i_thd + n_thread - 1) % n_thread];
+        int err = 0, n_seg_above = 0;
+        
+        for (j=0; j<width; j++) {
+            int a, b, c, d, e, f, g, h, q, r, s, t, x;
             
-            if (avp_enable) {
-                AVPgetVecN(vec_n, n, a, b, c, d, e, f, g, h, q, r, s, t);
-                
-                p_B = p_B_row + (m * j);
-                p_F = p_F_row + (m * j);
+            if ((j % WF_SEG) == 0) {
+                if (i > 0) {                                               // wait for the row above to finish the next segment
+                    for (; n_seg_above < MIN(j/WF_SEG+2, n_seg); n_seg_above++)
+                        semaphoreWait(p_sem_above);
+                }
                 
-                bias1 = bias * BIAS_COEF / (BIAS_COEF+1);
-                bias2 = bias * (BIAS_COEF+1) / BIAS_COEF;
-                bias1 = CLIP(bias1, -1, bias-1);
-                bias2 = CLIP(bias2, bias+1, BIAS_MAX+1);
-                bias1 = CLIP(bias1, 0, BIAS_MAX);
-                bias2 = CLIP(bias2, 0, BIAS_MAX);
+                if (j == 0)
+                    AVPstartRow(p_avp, (i > 0) ? p_arg->p_bias_seed[i-1] : BIAS_INIT);
                 
-                px1_vld = AVPpredict(n, m, p_E, p_F, vec_n, bias1, &px1f);
-                px2_vld = AVPpredict(n, m, p_E, p_F, vec_n, bias2, &px2f);
-            }
-            
-            if (px1_vld) {
-                px0 = (int)((px1f + (1<<FB1>>1)) >> FB1);
-            } else {
-                px0 = simplePredict(a, b, c, d, e, f, g, h, q, r, s);
-                px1f = px0 << FB1;
-            }
-            
-            getQuantizedDelta(a, b, c, d, e, f, g, err, &qu, &qv, &qw);
-            
-            adr = getContextAddress(a, b, c, d, e, f, qu, px0);
-            
-            px = correctPxByContext(ctx_array[adr], px0, &sign);
-            
-            if (!decode) {
-                x = G2D(p_img, *p_width, i, j);
-                y = mapXtoY(x, px, sign, *p_near);
-                z = mapYtoZ(&maps[px][sign], y);
+                if (p_avp->n > 0)
+                    AVPprecalcuate(p_avp->m, p_avp->p_F_row, p_avp->p_B_row, j, MIN(j+WF_F_COLS, width));
             }
             
-            Zcodec(&codec, k_step, bc_tree, qu, qv, qw, &z);
+            sampleNeighbourPixels(p_arg->p_img, width, i, j, &a, &b, &c, &d, &e, &f, &g, &h, &q, &r, &s, &t);
             
-            if (decode)
-                y = mapZtoY(&maps[px][sign], z);
+            modelPixel(p_avp, p_avp->n, p_avp->fast, j, err, a, b, c, d, e, f, g, h, q, r, s, t, &G2D(p_arg->p_pm, width, i, j));
             
-            addY(&maps[px][sign], y);
+            x   = G2D(p_arg->p_img, width, i, j);
+            err = CLIP((x-G2D(p_arg->p_pm, width, i, j).px0), MIN_PX_INC, MAX_PX_INC);
             
-            x = mapYtoX(y, px, sign, *p_near);
+            AVPupdatePixel(p_avp, p_avp->n, p_avp->fast, x);
             
-            G2D(p_img_out, (*p_width), i, j) = (UI8)x;
+            if (j == MIN(WF_SEG, width)-1)
+                p_arg->p_bias_seed[i] = p_avp->bias;
             
-            err = CLIP((x-px0), MIN_PX_INC, MAX_PX_INC);
-            
-            updateContext(&ctx_array[adr], err);
+            if (((j+1) % WF_SEG) == 0 || j+1 == width) {
+                semaphorePost(&p_arg->p_sem_seg[i_thd]);
+                semaphorePost(&p_arg->p_sem_out[i_thd]);
+            }
+        }
+    }
+}
+
+
+// return:
+//    positive value : compressed stream length
+//                -1 : failed to start (no memory or threads, or the image is too large), nothing is written
+static I64 NBLICcompressWavefrontMultiThread (int verbose, UI8 *p_buf, const UI8 *p_img, int height, int width, int effort, int options, int n_thread) {
+    const int n      = N_LIST[effort];
+    const int m      = GET_M(n);
+    const int k_step = MIN_K_STEP;                             // near=0
+    
+    int i, j, i_thd, n_started=0, abort=0, n_sem=0;
+    
+    I64 ret = -1;
+    
+    Model_t model;
+    
+    CODEC_t codec;
+    
+    UI8 *p_buf_base = p_buf;
+    
+    Thread_t       threads     [MAX_N_THREAD];
+    WavefrontArg_t threads_arg [MAX_N_THREAD];
+    Semaphore_t    sem_seg     [MAX_N_THREAD];
+    Semaphore_t    sem_out     [MAX_N_THREAD];
+    Semaphore_t    sem_start;
+    
+    I64          *p_B_row, *p_bias_seed;
+    PixelModel_t *p_pm;
+    
+    if (checkParam(height, width, 1, 0, k_step, effort) || (I64)height * width > WF_MT_MAX_IMG_SIZE)
+        return -1;
+    
+    p_bias_seed = (I64*)malloc(sizeof(I64) * height + sizeof(I64) * m * (width + F_ROW_COLS(width, 1) * n_thread));
+    p_pm        = (PixelModel_t*)malloc(sizeof(PixelModel_t) * height * width);
+    
+    if (p_bias_seed == NULL || p_pm == NULL || semaphoreInit(&sem_start, 0, n_thread)) {
+        free(p_bias_seed);
+        free(p_pm);
+        return -1;
+    }
+    
+    for (n_sem=0; n_sem<n_thread; n_sem++) {
+        if (semaphoreInit(&sem_seg[n_sem], 0, 0x7FFFFFFF))
+            break;
+        if (semaphoreInit(&sem_out[n_sem], 0, 0x7FFFFFFF)) {
+            semaphoreDestroy(&sem_seg[n_sem]);
+            break;
+        }
+    }
+    
+    p_B_row = p_bias_seed + height;
+    SET_ARRAY_ZERO(p_B_row, width * m);
+    
+    for (i_thd=0; i_thd<n_thread; i_thd++) {
+        WavefrontArg_t *p_arg = &threads_arg[i_thd];
+        p_arg->p_img       = p_img;
+        p_arg->height      = height;
+        p_arg->width       = width;
+        p_arg->n_thread    = n_thread;
+        p_arg->i_thd       = i_thd;
+        p_arg->p_abort     = &abort;
+        p_arg->avp.n       = n;
+        p_arg->avp.m       = m;
+        p_arg->avp.fast    = (effort == FAST_AVP_EFFORT);
+        p_arg->avp.wavefront = 1;
+        p_arg->avp.p_B_row = p_B_row;
+        p_arg->avp.p_F_row = p_B_row + m * (width + F_ROW_COLS(width, 1) * i_thd);
+        p_arg->p_bias_seed = p_bias_seed;
+        p_arg->p_pm        = p_pm;
+        p_arg->p_sem_start = &sem_start;
+        p_arg->p_sem_seg   = sem_seg;
+        p_arg->p_sem_out   = sem_out;
+    }
+    
+    if (n_sem == n_thread) {
+        for (n_started=0; n_started<n_thread; n_started++)
+            if (threadCreate(&threads[n_started], WavefrontThreadFunc, (void*)(&threads_arg[n_started])))
+                break;
+    }
+    
+    abort = (n_started < n_thread);                                    // the rows of a missing thread cannot be modeled, stop all the subthreads
+    
+    for (i_thd=0; i_thd<n_started; i_thd++)
+        semaphorePost(&sem_start);
+    
+    if (!abort) {
+        putHeader(&p_buf, 1, height, width, 0, k_step, effort, WAVEFRONT_FLAG | options);
+        
+        codec = newCodec(0, p_buf);
+        
+        codec.fast_prob = (options & NBLIC_FAST_PROB) ? 1 : 0;
+        codec.multi_sym = (options & NBLIC_MULTI_SYM) ? 1 : 0;
+        
+        initModel(&model, codec.fast_prob);
+        
+        for (i=0; i<height; i++) {
+            if (verbose)
+                printProgress(effort, 0, i, height);
             
-            if (avp_enable) {
-                I64 s_curr = ABS(px1f - (x<<FB1));
-                I64 s_sum  = (p_E[0] + p_F[0]) + (s_curr * BETA / (BETA-1));
-                
-                AVPupdate(n, m, p_E, p_B, vec_n, x, s_curr, s_sum);
+            for (j=0; j<width; j++) {
+                if ((j % WF_SEG) == 0)
+                    semaphoreWait(&sem_out[i % n_thread]);
                 
-                if (px1_vld && px2_vld) {
-                    px1f = ABS(px1f - (x<<FB1));
-                    px2f = ABS(px2f - (x<<FB1));
-                    bias = (px1f > px2f) ? bias2 : bias1;
-                }
+                codePixel(&codec, 0, k_step, 0, &model, &G2D(p_pm, width, i, j), G2D(p_img, width, i, j));
             }
         }
+        
+        if (verbose)
+            printf("\r                                                                        \r");
+        
+        flushEncoder(&codec);
+        
+        ret = codec.p_buf - p_buf_base;
     }
     
-    if (verbose)
-        printf("\r                                                                        \r");
+    for (i_thd=0; i_thd<n_started; i_thd++)
+        threadJoin(threads[i_thd]);
+    
+    for (i_thd=0; i_thd<n_sem; i_thd++) {
+        semaphoreDestroy(&sem_seg[i_thd]);
+        semaphoreDestroy(&sem_out[i_thd]);
+    }
+    semaphoreDestroy(&sem_start);
     
-    free(p_B_row);
+    free(p_bias_seed);
+    free(p_pm);
     
-    flushEncoder(&codec);
+    return ret;
+}
+
+
+
+// return :
+//    positive value : compressed stream length
+//                -1 : failed
+int64_t NBLICcompress (int verbose, UI8 *p_buf, const UI8 *p_img, int height, int width, int *p_near, int *p_effort) {
+    int wavefront = 0;
+    return NBLICcodec(NULL, verbose, 0, p_buf, p_img, NULL, &height, &width, p_near, p_effort, &wavefront, 0, 1);
+}
+
+
+
+// return :
+//    positive value : compressed stream length
+//                -1 : failed
+int64_t NBLICcompressMultiThread (int verbose, UI8 *p_buf, const UI8 *p_img, int height, int width, int *p_near, int *p_effort, int n_thread) {
+    int wavefront = 0;
     
-    if (decode)
-        return 0;
-    else
-        return codec.p_buf - p_buf_base;
+    if (n_thread <= 0)
+        n_thread = getCPUCount();                                      // auto : use all CPU cores
+    
+    return NBLICcodec(NULL, verbose, 0, p_buf, p_img, NULL, &height, &width, p_near, p_effort, &wavefront, 0, n_thread);
 }
 
 
@@ -912,8 +2430,78 @@ static int NBLICcodec (int verbose, int decode, UI8 *p_buf, UI8 *p_img, UI8 *p_i
 // return :
 //    positive value : compressed stream length
 //                -1 : failed
-int NBLICcompress (int verbose, UI8 *p_buf, UI8 *p_img, int height, int width, int *p_near, int *p_effort) {
-    return NBLICcodec(verbose, 0, p_buf, p_img, p_img, &height, &width, p_near, p_effort);
+int64_t NBLICcompressWavefront (int verbose, UI8 *p_buf, const UI8 *p_img, int height, int width, int *p_near, int *p_effort, int n_thread) {
+    int wavefront = 1;
+    
+    if (n_thread <= 0)
+        n_thread = getCPUCount();                                      // auto : use all CPU cores
+    n_thread = MIN(n_thread, MAX_N_THREAD);
+    
+    if (n_thread > 1 && *p_near <= 0) {                                // the lossless mode can be modeled by multiple threads
+        int effort = CLIP_EFFORT((*p_effort) & ~NBLIC_OPTIONS);
+        I64 len;
+        len = NBLICcompressWavefrontMultiThread(verbose, p_buf, p_img, height, width, effort, (*p_effort) & NBLIC_OPTIONS, n_thread);
+        if (len >= 0) {
+            *p_near   = 0;
+            *p_effort = effort | ((*p_effort) & NBLIC_OPTIONS);
+            return len;
+        }
+    }
+    
+    return NBLICcodec(NULL, verbose, 0, p_buf, p_img, NULL, &height, &width, p_near, p_effort, &wavefront, 0, n_thread);   // not modeled by multiple threads, but still pipelined
+}
+
+
+
+// return :
+//    positive value : compressed stream length
+//                -1 : failed
+int64_t NBLICcompressTiled (int verbose, UI8 *p_buf, const UI8 *p_img, int height, int width, int *p_near, int *p_effort, int tile_size, int wavefront, int n_thread) {
+    if (n_thread <= 0)
+        n_thread = getCPUCount();                                      // auto : use all CPU cores
+    n_thread = MIN(n_thread, MAX_N_THREAD);
+    
+    wavefront = wavefront ? 1 : 0;
+    
+    return NBLICcodec(NULL, verbose, 0, p_buf, p_img, NULL, &height, &width, p_near, p_effort, &wavefront, MAX(tile_size, 1), n_thread);
+}
+
+
+
+void NBLICgetWorkingSetSize (int width, int effort, int *p_model_size, int *p_row_size) {
+    const int n = N_LIST[CLIP_EFFORT(effort & ~NBLIC_OPTIONS)];
+    *p_model_size = (int)sizeof(Model_t);
+    *p_row_size   = 3 * LINE_LEN(width) + 2 * width;                   // the line buffer and the head buffer
+    if (n > 0)
+        *p_row_size += width * GET_M(n) * 2 * (int)sizeof(I64);        // AVP B and F of a row
+}
+
+
+
+// return :
+//                 0 : success
+//                -1 : failed
+int NBLICgetImageSize (const UI8 *p_buf, I64 len, int *p_height, int *p_width) {
+    UI8  head [MAX_HEADER_LEN] = {0};
+    UI8 *p_head = head;
+    int  i, n_channel, near, k_step, effort, flags;
+    
+    for (i=0; i<MAX_HEADER_LEN && i<len; i++)
+        head[i] = p_buf[i];
+    
+    if (getHeader(&p_head, &n_channel, p_height, p_width, &near, &k_step, &effort, &flags) || (p_head - head) > len)
+        return -1;
+    
+    return checkSize(*p_height, *p_width);
+}
+
+
+
+// the tile streams are at most 2 bytes per pixel plus TILE_EXTRA_BYTES (see codeTiles), and the untiled stream is like one tile
+int64_t NBLICgetStreamBound (int height, int width) {
+    I64 n_tile = ((I64)(height + MIN_TILE_SIZE - 1) / MIN_TILE_SIZE) * ((width + MIN_TILE_SIZE - 1) / MIN_TILE_SIZE);
+    n_tile = MIN(n_tile, MAX_N_TILE);
+    return MAX_HEADER_LEN + 4 + (I64)2 * height * width + (8 + TILE_EXTRA_BYTES) * n_tile;
 }
 
 
@@ -922,5 +2510,261 @@ int NBLICcompress (int verbose, UI8 *p_buf, UI8 *p_img, int height, int width, i
 //                 0 : success
 //                -1 : failed
 int NBLICdecompress (int verbose, UI8 *p_buf, UI8 *p_img, int *p_height, int *p_width, int *p_near, int *p_effort) {
-    return NBLICcodec(verbose, 1, p_buf, NULL, p_img, p_height, p_width, p_near, p_effort);
+    return NBLICdecompressMultiThread(verbose, p_buf, p_img, p_height, p_width, p_near, p_effort, 1);
+}
+
+
+
+// return :
+//                 0 : success
+//                -1 : failed
+int NBLICdecompressMultiThread (int verbose, UI8 *p_buf, UI8 *p_img, int *p_height, int *p_width, int *p_near, int *p_effort, int n_thread) {
+    int wavefront = 0;
+    
+    if (n_thread <= 0)
+        n_thread = getCPUCount();                                      // auto : use all CPU cores
+    n_thread = MIN(n_thread, MAX_N_THREAD);
+    
+    return (int)NBLICcodec(NULL, verbose, 1, p_buf, NULL, p_img, p_height, p_width, p_near, p_effort, &wavefront, 0, n_thread);
+}
+
+
+
+NBLICctx_t *NBLICcreateContext (void) {
+    NBLICctx_t *p_ctx = (NBLICctx_t*)malloc(sizeof(NBLICctx_t));
+    if (p_ctx != NULL)
+        initContext(p_ctx);
+    return p_ctx;
+}
+
+
+void NBLICresetContext (NBLICctx_t *p_ctx) {
+    if (p_ctx != NULL)
+        freeContextBuffers(p_ctx);
+}
+
+
+void NBLICdestroyContext (NBLICctx_t *p_ctx) {
+    if (p_ctx != NULL) {
+        freeContextBuffers(p_ctx);
+        free(p_ctx);
+    }
+}
+
+
+int64_t NBLICcompressWithContext (NBLICctx_t *p_ctx, int verbose, UI8 *p_buf, const UI8 *p_img, int height, int width, int *p_near, int *p_effort) {
+    int wavefront = 0;
+    if (p_ctx == NULL)
+        return -1;
+    return NBLICcodec(p_ctx, verbose, 0, p_buf, p_img, NULL, &height, &width, p_near, p_effort, &wavefront, 0, 1);
+}
+
+
+int NBLICdecompressWithContext (NBLICctx_t *p_ctx, int verbose, UI8 *p_buf, UI8 *p_img, int *p_height, int *p_width, int *p_near, int *p_effort) {
+    int wavefront = 0;
+    if (p_ctx == NULL)
+        return -1;
+    return (int)NBLICcodec(p_ctx, verbose, 1, p_buf, NULL, p_img, p_height, p_width, p_near, p_effort, &wavefront, 0, 1);
+}
+
+
+
+// Streaming encoder ---------------------------------------------------------------------------------------
+// the rows are pushed in raster order, and the stream is sent to the write callback in chunks of STREAM_CHUNK bytes as the coder emits it,
+// so that the memory does not depend on the image height. the stream is the same as NBLICcompress.
+struct NBLICencoder_t {
+    NBLICctx_t   ctx;
+    ImageCoder_t ic;
+    ChunkIO_t    io;
+    int          height, width;
+    int          i;                           // the next row to push
+    UI8          chunk [STREAM_CHUNK + 4];    // flushEncoder may write 4 bytes after the limit
+};
+
+
+NBLICencoder_t *NBLICencoderBegin (int height, int width, int *p_near, int *p_effort, NBLICwrite_t p_write, void *p_user) {
+    int k_step, effort, flags;
+    
+    UI8 *p_buf;
+    
+    NBLICencoder_t *p_enc;
+    
+    if (p_write == NULL)
+        return NULL;
+    
+    *p_near   = CLIP(*p_near, 0, MAX_NEAR);
+    k_step    = CLIP(MIN_K_STEP+2*(*p_near), MIN_K_STEP, N_QD);
+    effort    = CLIP_EFFORT((*p_effort) & ~NBLIC_OPTIONS);
+    flags     = (*p_effort) & NBLIC_OPTIONS;
+    *p_effort = effort | flags;
+    
+    if (checkParam(height, width, 1, *p_near, k_step, effort))
+        return NULL;
+    
+    p_enc = (NBLICencoder_t*)malloc(sizeof(NBLICencoder_t));
+    if (p_enc == NULL)
+        return NULL;
+    
+    initContext(&p_enc->ctx);
+    
+    p_enc->height = height;
+    p_enc->width  = width;
+    p_enc->i      = 0;
+    
+    p_enc->io.p_write = p_write;
+    p_enc->io.p_read  = NULL;
+    p_enc->io.p_user  = p_user;
+    p_enc->io.p_chunk = p_enc->chunk;
+    p_enc->io.n_byte  = 0;
+    p_enc->io.err     = 0;
+    
+    p_buf = p_enc->chunk;
+    putHeader(&p_buf, 1, height, width, *p_near, k_step, effort, flags);   // the header goes with the first chunk
+    
+    if (startImage(&p_enc->ic, &p_enc->ctx, 0, p_buf, width, *p_near, k_step, effort, flags, 0)) {
+        freeContextBuffers(&p_enc->ctx);
+        free(p_enc);
+        return NULL;
+    }
+    
+    p_enc->ic.codec.p_buf_lim = p_enc->chunk + STREAM_CHUNK;
+    p_enc->ic.codec.p_io      = &p_enc->io;
+    
+    return p_enc;
+}
+
+
+int NBLICencoderPushRows (NBLICencoder_t *p_enc, const UI8 *p_rows, int n_row) {
+    if (p_enc == NULL || p_rows == NULL || n_row < 0 || n_row > p_enc->height - p_enc->i)
+        return -1;
+    
+    for (; n_row>0; n_row--) {
+        codeImageRow(&p_enc->ic, p_rows, NULL, p_enc->i);
+        p_rows += p_enc->width;
+        p_enc->i ++;
+    }
+    
+    return p_enc->io.err ? -1 : 0;
+}
+
+
+int64_t NBLICencoderEnd (NBLICencoder_t *p_enc) {
+    I64 ret = -1;
+    
+    if (p_enc == NULL)
+        return -1;
+    
+    if (p_enc->i == p_enc->height) {
+        finishImage(&p_enc->ic);
+        chunkWrite(&p_enc->ic.codec);
+        if (!p_enc->io.err)
+            ret = p_enc->io.n_byte;
+    }
+    
+    freeContextBuffers(&p_enc->ctx);
+    free(p_enc);
+    
+    return ret;
+}
+
+
+
+
+// Streaming decoder ---------------------------------------------------------------------------------------
+// the rows are decoded on demand, with the line buffer of the context as the only window of rows. the stream is read from a buffer,
+// or from a read callback in chunks of STREAM_CHUNK bytes. the tiled streams are not supported, since their tiles are not in raster order.
+struct NBLICdecoder_t {
+    NBLICctx_t   ctx;
+    ImageCoder_t ic;
+    ChunkIO_t    io;
+    int          height, width;
+    int          i;                           // the next row to decode
+    UI8          chunk [STREAM_CHUNK];
+};
+
+
+// p_read : the read callback, or NULL to read the stream from p_buf
+static NBLICdecoder_t *openDecoder (NBLICread_t p_read, void *p_user, UI8 *p_buf, int *p_height, int *p_width, int *p_near, int *p_effort) {
+    int n_channel, k_step, effort, flags;
+    
+    NBLICdecoder_t *p_dec = (NBLICdecoder_t*)malloc(sizeof(NBLICdecoder_t));
+    
+    if (p_dec == NULL)
+        return NULL;
+    
+    initContext(&p_dec->ctx);
+    
+    p_dec->i = 0;
+    
+    p_dec->io.p_write = NULL;
+    p_dec->io.p_read  = p_read;
+    p_dec->io.p_user  = p_user;
+    p_dec->io.p_chunk = p_dec->chunk;
+    p_dec->io.n_byte  = 0;
+    p_dec->io.err     = 0;
+    
+    if (p_read) {                             // the header and the first bytes of the stream are in the first chunk
+        p_dec->ic.codec.p_io = &p_dec->io;
+        chunkRead(&p_dec->ic.codec);
+        p_buf = p_dec->chunk;
+    }
+    
+    if (getHeader(&p_buf, &n_channel, p_height, p_width, p_near, &k_step, &effort, &flags) ||
+        checkParam(*p_height, *p_width, n_channel, *p_near, k_step, effort)                 ||
+        (flags & TILED_FLAG)                                                                ||
+        startImage(&p_dec->ic, &p_dec->ctx, 1, p_buf, *p_width, *p_near, k_step, effort, flags, 0) ) {
+        freeContextBuffers(&p_dec->ctx);
+        free(p_dec);
+        return NULL;
+    }
+    
+    *p_effort = effort | (flags & NBLIC_OPTIONS);
+    
+    p_dec->height = *p_height;
+    p_dec->width  = *p_width;
+    
+    if (p_read) {
+        p_dec->ic.codec.p_buf_lim = p_dec->chunk + STREAM_CHUNK;
+        p_dec->ic.codec.p_io      = &p_dec->io;
+    }
+    
+    return p_dec;
+}
+
+
+NBLICdecoder_t *NBLICdecoderOpen (NBLICread_t p_read, void *p_user, int *p_height, int *p_width, int *p_near, int *p_effort) {
+    if (p_read == NULL)
+        return NULL;
+    return openDecoder(p_read, p_user, NULL, p_height, p_width, p_near, p_effort);
+}
+
+
+NBLICdecoder_t *NBLICdecoderOpenBuffer (UI8 *p_buf, int *p_height, int *p_width, int *p_near, int *p_effort) {
+    if (p_buf == NULL)
+        return NULL;
+    return openDecoder(NULL, NULL, p_buf, p_height, p_width, p_near, p_effort);
+}
+
+
+int NBLICdecoderReadRows (NBLICdecoder_t *p_dec, UI8 *p_rows, int n_row) {
+    int n_done = 0;
+    
+    if (p_dec == NULL || p_rows == NULL || n_row < 0)
+        return -1;
+    
+    for (; n_done<n_row && p_dec->i<p_dec->height; n_done++) {
+        codeImageRow(&p_dec->ic, NULL, p_rows, p_dec->i);
+        p_rows += p_dec->width;
+        p_dec->i ++;
+    }
+    
+    return p_dec->io.err ? -1 : n_done;
+}
+
+
+void NBLICdecoderClose (NBLICdecoder_t *p_dec) {
+    if (p_dec != NULL) {
+        freeContextBuffers(&p_dec->ctx);
+        free(p_dec);
+    }
 }
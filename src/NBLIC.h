@@ -26,9 +26,28 @@
 #define   __NBLIC_H__
 
 
-#define    NBLIC_MAX_HEIGHT    65535
-#define    NBLIC_MAX_WIDTH     65535
-#define    NBLIC_MAX_IMG_SIZE  100000000
+#include <stdint.h>
+
+
+// an image higher or wider than 65535 pixels is stored with the v2 header (32-bit height and width), which older versions cannot decode.
+// the image size is only limited by memory : the buffer sizes and the stream lengths are 64-bit.
+#define    NBLIC_MAX_HEIGHT    1048576
+#define    NBLIC_MAX_WIDTH     1048576
+#define    NBLIC_MAX_IMG_SIZE  ((int64_t)NBLIC_MAX_HEIGHT * NBLIC_MAX_WIDTH)
+
+
+// options, which can be OR-ed into the effort value when compressing. they are stored in the stream, and are also OR-ed into the effort value got by decompressing.
+#define    NBLIC_FAST_PROB     0x20    // division-free probability model : each context keeps a probability which is updated by a reciprocal table, instead of bit counters.
+                                       //                                   faster decoding (about 7% for effort=1), with about the same compression ratio
+#define    NBLIC_MULTI_SYM     0x10    // multi-symbol coding : each residual is coded with an adaptive frequency table of its context, in one or two coder calls,
+                                       //                       instead of a unary prefix and a few bins.
+                                       //                       decoding is faster (about 30% for effort=1), at a cost of about 0.2~0.4% compression ratio
+#define    NBLIC_OPTIONS       (NBLIC_FAST_PROB | NBLIC_MULTI_SYM)
+
+
+// the effort value of the fast AVP level ("2.5") : it has the predictor of effort=3, but reuses the solution of the previous pixel instead of solving from scratch,
+// which gives about the compression ratio of effort=3 at about the speed of effort=2
+#define    NBLIC_EFFORT_2_5    4
 
 
 // function  : NBLIC image compress
@@ -37,6 +56,7 @@
 //    - verbose  : 1:print progress    0:don't print progress
 //    - p_buf    : Pointer to the compressed stream buffer. The buffer will be written.
 //    - p_img    : Pointer to the image pixel buffer. Each pixel is a 8-bit luminance value, which occupy an unsigned char. The buffer will be read. Pixels should be stored in this buffer in raster scan order (from left to right, from up to down).
+//                 The buffer is not modified, even when near>0 : the encoder keeps the reconstructed pixels in a small internal buffer.
 //    - height   : image height
 //    - width    : image width
 //    - p_near   : Pointer to the near value of near-lossless compression. The user should specify a near value in it.
@@ -46,12 +66,59 @@
 //                   1 : fastest and lowest compression ratio
 //                   2 : 
 //                   3 : slowest and highest compression ratio
+//                   NBLIC_EFFORT_2_5 : between 2 and 3
+//                 the other values are clipped to 1~3. the options (such as NBLIC_FAST_PROB) can be OR-ed into it
 //
 // return :
 //    - positive value : compressed stream length
 //                  -1 : failed
 //
-extern int NBLICcompress   (int verbose, unsigned char *p_buf, unsigned char *p_img, int height, int width, int *p_near, int *p_effort);
+extern int64_t NBLICcompress   (int verbose, unsigned char *p_buf, const unsigned char *p_img, int height, int width, int *p_near, int *p_effort);
+
+
+// function  : NBLIC image compress with multiple threads. the parameters and the return value are the same as NBLICcompress, except :
+//    - n_thread : number of threads, 0 means using all CPU cores.
+//                 when n_thread>1, the modeling and the arithmetic coding run on two threads as a pipeline. the stream is the same as NBLICcompress.
+//
+extern int64_t NBLICcompressMultiThread (int verbose, unsigned char *p_buf, const unsigned char *p_img, int height, int width, int *p_near, int *p_effort, int n_thread);
+
+
+// function  : NBLIC image compress to a wavefront stream. the parameters and the return value are the same as NBLICcompress, except :
+//    - n_thread : number of threads, 0 means using all CPU cores.
+//                 in the wavefront stream, the AVP of a row only depends on the row above up to a few columns on the right,
+//                 so that the rows are modeled in parallel. only the lossless mode (near=0) uses multiple threads.
+//                 the stream does not depend on n_thread, and is decompressed by NBLICdecompress.
+//
+extern int64_t NBLICcompressWavefront (int verbose, unsigned char *p_buf, const unsigned char *p_img, int height, int width, int *p_near, int *p_effort, int n_thread);
+
+
+// function  : NBLIC image compress to a tiled stream. the parameters and the return value are the same as NBLICcompress, except :
+//    - tile_size : the image is split into tiles of tile_size x tile_size pixels (16 ~ 16384), each tile is coded with fresh models,
+//                  so that the tiles are encoded and decoded in parallel. smaller tiles give more parallelism but lower compression ratio.
+//                  the tiles of a huge image are enlarged, so that there are at most 2^24 tiles.
+//    - wavefront : 1 : each tile is a wavefront stream    0 : normal
+//    - n_thread  : number of threads, 0 means using all CPU cores. the stream does not depend on n_thread.
+//
+extern int64_t NBLICcompressTiled (int verbose, unsigned char *p_buf, const unsigned char *p_img, int height, int width, int *p_near, int *p_effort, int tile_size, int wavefront, int n_thread);
+
+
+// function  : get the image size from the header of a NBLIC stream, without decoding it, for example to allocate the image buffer before NBLICdecompress
+//
+// parameter :
+//    - p_buf    : Pointer to the compressed stream, or its first len bytes
+//    - len      : the bytes in p_buf
+//    - p_height, p_width : Pointers to get the image height and width
+//
+// return :
+//    -   0 : success
+//    -  -1 : failed (not a NBLIC stream, or len is shorter than the header)
+//
+extern int NBLICgetImageSize (const unsigned char *p_buf, int64_t len, int *p_height, int *p_width);
+
+
+// function  : get the worst case length (in bytes) of the stream of a height x width image, for all the NBLICcompress* functions, to allocate p_buf
+//
+extern int64_t NBLICgetStreamBound (int height, int width);
 
 
 // function  : NBLIC image decompress
@@ -63,7 +130,7 @@ extern int NBLICcompress   (int verbose, unsigned char *p_buf, unsigned char *p_
 //    - p_height : Pointer to the image height. The user do not need to specify it, instead, he will get the image height in this pointer, which is parsed from the compressed file header.
 //    - p_width  : Pointer to the image width. The user do not need to specify it, instead, he will get the image width in this pointer, which is parsed from the compressed file header.
 //    - p_near   : Pointer to the near value of near-lossless compression. The user do not need to specify it, instead, he will get the near in this pointer, which is parsed from the compressed file header.
-//    - p_effort : Pointer to the effort value. The user do not need to specify it, instead, he will get the effort in this pointer, which is parsed from the compressed file header.
+//    - p_effort : Pointer to the effort value. The user do not need to specify it, instead, he will get the effort in this pointer, which is parsed from the compressed file header, with the options OR-ed into it.
 //
 // return :
 //    -   0 : success
@@ -72,4 +139,141 @@ extern int NBLICcompress   (int verbose, unsigned char *p_buf, unsigned char *p_
 extern int NBLICdecompress (int verbose, unsigned char *p_buf, unsigned char *p_img, int *p_height, int *p_width, int *p_near, int *p_effort);
 
 
+// function  : NBLIC image decompress with multiple threads. the parameters and the return value are the same as NBLICdecompress, except :
+//    - n_thread : number of threads, 0 means using all CPU cores. only the tiles of a tiled stream are decoded in parallel.
+//
+extern int NBLICdecompressMultiThread (int verbose, unsigned char *p_buf, unsigned char *p_img, int *p_height, int *p_width, int *p_near, int *p_effort, int n_thread);
+
+
+
+// function  : get the working set of NBLIC (effort=1~3 or NBLIC_EFFORT_2_5) in bytes, to check whether it fits the cache
+//
+// parameter :
+//    - width        : image width
+//    - effort       : effort value (1~3 or NBLIC_EFFORT_2_5), the options are ignored
+//    - p_model_size : Pointer to get the size of the adaptive model state (the contexts, the bin counters, and the mappers), which is accessed for every pixel.
+//                     it does not depend on the image.
+//    - p_row_size   : Pointer to get the size of the row state (the line buffer, and the AVP state of a row), which grows with the image width.
+//                     it is streamed once per row.
+//
+extern void NBLICgetWorkingSetSize (int width, int effort, int *p_model_size, int *p_row_size);
+
+
+
+// codec context : owns the model state and the scratch buffers of NBLIC (effort=1~3 or NBLIC_EFFORT_2_5), so that coding many images with one context
+// does not allocate and initialize them for each image : the buffers only grow when a wider image arrives, and the model is reset at the start of each image.
+// a context is used by one thread at a time. each thread of a batch should have its own context.
+typedef struct NBLICctx_t NBLICctx_t;
+
+
+// function  : create a codec context
+// return    : the context, or NULL if out of memory
+extern NBLICctx_t *NBLICcreateContext (void);
+
+
+// function  : release the scratch buffers of a context, for example after an unusually large image. the context is still usable.
+//             it is not needed between images, since compressing or decompressing always starts with a fresh model.
+extern void NBLICresetContext (NBLICctx_t *p_ctx);
+
+
+// function  : destroy a codec context, and release all its memory
+extern void NBLICdestroyContext (NBLICctx_t *p_ctx);
+
+
+// function  : NBLIC image compress with a context. the parameters and the return value are the same as NBLICcompress, except :
+//    - p_ctx    : the context
+//
+extern int64_t NBLICcompressWithContext (NBLICctx_t *p_ctx, int verbose, unsigned char *p_buf, const unsigned char *p_img, int height, int width, int *p_near, int *p_effort);
+
+
+// function  : NBLIC image decompress with a context. the parameters and the return value are the same as NBLICdecompress, except :
+//    - p_ctx    : the context. the tiled streams (NBLICcompressTiled) do not use it, since each tile is coded with its own buffers.
+//
+extern int NBLICdecompressWithContext (NBLICctx_t *p_ctx, int verbose, unsigned char *p_buf, unsigned char *p_img, int *p_height, int *p_width, int *p_near, int *p_effort);
+
+
+
+// streaming encoder : the rows are pushed in raster order, one or more at a time, and the stream is passed to a write callback as it is coded.
+// it only keeps a few rows and the model state (see NBLICgetWorkingSetSize), instead of the whole image and the whole stream. the stream is the same as NBLICcompress.
+typedef struct NBLICencoder_t NBLICencoder_t;
+
+
+// the write callback of the streaming encoder : write n_byte bytes of the stream. return 0 on success, non-zero on failure
+typedef int (*NBLICwrite_t) (void *p_user, const unsigned char *p_bytes, int n_byte);
+
+
+// function  : begin to compress an image with the streaming encoder. the header is written to p_write with the first chunk of the stream
+//
+// parameter :
+//    - height, width, p_near, p_effort : the same as NBLICcompress
+//    - p_write  : the write callback
+//    - p_user   : passed to p_write
+//
+// return    : the encoder, or NULL if failed (invalid parameters or out of memory)
+//
+extern NBLICencoder_t *NBLICencoderBegin (int height, int width, int *p_near, int *p_effort, NBLICwrite_t p_write, void *p_user);
+
+
+// function  : push the next n_row rows to the encoder. p_rows has n_row*width pixels in raster scan order, and is not used after the call returns.
+//
+// return :
+//    -   0 : success
+//    -  -1 : failed (the rows exceed the image height, or the write callback failed)
+//
+extern int NBLICencoderPushRows (NBLICencoder_t *p_enc, const unsigned char *p_rows, int n_row);
+
+
+// function  : finish the stream, and destroy the encoder. it is also used to abort an encoder before all rows are pushed.
+//
+// return :
+//    - positive value : the compressed stream length, including the header
+//                  -1 : failed (not all rows were pushed, or the write callback failed)
+//
+extern int64_t NBLICencoderEnd (NBLICencoder_t *p_enc);
+
+
+
+// streaming decoder : the rows are decoded on demand in raster order, so that the rows can be used before the whole image is decoded.
+// it only keeps a few rows and the model state, like the streaming encoder. the tiled streams (NBLICcompressTiled) are not supported.
+typedef struct NBLICdecoder_t NBLICdecoder_t;
+
+
+// the read callback of the streaming decoder : read up to n_byte bytes of the stream into p_bytes.
+// return the number of bytes read, 0 at the end of the input, or -1 on failure
+typedef int (*NBLICread_t) (void *p_user, unsigned char *p_bytes, int n_byte);
+
+
+// function  : open a stream with the streaming decoder, which reads the stream by the read callback in chunks of a few KB.
+//             the callback may be asked for more bytes than the stream has, so a stream followed by other data should be read from a buffer.
+//             like NBLICdecompress, the stream is not checked, so it should be complete : the bytes after the end of the input are decoded as zeros.
+//
+// parameter :
+//    - p_read   : the read callback
+//    - p_user   : passed to p_read
+//    - p_height, p_width, p_near, p_effort : to get the parameters in the header, the same as NBLICdecompress
+//
+// return    : the decoder, or NULL if failed (invalid header, tiled stream, or out of memory)
+//
+extern NBLICdecoder_t *NBLICdecoderOpen (NBLICread_t p_read, void *p_user, int *p_height, int *p_width, int *p_near, int *p_effort);
+
+
+// function  : open a stream in a buffer with the streaming decoder. the parameters are the same as NBLICdecoderOpen, except :
+//    - p_buf    : the compressed stream buffer, which is read until the decoder is closed
+//
+extern NBLICdecoder_t *NBLICdecoderOpenBuffer (unsigned char *p_buf, int *p_height, int *p_width, int *p_near, int *p_effort);
+
+
+// function  : decode the next n_row rows into p_rows (n_row*width pixels in raster scan order). fewer rows are decoded at the end of the image.
+//
+// return :
+//    - non-negative value : the number of decoded rows, 0 after the last row
+//                      -1 : failed (the read callback failed, the rows of this call are not valid)
+//
+extern int NBLICdecoderReadRows (NBLICdecoder_t *p_dec, unsigned char *p_rows, int n_row);
+
+
+// function  : close the streaming decoder, and release its memory. it may be closed before all rows are decoded.
+extern void NBLICdecoderClose (NBLICdecoder_t *p_dec);
+
+
 #endif // __NBLIC_H__
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "FileIO.h"
 #include "NBLIC.h"     // NBLIC effort  =0
@@ -21,11 +23,31 @@ const char *USAGE =
   "|            <output-file>      can only be .nblic                           |\n"
   "|     swiches:                                                               |\n"
   "|            -n<number> : near, can be 0 (lossless) or 1,2,3,... (lossy)     |\n"
-  "|            -e<number> : effort, can be 0 (fastest), 1, 2, or 3 (slowest)   |\n"
+  "|            -e<number> : effort, can be 0 (fastest), 1, 2, 2.5, or 3        |\n"
+  "|                         (slowest). 2.5 is about as good as 3, but faster   |\n"
   "|                         note: when using lossy(near>0), effort cannot be 0 |\n"
   "|            -v : verbose, print infomations                                 |\n"
   "|            -V : verbose, print infomations and progress                    |\n"
-  "|            -t : multithread speedup, currently only support -e0 on Windows |\n"
+  "|            -t<number> : multithread speedup, for all efforts               |\n"
+  "|                         <number> is thread count, omit it to use all CPUs  |\n"
+  "|            -l<number> : interleaved rANS lanes (1,2,4,8), for faster       |\n"
+  "|                         decoding of -e0, omit it to use legacy format      |\n"
+  "|            -s<number> : split -e0 image to independent stripes of <number> |\n"
+  "|                         rows, allows parallel encoding and decoding        |\n"
+  "|            -b<number> : histogram precision bits of -e0 (11~15, default 15)|\n"
+  "|                         11 or 12 gives faster decoding                     |\n"
+  "|            -k<number> : encode -e0 in blocks of <number> rows, which have  |\n"
+  "|                         own histograms, to bound the encoder memory        |\n"
+  "|                         (-s and -k cannot be used together)                |\n"
+  "|            -w : wavefront stream for -e1~3, whose rows can be modeled by   |\n"
+  "|                 multiple threads (-t) when lossless (-n0)                  |\n"
+  "|            -f : division-free probability model for -e1~3, which makes     |\n"
+  "|                 decoding faster with about the same compression ratio      |\n"
+  "|            -m : multi-symbol residual coding for -e1~3, which makes coding |\n"
+  "|                 faster at a cost of compression ratio                      |\n"
+  "|            -g<number> : split -e1~3 image to independent tiles of <number> |\n"
+  "|                         x <number> pixels, allows parallel encoding and    |\n"
+  "|                         decoding (-t)                                      |\n"
   "|                                                                            |\n"
   "| compression examples :                                                     |\n"
   "|   fastest lossless:    ./nblic_codec -c -V -n0 -e0 in.bmp out.nblic        |\n"
@@ -41,6 +63,8 @@ const char *USAGE =
   "|     swiches:                                                               |\n"
   "|            -v : verbose, print infomations                                 |\n"
   "|            -V : verbose, print infomations and progress                    |\n"
+  "|            -t<number> : multithread speedup, only for -e0 with stripes,    |\n"
+  "|                         or -e1~3 with tiles                                |\n"
   "|                                                                            |\n"
   "| decompression example :   ./nblic_codec -d -V in.nblic out.bmp             |\n"
   "|                                                                            |\n"
@@ -49,7 +73,7 @@ const char *USAGE =
 
 
 
-static void parseSwitches (char *arg, int *p_d, int *p_n, int *p_e, int *p_v, int *p_t) {
+static void parseSwitches (char *arg, int *p_d, int *p_n, int *p_e, int *p_v, int *p_t, int *p_l, int *p_s, int *p_b, int *p_k, int *p_w, int *p_g, int *p_f, int *p_m) {
     for (; arg[0]; arg++) {
         switch (arg[0]) {
             case 'c' :
@@ -70,6 +94,21 @@ static void parseSwitches (char *arg, int *p_d, int *p_n, int *p_e, int *p_v, in
                 *p_v = 2;
                 break;
             
+            case 'w' :
+            case 'W' :
+                *p_w = 1;
+                break;
+            
+            case 'f' :
+            case 'F' :
+                *p_f = 1;
+                break;
+            
+            case 'm' :
+            case 'M' :
+                *p_m = 1;
+                break;
+            
             case 'n' :
             case 'N' :
                 (*p_n) = 0;
@@ -82,32 +121,90 @@ static void parseSwitches (char *arg, int *p_d, int *p_n, int *p_e, int *p_v, in
             case 'e' :
             case 'E' :
                 if ('0'<=arg[1] && arg[1]<='9')
-                    (*p_e) = (arg[1] - '0');
+                    (*p_e) = (arg[1] <= '3') ? (arg[1] - '0') : 3;      // -e4 ~ -e9 mean the slowest effort, 2.5 is only chosen by -e2.5
                 arg ++;
+                if (arg[0] == '2' && arg[1] == '.' && arg[2] == '5') {   // -e2.5
+                    (*p_e) = NBLIC_EFFORT_2_5;
+                    arg += 2;
+                }
                 break;
             
             case 't' :
             case 'T' :
-                *p_t = 1;  // enable multithread
+                (*p_t) = 0;  // enable multithread, 0 means using all CPU cores
+                for (; ('0'<=arg[1] && arg[1]<='9'); arg++) {
+                    (*p_t) *= 10;
+                    (*p_t) += (arg[1] - '0');
+                }
+                break;
+            
+            case 'l' :
+            case 'L' :
+                (*p_l) = 0;
+                for (; ('0'<=arg[1] && arg[1]<='9'); arg++) {
+                    (*p_l) *= 10;
+                    (*p_l) += (arg[1] - '0');
+                }
+                break;
+            
+            case 's' :
+            case 'S' :
+                (*p_s) = 0;
+                for (; ('0'<=arg[1] && arg[1]<='9'); arg++) {
+                    (*p_s) *= 10;
+                    (*p_s) += (arg[1] - '0');
+                }
+                break;
+            
+            case 'b' :
+            case 'B' :
+                (*p_b) = 0;
+                for (; ('0'<=arg[1] && arg[1]<='9'); arg++) {
+                    (*p_b) *= 10;
+                    (*p_b) += (arg[1] - '0');
+                }
+                break;
+            
+            case 'k' :
+            case 'K' :
+                (*p_k) = 0;
+                for (; ('0'<=arg[1] && arg[1]<='9'); arg++) {
+                    (*p_k) *= 10;
+                    (*p_k) += (arg[1] - '0');
+                }
+                break;
+            
+            case 'g' :
+            case 'G' :
+                (*p_g) = 0;
+                for (; ('0'<=arg[1] && arg[1]<='9'); arg++) {
+                    (*p_g) *= 10;
+                    (*p_g) += (arg[1] - '0');
+                }
                 break;
         }
     }
 }
 
 
-static void parseCommand (int argc, char **argv, char **pp_src_fname, char **pp_dst_fname, int *p_d, int *p_n, int *p_e, int *p_v, int *p_t) {
+// return:
+//     -1 : -s and -k are both given
+//      0 : success
+static int parseCommand (int argc, char **argv, char **pp_src_fname, char **pp_dst_fname, int *p_d, int *p_n, int *p_e, int *p_v, int *p_t, int *p_l, int *p_s, int *p_b, int *p_k, int *p_w, int *p_g, int *p_f, int *p_m) {
     int i;
     
     for (i=1; i<argc; i++) {
         char *arg = argv[i];
         
         if      (arg[0] == '-')
-            parseSwitches(&arg[1], p_d, p_n, p_e, p_v, p_t);
+            parseSwitches(&arg[1], p_d, p_n, p_e, p_v, p_t, p_l, p_s, p_b, p_k, p_w, p_g, p_f, p_m);
         else if (*pp_src_fname == NULL)
             *pp_src_fname = arg;
         else
             *pp_dst_fname = arg;
     }
+    
+    return ((*p_s) > 0 && (*p_k) > 0) ? -1 : 0;              // stripes and blocks cannot be used together
 }
 
 
@@ -132,27 +229,47 @@ static int matchSuffixIgnoringCase (const char *string, const char *suffix) {
 }
 
 
+static void printEffort (int effort) {
+    effort &= ~NBLIC_OPTIONS;
+    if (effort == NBLIC_EFFORT_2_5)
+        printf("  effort             = 2.5\n");
+    else
+        printf("  effort             = %d\n"      , effort);
+}
+
+
 
 // return:
 //     -1 : exit with error
 //      0 : exit normally
 int main (int argc, char **argv) {
-    static unsigned char img [NBLIC_MAX_IMG_SIZE];
-    static uint16_t      buf [NBLIC_MAX_IMG_SIZE];
-
     char *p_src_fname=NULL, *p_dst_fname=NULL;
     
     int decompress = 0;
     int near       = 0;
     int effort     = 1;
     int verbose    = 0;
-    int multithread= 0;
+    int n_thread   = 1;
+    int wavefront  = 0;
+    int tile_size  = 0;
+    int fast_prob  = 0;
+    int multi_sym  = 0;
+    
+    QNBLICparam_t qparam = {0};
     int height     =-1;
     int width      =-1;
-    int len        =-1;
+    int64_t len    =-1;
+    int64_t offset =-1;
     int is_bmp     =0;
     
-    parseCommand(argc, argv, &p_src_fname, &p_dst_fname, &decompress, &near, &effort, &verbose, &multithread);
+    MappedFile_t   src, dst;
+    unsigned char *p_img = NULL;        // the image, in the mapped file if possible, otherwise in p_img_alloc
+    unsigned char *p_img_alloc = NULL;
+    
+    if ( parseCommand(argc, argv, &p_src_fname, &p_dst_fname, &decompress, &near, &effort, &verbose, &n_thread, &qparam.n_lane, &qparam.stripe_rows, &qparam.norm_bits, &qparam.block_rows, &wavefront, &tile_size, &fast_prob, &multi_sym) ) {
+        printf("  ***Error : -s and -k cannot be used together\n");
+        return -1;
+    }
     
     if (p_src_fname==NULL || p_dst_fname==NULL) {
         printf(USAGE);
@@ -164,13 +281,26 @@ int main (int argc, char **argv) {
         printf("  output file        = %s\n" , p_dst_fname);
     }
     
+    if ( mapFileForRead(p_src_fname, &src, 0) ) {
+        printf("  ***Error : open %s failed\n", p_src_fname);
+        return -1;
+    }
+    
     if (!decompress) { // compress ---------------------------------------
-        if     ( loadPGMImageFile    (p_src_fname, img, &height, &width) ) {
-            if ( loadBMPGrayImageFile(p_src_fname, img, &height, &width) ) {
+        offset = parsePGMHeader(src.p_data, src.len, &height, &width);
+        
+        if (offset >= 0) {                                       // the pixels of PGM are coded in place
+            p_img = src.p_data + offset;
+        } else {
+            offset = parseBMPGrayHeader(src.p_data, src.len, &height, &width);
+            if (offset >= 0)
+                p_img = p_img_alloc = (unsigned char*)malloc((size_t)height * width);
+            if (p_img == NULL) {
                 printf("  ***Error : open %s failed\n", p_src_fname);
                 printf("             please specific a gray 8-bit PGM or BMP file as input\n");
                 return -1;
             }
+            copyBMPGrayPixels(p_img, src.p_data + offset, height, width);
             is_bmp = 1;
         }
         
@@ -179,70 +309,146 @@ int main (int argc, char **argv) {
             printf("  input image shape  = %d x %d\n" , width, height );
         }
         
+        if (near==0 && effort==0 && qparam.stripe_rows > 0 && (int64_t)height * width > QNBLIC_MAX_IMG_SIZE) {
+            printf("  ***Error : -s cannot be used for an image of more than %d pixels, use -k instead\n", QNBLIC_MAX_IMG_SIZE);
+            return -1;
+        }
+        
+        if (fast_prob && effort > 0)
+            effort |= NBLIC_FAST_PROB;
+        
+        if (multi_sym && effort > 0)
+            effort |= NBLIC_MULTI_SYM;
+        
+        // the output file is mapped with the worst case stream length, and truncated to the stream length after compressing
+        if ( mapFileForWrite(p_dst_fname, &dst, (near==0 && effort==0) ? 2*QNBLICgetStreamBound(height, width, &qparam) : NBLICgetStreamBound(height, width)) ) {
+            printf("  ***Error : write %s failed\n", p_dst_fname);
+            return -1;
+        }
+        
         if (near==0 && effort==0) {
-            if (multithread)
-                len = 2 * QNBLICcompressMultiThread(buf, img, height, width);
+            if (n_thread != 1)
+                len = 2 * QNBLICcompressMultiThread((uint16_t*)dst.p_data, p_img, height, width, &qparam, n_thread);
             else
-                len = 2 * QNBLICcompress(buf, img, height, width);
+                len = 2 * QNBLICcompress((uint16_t*)dst.p_data, p_img, height, width, &qparam);
+        } else if (tile_size > 0) {
+            len = NBLICcompressTiled((verbose>1), dst.p_data, p_img, height, width, &near, &effort, tile_size, wavefront, n_thread);
+        } else if (wavefront) {
+            len = NBLICcompressWavefront((verbose>1), dst.p_data, p_img, height, width, &near, &effort, n_thread);
+        } else if (n_thread != 1) {
+            len = NBLICcompressMultiThread((verbose>1), dst.p_data, p_img, height, width, &near, &effort, n_thread);
         } else {
-            len = NBLICcompress((verbose>1), (unsigned char*)buf, img, height, width, &near, &effort);
+            len = NBLICcompress((verbose>1), dst.p_data, p_img, height, width, &near, &effort);
         }
         
-        if (len < 0) {
+        if (len < 0 || len > dst.len) {
             printf("  ***Error : compress failed\n");
+            unmapFile(&dst, 0);
+            remove(p_dst_fname);
             return -1;
         }
         
         if (verbose) {
-            printf("  effort             = %d\n"      , effort);
+            printEffort(effort);
+            if (effort > 0)
+                printf("  probability model  = %s\n"      , (effort & NBLIC_FAST_PROB) ? "division-free" : "counters");
+            if (effort > 0)
+                printf("  residual coding    = %s\n"      , (effort & NBLIC_MULTI_SYM) ? "multi-symbol" : "binarized");
+            if (effort > 0) {
+                int model_size, row_size;
+                NBLICgetWorkingSetSize(width, effort, &model_size, &row_size);
+                printf("  working set        = %d B model + %d B row state\n", model_size, row_size);
+            }
             printf("  near               = %d (%s)\n" , near, (near<=0)?"lossless":"lossy");
-            printf("  output size        = %d B\n"    , len   );
+            printf("  output size        = %lld B\n"  , (long long)len );
             printf("  compression rate   = %.5f\n"    , (1.0*width*height)/len );
-            printf("  compression bpp    = %.5f\n"    , (8.0*len)/(width*height) );
+            printf("  compression bpp    = %.5f\n"    , (8.0*len)/(1.0*width*height) );
         }
         
-        if ( writeBytesToFile(p_dst_fname, (unsigned char*)buf, len) ) {
+        if ( unmapFile(&dst, len) ) {
             printf("  ***Error : write %s failed\n", p_dst_fname);
             return -1;
         }
         
     } else { // decompress ---------------------------------------
-        len = loadBytesFromFile(p_src_fname, (unsigned char*)buf, sizeof(buf));
-
-        if (len < 0) {
-            printf("  ***Error : open %s failed\n", p_src_fname);
-            return -1;
-        }
+        len = src.len;
         
         if (verbose)
-            printf("  input size         = %d B\n" , len );
+            printf("  input size         = %lld B\n" , (long long)len );
         
         near = 0;
         effort = 0;
         
-        len = QNBLICdecompress(buf, img, &height, &width);
+        if ( QNBLICgetImageSize((uint16_t*)src.p_data, len/2, &height, &width) && NBLICgetImageSize(src.p_data, len, &height, &width) ) {
+            printf("  ***Error : %s is not a NBLIC stream\n", p_src_fname);
+            return -1;
+        }
+        
+        {   // the decoders read past the end of a truncated stream, so the input is mapped again with zeros up to the worst case stream length
+            QNBLICparam_t qworst = {0};
+            int64_t bound;
+            qworst.block_rows = 1;                               // the largest -e0 stream : each row is a block with its own histograms
+            bound = 2 * QNBLICgetStreamBound(height, width, &qworst);
+            if (bound < NBLICgetStreamBound(height, width))
+                bound = NBLICgetStreamBound(height, width);
+            if ( src.map_len < bound && (unmapFile(&src, -1) || mapFileForRead(p_src_fname, &src, bound)) ) {
+                printf("  ***Error : open %s failed\n", p_src_fname);
+                return -1;
+            }
+        }
+        
+        is_bmp = matchSuffixIgnoringCase(p_dst_fname, ".bmp");
+        
+        if (is_bmp) {                                            // the rows of BMP are upside down, so it is decoded to memory and then written
+            p_img = p_img_alloc = (unsigned char*)malloc((size_t)height * width);
+        } else {                                                 // PGM is decoded to the mapped output file
+            unsigned char header [PGM_MAX_HEADER_LEN];
+            offset = putPGMHeader(header, height, width);
+            if ( mapFileForWrite(p_dst_fname, &dst, offset + (int64_t)height * width) == 0 ) {
+                memcpy(dst.p_data, header, offset);
+                p_img = dst.p_data + offset;
+            }
+        }
+        
+        if (p_img == NULL) {
+            printf("  ***Error : write %s failed\n", p_dst_fname);
+            return -1;
+        }
+        
+        len = QNBLICdecompressMultiThread((uint16_t*)src.p_data, p_img, &height, &width, n_thread);
         
         if (len < 0)
-            len = NBLICdecompress((verbose>1), (unsigned char*)buf, img, &height, &width, &near, &effort);
+            len = NBLICdecompressMultiThread((verbose>1), src.p_data, p_img, &height, &width, &near, &effort, n_thread);
         
         if (len < 0) {
             printf("  ***Error : decompress failed\n");
+            if (!is_bmp) {
+                unmapFile(&dst, 0);
+                remove(p_dst_fname);
+            }
             return -1;
         }
         
-        is_bmp = matchSuffixIgnoringCase(p_dst_fname, ".bmp");
-        
         if (verbose) {
-            printf("  effort             = %d\n"      , effort);
+            printEffort(effort);
+            if (effort > 0)
+                printf("  probability model  = %s\n"      , (effort & NBLIC_FAST_PROB) ? "division-free" : "counters");
+            if (effort > 0)
+                printf("  residual coding    = %s\n"      , (effort & NBLIC_MULTI_SYM) ? "multi-symbol" : "binarized");
+            if (effort > 0) {
+                int model_size, row_size;
+                NBLICgetWorkingSetSize(width, effort, &model_size, &row_size);
+                printf("  working set        = %d B model + %d B row state\n", model_size, row_size);
+            }
             printf("  near               = %d (%s)\n" , near, (near  <=0)?"lossless":"lossy");
             printf("  output image format= %s\n"      , is_bmp?"BMP":"PGM");
             printf("  output image shape = %d x %d\n" , width, height );
         }
         
         if (is_bmp)
-            len = writeBMPGrayImageFile(p_dst_fname, img, height, width);
+            len = writeBMPGrayImageFile(p_dst_fname, p_img, height, width);
         else
-            len = writePGMImageFile(p_dst_fname, img, height, width);
+            len = unmapFile(&dst, -1);
         
         if (len) {
             printf("  ***Error : write %s failed\n", p_dst_fname);
@@ -250,5 +456,8 @@ int main (int argc, char **argv) {
         }
     }
 
+    free(p_img_alloc);
+    unmapFile(&src, -1);
+    
     return 0;
 }
@@ -1,21 +1,22 @@
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "QNBLIC.h"
+#include "Thread.h"
 
 typedef    unsigned char          UI8;
 
 
-#define    ENABLE_MULTITHREAD     1
-
-#define    WINDOWS_MULTITHREAD    (ENABLE_MULTITHREAD && defined(_WIN32))                // multithread enabled, and system is Windows
+#define    ENABLE_MULTITHREAD     1                                                      // 1: QNBLICcompressMultiThread uses subthreads (Windows threads or POSIX threads)   0: always single thread
+#define    ENABLE_SIMD            1                                                      // 1: the encoder uses AVX2 or SSE4.1 row kernel when the compiler targets them (e.g. -mavx2)   0: always scalar
 
 #define    ABS(x)                 ( ((x)<0) ? (-(x)) : (x) )                             // get absolute value
 #define    CLIP(x,a,b)            ( ((x)<(a)) ? (a) : (((x)>(b)) ? (b) : (x)) )          // clip x between a~b
 #define    MIN(a,b)               ( ((a)<(b)) ? (a) : (b) )
 #define    MAX(a,b)               ( ((a)>(b)) ? (a) : (b) )
 
-#define    G2D(ptr,width,i,j)     (*( (ptr) + (width)*(i) + (j) ))
+#define    G2D(ptr,width,i,j)     (*( (ptr) + (int64_t)(width)*(i) + (j) ))                // 64-bit offset, since an image can have more than 2^31 pixels
 #define    SPIX(ptr,width,i,j,v0) (((0<=(i)) && (0<=(j)) && ((j)<(width))) ? G2D((ptr),(width),(i),(j)) : (v0))
 
 #define    MAX_VAL                255
@@ -27,6 +28,8 @@ typedef    unsigned char          UI8;
 #define    CTX_COEF               7
 #define    CTX_SCALE              11
 
+#define    MAX_N_LANE             8
+
     
 
 // return:  -1:failed  0:success
@@ -39,12 +42,17 @@ static int checkSize (int height, int width) {
         return -1;
     if (width  > QNBLIC_MAX_WIDTH)
         return -1;
-    if ((height*width) > QNBLIC_MAX_IMG_SIZE)
-        return -1;
     return 0;
 }
 
 
+// the legacy stream and the stripes keep the symbols of the whole image when encoding, and count them in one set of 32-bit histograms,
+// so an image of more than QNBLIC_MAX_IMG_SIZE pixels is always coded in blocks (see getFormat)
+static int isLargeImage (int height, int width) {
+    return (int64_t)height * width > QNBLIC_MAX_IMG_SIZE;
+}
+
+
 #define    SAMPLE_PIXELS(p_img,width,i,j,a,b,c,d,e,f,g,h,q,r,s) {          \
     a = (int)SPIX(p_img, width, i   , j-1 , MID_VAL);                      \
     b = (int)SPIX(p_img, width, i-1 , j   , MID_VAL);                      \
@@ -173,6 +181,318 @@ static void initQDLookupTable (UI8 tab[]) {
 }
 
 
+// Line buffer --------------------------------------------------------------------------------------------
+// a line buffer holds the last 3 rows, row i is in line (i%3), and each line has ROW_PAD pixels on each side.
+// before processing row i (i>=2), padLines sets the paddings, so that the neighbours read with fixed offsets
+// (a=pc[j-1], b=p1[j], f=p2[j], ...) are exactly the same as SAMPLE_PIXELS, without any bounds check.
+// rows 0 and 1 have special border rules, they still use SAMPLE_PIXELS.
+
+#define   ROW_PAD                 2
+#define   LINE_LEN(width)         ((width) + 2*ROW_PAD)
+#define   LINE(p_lines,width,i)   ((p_lines) + ((i)%3) * LINE_LEN(width) + ROW_PAD)
+
+
+static void padLines (UI8 *p_lines, int width, int i) {
+    UI8 *pc = LINE(p_lines, width, i  );
+    UI8 *p1 = LINE(p_lines, width, i-1);
+    UI8 *p2 = LINE(p_lines, width, i-2);
+    pc[-2] = pc[-1] = p1[0];                                   // at j=0 : a=e=b
+    p1[-2] = p1[-1] = p1[0];                                   // at j=0 : q=c=b
+    p2[-2] = p2[-1] = p2[0];                                   // at j=0 : s=h=f
+    p1[width+1] = p1[width] = p1[width-1];                     // at j=width-1 : d=b
+    p2[width+1] = p2[width] = p2[width-1];                     // at j=width-1 : r=g=f
+}
+
+
+
+// Row prediction kernel (encoder only) --------------------------------------------------------------------
+// in the encoder, the neighbours of every pixel are known from the input image, so px0 (the prediction before context correction),
+// qd, and the context address of a whole row can be computed before the serial context-correction pass.
+// for row>=2, the neighbours come from the line buffer. rows 0 and 1 use the scalar SAMPLE_PIXELS path.
+
+// buffers of predictRow
+typedef struct {
+    int      width;
+    int      line_row [3];     // the row held by each line of the line buffer, -1 : none
+    UI8     *p_lines;          // line buffer
+    int16_t *p_err;            // prediction errors of the row, p_err[-1] = 0
+    int16_t *p_px;             // output : px0 of the row
+    int16_t *p_adr;            // output : context address of the row
+} RowWork_t;
+
+
+#if       ENABLE_SIMD && defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define   VLEN                 16
+typedef   __m256i              VEC_t;
+#define   V_LOAD8(p)           _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(p)))
+#define   V_LOAD16(p)          _mm256_loadu_si256((const __m256i*)(p))
+#define   V_STORE16(p,v)       _mm256_storeu_si256((__m256i*)(p), (v))
+#define   V_SET1(v)            _mm256_set1_epi16((short)(v))
+#define   V_ADD(a,b)           _mm256_add_epi16((a), (b))
+#define   V_SUB(a,b)           _mm256_sub_epi16((a), (b))
+#define   V_MUL(a,b)           _mm256_mullo_epi16((a), (b))
+#define   V_ABS(a)             _mm256_abs_epi16(a)
+#define   V_MIN(a,b)           _mm256_min_epi16((a), (b))
+#define   V_MAX(a,b)           _mm256_max_epi16((a), (b))
+#define   V_GT(a,b)            _mm256_cmpgt_epi16((a), (b))
+#define   V_SEL(m,a,b)         _mm256_blendv_epi8((b), (a), (m))                   // m ? a : b
+#define   V_AND(a,b)           _mm256_and_si256((a), (b))
+#define   V_OR(a,b)            _mm256_or_si256((a), (b))
+#define   V_SLL(a,n)           _mm256_slli_epi16((a), (n))
+#define   V_SRA(a,n)           _mm256_srai_epi16((a), (n))
+
+#elif     ENABLE_SIMD && defined(__SSE4_1__)
+
+#include <smmintrin.h>
+
+#define   VLEN                 8
+typedef   __m128i              VEC_t;
+#define   V_LOAD8(p)           _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(p)))
+#define   V_LOAD16(p)          _mm_loadu_si128((const __m128i*)(p))
+#define   V_STORE16(p,v)       _mm_storeu_si128((__m128i*)(p), (v))
+#define   V_SET1(v)            _mm_set1_epi16((short)(v))
+#define   V_ADD(a,b)           _mm_add_epi16((a), (b))
+#define   V_SUB(a,b)           _mm_sub_epi16((a), (b))
+#define   V_MUL(a,b)           _mm_mullo_epi16((a), (b))
+#define   V_ABS(a)             _mm_abs_epi16(a)
+#define   V_MIN(a,b)           _mm_min_epi16((a), (b))
+#define   V_MAX(a,b)           _mm_max_epi16((a), (b))
+#define   V_GT(a,b)            _mm_cmpgt_epi16((a), (b))
+#define   V_SEL(m,a,b)         _mm_blendv_epi8((b), (a), (m))                      // m ? a : b
+#define   V_AND(a,b)           _mm_and_si128((a), (b))
+#define   V_OR(a,b)            _mm_or_si128((a), (b))
+#define   V_SLL(a,n)           _mm_slli_epi16((a), (n))
+#define   V_SRA(a,n)           _mm_srai_epi16((a), (n))
+
+#else
+
+#define   VLEN                 0                                                   // no SIMD, the whole row uses the scalar path
+
+#endif
+
+
+#if       VLEN > 0
+
+// count of thresholds which v reaches, i.e., the same as looking up a table built by initPTLookupTable or initQDLookupTable
+#define   V_ADD_IF_REACH(cnt,v,t)  { cnt = V_SUB(cnt, V_GT((v), V_SET1((t)-1))); }
+
+
+// compute px0 of VLEN pixels start from j. all the values fit in int16 : px_lnr <= 16*MAX_VAL, csum <= 7*8*MAX_VAL, and the final weighted sum <= 128*MAX_VAL+64
+static void simplePredictVec (const UI8 *pc, const UI8 *p1, const UI8 *p2, int j, int16_t *p_px) {
+    VEC_t a = V_LOAD8(pc+j-1);
+    VEC_t e = V_LOAD8(pc+j-2);
+    VEC_t b = V_LOAD8(p1+j  );
+    VEC_t c = V_LOAD8(p1+j-1);
+    VEC_t d = V_LOAD8(p1+j+1);
+    VEC_t q = V_LOAD8(p1+j-2);
+    VEC_t f = V_LOAD8(p2+j  );
+    VEC_t g = V_LOAD8(p2+j+1);
+    VEC_t h = V_LOAD8(p2+j-1);
+    VEC_t r = V_LOAD8(p2+j+2);
+    VEC_t s = V_LOAD8(p2+j-2);
+    VEC_t a2 = V_ADD(a, a);
+    VEC_t b2 = V_ADD(b, b);
+    VEC_t c2 = V_ADD(c, c);
+    VEC_t d2 = V_ADD(d, d);
+    VEC_t px_lnr, px_ang, cost, csum, cmin, wt, m;
+    
+    px_lnr = V_ADD(V_ADD(V_SLL(V_ADD(a, b), 3), V_ADD(a, b)), V_SUB(d2, c2));
+    px_lnr = V_SUB(px_lnr, V_ADD(e, f));
+    px_lnr = V_MIN(V_MAX(px_lnr, V_SET1(0)), V_SET1(16*MAX_VAL));
+    
+    cmin = csum = V_ADD(V_ADD(V_ABS(V_SUB(a, e)), V_ABS(V_SUB(c, q))), V_ADD(V_ABS(V_SUB(b, c)), V_ABS(V_SUB(d, b))));
+    cmin = csum = V_ADD(csum, csum);
+    px_ang = a2;
+    
+    #define   V_TRY_DIRECTION(cost_expr, ang_expr)  {    \
+        cost = (cost_expr);                              \
+        csum = V_ADD(csum, cost);                        \
+        m    = V_GT(cmin, cost);                         \
+        cmin = V_MIN(cmin, cost);                        \
+        px_ang = V_SEL(m, (ang_expr), px_ang);           \
+    }
+    
+    V_TRY_DIRECTION( V_SLL(V_ADD(V_ADD(V_ABS(V_SUB(a, c)), V_ABS(V_SUB(c, h))), V_ADD(V_ABS(V_SUB(b, f)), V_ABS(V_SUB(d, g)))), 1) , b2 );
+    V_TRY_DIRECTION( V_SLL(V_ADD(V_ADD(V_ABS(V_SUB(a, q)), V_ABS(V_SUB(c, s))), V_ADD(V_ABS(V_SUB(b, h)), V_ABS(V_SUB(d, f)))), 1) , c2 );
+    V_TRY_DIRECTION( V_SLL(V_ADD(V_ADD(V_ABS(V_SUB(a, b)), V_ABS(V_SUB(c, f))), V_ADD(V_ABS(V_SUB(b, g)), V_ABS(V_SUB(d, r)))), 1) , d2 );
+    V_TRY_DIRECTION( V_ADD(V_ADD(V_ABS(V_SUB(a2, V_ADD(e, q))), V_ABS(V_SUB(c2, V_ADD(q, s)))), V_ADD(V_ABS(V_SUB(b2, V_ADD(c, h))), V_ABS(V_SUB(d2, V_ADD(b, f))))) , V_ADD(a, c) );
+    V_TRY_DIRECTION( V_ADD(V_ADD(V_ABS(V_SUB(a2, V_ADD(q, c))), V_ABS(V_SUB(c2, V_ADD(s, h)))), V_ADD(V_ABS(V_SUB(b2, V_ADD(h, f))), V_ABS(V_SUB(d2, V_ADD(f, g))))) , V_ADD(c, b) );
+    V_TRY_DIRECTION( V_ADD(V_ADD(V_ABS(V_SUB(a2, V_ADD(c, b))), V_ABS(V_SUB(c2, V_ADD(h, f)))), V_ADD(V_ABS(V_SUB(b2, V_ADD(f, g))), V_ABS(V_SUB(d2, V_ADD(g, r))))) , V_ADD(b, d) );
+    
+    #undef    V_TRY_DIRECTION
+    
+    csum = V_SUB(csum, V_MUL(cmin, V_SET1(7)));
+    csum = V_MIN(V_SRA(csum, 3), V_SET1(608-1));
+    
+    wt = V_SET1(0);                                            // thresholds of initPTLookupTable
+    V_ADD_IF_REACH(wt, csum,   5);
+    V_ADD_IF_REACH(wt, csum,  12);
+    V_ADD_IF_REACH(wt, csum,  34);
+    V_ADD_IF_REACH(wt, csum,  78);
+    V_ADD_IF_REACH(wt, csum, 194);
+    V_ADD_IF_REACH(wt, csum, 431);
+    V_ADD_IF_REACH(wt, csum, 601);
+    
+    px_ang = V_MUL(V_SLL(wt, 3), px_ang);
+    px_lnr = V_MUL(V_SUB(V_SET1(8), wt), px_lnr);
+    
+    V_STORE16(p_px+j, V_SRA(V_ADD(V_ADD(px_ang, px_lnr), V_SET1(64)), 7));
+}
+
+
+// compute qd and the context address of VLEN pixels start from j, p_err[j-1] is the prediction error of the left pixel
+static void contextAddressVec (const UI8 *pc, const UI8 *p1, const UI8 *p2, int j, const int16_t *p_px, const int16_t *p_err, int16_t *p_adr) {
+    VEC_t a  = V_LOAD8(pc+j-1);
+    VEC_t e  = V_LOAD8(pc+j-2);
+    VEC_t b  = V_LOAD8(p1+j  );
+    VEC_t c  = V_LOAD8(p1+j-1);
+    VEC_t d  = V_LOAD8(p1+j+1);
+    VEC_t f  = V_LOAD8(p2+j  );
+    VEC_t g  = V_LOAD8(p2+j+1);
+    VEC_t px = V_LOAD16(p_px+j);
+    VEC_t qd, adr, v;
+    
+    v = V_ADD(V_ADD(V_ABS(V_SUB(a, e)), V_ABS(V_SUB(b, c))), V_ADD(V_ABS(V_SUB(b, d)), V_ABS(V_SUB(a, c))));
+    v = V_ADD(v, V_ADD(V_ABS(V_SUB(b, f)), V_ABS(V_SUB(d, g))));
+    v = V_ADD(v, V_SLL(V_ABS(V_LOAD16(p_err+j-1)), 1));
+    v = V_MIN(v, V_SET1(152-1));
+    
+    qd = V_SET1(0);                                            // thresholds of initQDLookupTable
+    V_ADD_IF_REACH(qd, v,   1);
+    V_ADD_IF_REACH(qd, v,   2);
+    V_ADD_IF_REACH(qd, v,   4);
+    V_ADD_IF_REACH(qd, v,   6);
+    V_ADD_IF_REACH(qd, v,   9);
+    V_ADD_IF_REACH(qd, v,  15);
+    V_ADD_IF_REACH(qd, v,  25);
+    V_ADD_IF_REACH(qd, v,  39);
+    V_ADD_IF_REACH(qd, v,  63);
+    V_ADD_IF_REACH(qd, v, 101);
+    V_ADD_IF_REACH(qd, v, 151);
+    
+    adr = V_SLL(qd, 8);
+    adr = V_OR(adr, V_AND(V_GT(px, a), V_SET1(0x80)));
+    adr = V_OR(adr, V_AND(V_GT(px, b), V_SET1(0x40)));
+    adr = V_OR(adr, V_AND(V_GT(px, c), V_SET1(0x20)));
+    adr = V_OR(adr, V_AND(V_GT(px, d), V_SET1(0x10)));
+    adr = V_OR(adr, V_AND(V_GT(px, e), V_SET1(0x08)));
+    adr = V_OR(adr, V_AND(V_GT(px, f), V_SET1(0x04)));
+    adr = V_OR(adr, V_AND(V_GT(px, V_SUB(V_ADD(a, a), e)), V_SET1(0x02)));
+    adr = V_OR(adr, V_AND(V_GT(px, V_SUB(V_ADD(b, b), f)), V_SET1(0x01)));
+    
+    V_STORE16(p_adr+j, adr);
+}
+
+#endif // VLEN > 0
+
+
+// return:  -1:failed  0:success
+static int initRowWork (RowWork_t *p_work, int width) {
+    p_work->width = width;
+    p_work->line_row[0] = p_work->line_row[1] = p_work->line_row[2] = -1;
+    p_work->p_px = (int16_t*)malloc(sizeof(int16_t) * (3*width + 1) + 3 * LINE_LEN(width));
+    if (p_work->p_px == NULL)
+        return -1;
+    p_work->p_adr   = p_work->p_px  + width;
+    p_work->p_err   = p_work->p_adr + width + 1;
+    p_work->p_lines = (UI8*)(p_work->p_err + width);
+    return 0;
+}
+
+
+static void freeRowWork (RowWork_t *p_work) {
+    free(p_work->p_px);
+}
+
+
+// compute px0 and the context address of all pixels in row i of the input image (the encoder only), into p_work->p_px and p_work->p_adr
+static void predictRow (const UI8 *p_img, int i, RowWork_t *p_work, UI8 tab_qd[], UI8 tab_pt[]) {
+    const int width = p_work->width;
+    int16_t  *p_px  = p_work->p_px;
+    int16_t  *p_adr = p_work->p_adr;
+    int j, k, err = 0;
+    
+    if (i < 2) {                                               // the first two rows have special border rules, use the scalar SAMPLE_PIXELS path
+        int x=0, a=0, b=0, c=0, d=0, e=0, f=0, g=0, h=0, q=0, r=0, s=0;
+        
+        SAMPLE_PIXELS(p_img, width, i, 0, a, b, c, d, e, f, g, h, q, r, s);
+        
+        for (j=0; j<width; j++) {
+            int px, qd, adr;
+            
+            x = G2D(p_img, width, i, j);
+            
+            px = simplePredict(a, b, c, d, e, f, g, h, q, r, s, tab_pt);
+            
+            qd = ABS(a-e) + ABS(b-c) + ABS(b-d) + ABS(a-c) + ABS(b-f) + ABS(d-g) + 2*ABS(err);
+            qd = MIN(qd, 152-1);
+            qd = tab_qd[qd];
+            
+            err = x - px;
+            
+            GET_CONTEXT_ADDRESS(adr, a, b, c, d, e, f, px, qd);
+            
+            p_px [j] = (int16_t)px;
+            p_adr[j] = (int16_t)adr;
+            
+            SAMPLE_PIXELS_NEXT(p_img, width, i, j, x, a, b, c, d, e, f, g, h, q, r, s);
+        }
+    
+    } else {
+        int16_t *p_err = p_work->p_err;
+        UI8     *pc    = LINE(p_work->p_lines, width, i  );
+        UI8     *p1    = LINE(p_work->p_lines, width, i-1);
+        UI8     *p2    = LINE(p_work->p_lines, width, i-2);
+        int      j_vec = 0;
+        
+        for (k=i-2; k<=i; k++) {                               // load the rows which are not in the line buffer yet, usually only row i
+            if (p_work->line_row[k%3] != k) {
+                UI8 *p_line = LINE(p_work->p_lines, width, k);
+                for (j=0; j<width; j++)
+                    p_line[j] = G2D(p_img, width, k, j);
+                p_work->line_row[k%3] = k;
+            }
+        }
+        
+        padLines(p_work->p_lines, width, i);
+        
+        p_err[-1] = 0;
+        
+        #if VLEN > 0
+        for (j_vec=0; j_vec+VLEN<=width; j_vec+=VLEN)
+            simplePredictVec(pc, p1, p2, j_vec, p_px);
+        #endif
+        
+        for (j=0; j<width; j++) {
+            if (j >= j_vec) {                                  // the pixels which are not covered by the vector kernel
+                int a=pc[j-1], e=pc[j-2], b=p1[j], c=p1[j-1], d=p1[j+1], q=p1[j-2], f=p2[j], g=p2[j+1], h=p2[j-1], r=p2[j+2], s=p2[j-2];
+                int px, qd, adr;
+                
+                px = simplePredict(a, b, c, d, e, f, g, h, q, r, s, tab_pt);
+                
+                qd = ABS(a-e) + ABS(b-c) + ABS(b-d) + ABS(a-c) + ABS(b-f) + ABS(d-g) + 2*ABS(p_err[j-1]);
+                qd = MIN(qd, 152-1);
+                qd = tab_qd[qd];
+                
+                GET_CONTEXT_ADDRESS(adr, a, b, c, d, e, f, px, qd);
+                
+                p_px [j] = (int16_t)px;
+                p_adr[j] = (int16_t)adr;
+            }
+            p_err[j] = (int16_t)(pc[j] - p_px[j]);
+        }
+        
+        #if VLEN > 0
+        for (j=0; j<j_vec; j+=VLEN)
+            contextAddressVec(pc, p1, p2, j, p_px, p_err, p_adr);
+        #endif
+    }
+}
+
+
 #define  CORRECT_PX(ctx,px0,px,sign)  {                \
     sign = ((ctx) >> (CTX_SCALE-1)) & 1;               \
     px   = px0 + ((ctx) >> CTX_SCALE) + sign;          \
@@ -218,9 +538,15 @@ static int mapYtoX (int z, int px, int sign) {
 
 
 
-#define   NORM_BITS             15
+#define   NORM_BITS             15                                 // histogram precision of legacy stream, and the default of extended stream
 #define   NORM_MASK             ((1 << NORM_BITS) - 1)
 #define   NORM_SUM              ((1 << NORM_BITS)    )              // sum of normalized histogram
+#define   MIN_NORM_BITS         11                                 // extended stream can choose a lower precision : MIN_NORM_BITS ~ NORM_BITS
+
+#define   PACK_MAX_BITS         12                                 // use the packed decoding table when precision <= PACK_MAX_BITS
+#define   PACK_FREQ_SHIFT       8                                  // packed entry : bit[7:0]=symbol, bit[19:8]=frequency, bit[31:20]=offset in the symbol's range
+#define   PACK_OFS_SHIFT        20
+#define   PACK_FIELD_MASK       ((1 << PACK_MAX_BITS) - 1)
 
 #define   ANS_MVAL              MAX_VAL
 
@@ -230,10 +556,18 @@ static int mapYtoX (int z, int px, int sign) {
 #define   ANS_HIGH_BOUND_NORM   ((1 << (2*ANS_BITS-NORM_BITS)) - 1)
 #define   ANS_ENC_INIT_VALUE    ANS_LOW_BOUND
 
+#define   ANS64_BITS            32                                         // for multi-lane rANS : 64-bit state with 32-bit renormalization
+#define   ANS64_LOW_BOUND       (((uint64_t)1) << (ANS64_BITS-1))
+#define   ANS64_HIGH_BOUND_NORM(norm_bits) ((ANS64_LOW_BOUND >> (norm_bits)) << ANS64_BITS)
+#define   ANS64_ENC_INIT_VALUE  ANS64_LOW_BOUND
+
 #define   W16BIT(p_buf,value)   { (*((p_buf)++)) = (uint16_t)(value); }
 #define   R16BIT(p_buf,value)   { (value) = (*((p_buf)++)); }
 #define   ROR16BIT(p_buf,value) { (value)|= (*((p_buf)++)); }
 
+#define   W32BIT(p_buf,value)   { W16BIT(p_buf, ((value)>>16)); W16BIT(p_buf, (value)); }    // write high half first, since the encoded words will be reversed
+#define   ROR32BIT(p_buf,value) { (value)|= ((uint64_t)(p_buf)[0]) | (((uint64_t)(p_buf)[1]) << 16);  (p_buf) += 2; }
+
 
 #define   ANS_ENC(ans,p_buf,h,hacc)  {                    \
     uint32_t dans = (ans) / (h);                          \
@@ -274,6 +608,59 @@ static int mapYtoX (int z, int px, int sign) {
 }
 
 
+#define   ANS64_ENC(ans,p_buf,h,hacc,norm_bits)  {        \
+    if ((ans) >= ANS64_HIGH_BOUND_NORM(norm_bits) * (h)) {\
+        W32BIT(p_buf, (uint32_t)(ans));                   \
+        (ans) >>= ANS64_BITS;                             \
+    }                                                     \
+    (ans) = (((ans) / (h)) << (norm_bits)) + ((ans) % (h)) + (hacc); \
+}
+
+
+#define   ANS64_ENC_FIN(ans,p_buf)  {                     \
+    W32BIT(p_buf, (uint32_t)((ans)>>ANS64_BITS));         \
+    W32BIT(p_buf, (uint32_t)(ans));                       \
+}
+
+
+#define   ANS64_DEC_START(ans,p_buf)  {                   \
+    uint64_t lo = 0;                                      \
+    ROR32BIT(p_buf, lo);                                  \
+    (ans) = 0;                                            \
+    ROR32BIT(p_buf, ans);                                 \
+    (ans) <<= ANS64_BITS;                                 \
+    (ans) |= lo;                                          \
+}
+
+
+#define  ANS64_DEC(ans,p_buf,value,hist,hist_acc,tab_dec,norm_bits) { \
+    uint32_t lb = (uint32_t)(ans) & ((1<<(norm_bits))-1); \
+    value = tab_dec[lb];                                  \
+    ans >>= (norm_bits);                                  \
+    ans  *= hist[value];                                  \
+    ans  += lb;                                           \
+    ans  -= hist_acc[value];                              \
+    if (ans < ANS64_LOW_BOUND) {                          \
+        ans <<= ANS64_BITS;                               \
+        ROR32BIT(p_buf, ans);                             \
+    }                                                     \
+}
+
+
+// same as ANS64_DEC, but the symbol, frequency, and offset all come from one packed entry
+#define  ANS64_DEC_PACK(ans,p_buf,value,tab_pack,norm_bits) { \
+    uint32_t ent = tab_pack[(uint32_t)(ans) & ((1<<(norm_bits))-1)]; \
+    value = ent & 0xFF;                                   \
+    ans >>= (norm_bits);                                  \
+    ans  *= (ent >> PACK_FREQ_SHIFT) & PACK_FIELD_MASK;   \
+    ans  += (ent >> PACK_OFS_SHIFT);                      \
+    if (ans < ANS64_LOW_BOUND) {                          \
+        ans <<= ANS64_BITS;                               \
+        ROR32BIT(p_buf, ans);                             \
+    }                                                     \
+}
+
+
 static void reverseWords (uint16_t *p_start, uint16_t *p_end) {
     uint16_t tmp;
     p_end --;
@@ -295,17 +682,28 @@ static void initHistAcc (uint32_t hist[], uint32_t hist_acc[]) {
 }
 
 
-static void initDecodeLookupTable (UI8 tab_dec[], uint32_t hist_acc[]) {
+static void initDecodeLookupTable (UI8 tab_dec[], uint32_t hist_acc[], uint32_t norm_sum) {
     uint32_t i, v;
     for (v=0; v<ANS_MVAL; v++)
-        for (i=hist_acc[v]; i<hist_acc[v+1]; i++)
+        for (i=hist_acc[v]; i<hist_acc[v+1] && i<norm_sum; i++)
             tab_dec[i] = (UI8)v;
-    for (i=hist_acc[ANS_MVAL]; i<NORM_SUM; i++)
+    for (i=hist_acc[ANS_MVAL]; i<norm_sum; i++)
         tab_dec[i] = ANS_MVAL;
 }
 
 
-static void normHist (uint32_t hist[]) {
+// only for norm_sum <= (1<<PACK_MAX_BITS), where the frequency and offset both fit in PACK_MAX_BITS bits
+static void initPackedLookupTable (uint32_t tab_pack[], uint32_t hist[], uint32_t hist_acc[], uint32_t norm_sum) {
+    uint32_t i, v;
+    for (i=0; i<norm_sum; i++)
+        tab_pack[i] = ANS_MVAL;
+    for (v=0; v<=ANS_MVAL; v++)
+        for (i=hist_acc[v]; i<hist_acc[v]+hist[v] && i<norm_sum; i++)
+            tab_pack[i] = v | ((hist[v] & PACK_FIELD_MASK) << PACK_FREQ_SHIFT) | ((i - hist_acc[v]) << PACK_OFS_SHIFT);
+}
+
+
+static void normHist (uint32_t hist[], uint32_t norm_sum) {
     uint32_t i, j=0;
     uint32_t sum      = 0;
     uint32_t nz_count = 0;
@@ -319,14 +717,14 @@ static void normHist (uint32_t hist[]) {
         }
     }
     
-    scale = (1.0 * NORM_SUM) / sum;
+    scale = (1.0 * norm_sum) / sum;
     
     if        (nz_count <= 0) {
-        hist[0] = NORM_SUM - 1;
+        hist[0] = norm_sum - 1;
         hist[1] = 1;
         
     } else if (nz_count == 1) {
-        hist[j] = NORM_SUM - 1;
+        hist[j] = norm_sum - 1;
         j = ((j+1) % (ANS_MVAL+1));
         hist[j] = 1;
         
@@ -341,14 +739,14 @@ static void normHist (uint32_t hist[]) {
             }
         }
         
-        for (i=0; sum>NORM_SUM; i=((i+1)%(ANS_MVAL+1)) ) {
+        for (i=0; sum>norm_sum; i=((i+1)%(ANS_MVAL+1)) ) {
             if (hist[i] > 1) {
                 hist[i] --;
                 sum --;
             }
         }
         
-        for (i=0; sum<NORM_SUM; i=((i+1)%(ANS_MVAL+1)) ) {
+        for (i=0; sum<norm_sum; i=((i+1)%(ANS_MVAL+1)) ) {
             if (hist[i] > 0) {
                 hist[i] ++;
                 sum ++;
@@ -369,13 +767,13 @@ static void normHist (uint32_t hist[]) {
 //   case5 | 111XKKKKRRRRRRRR | repeat X for (RRRRRRRR+4) times (X is 0 or 1),
 //                              and follows a 4-bit value KKKK   
 //                              if KKKK==X, KKKK should be ignored                           |
-static void decodeHist (uint16_t **pp_buf, uint32_t hist[]) {
+static void decodeHist (uint16_t **pp_buf, uint32_t hist[], uint32_t norm_sum) {
     uint32_t i, sum=0;
     
     for (i=0; i<=ANS_MVAL; i++)
         hist[i] = 0;
     
-    for (i=0; i<=ANS_MVAL && sum<NORM_SUM ;) {
+    for (i=0; i<=ANS_MVAL && sum<norm_sum ;) {
         uint16_t code, len, h0, he;
         
         R16BIT(*pp_buf, code);
@@ -409,10 +807,10 @@ static void decodeHist (uint16_t **pp_buf, uint32_t hist[]) {
 }
 
 
-static void encodeHist (uint16_t **pp_buf, uint32_t hist[]) {
+static void encodeHist (uint16_t **pp_buf, uint32_t hist[], uint32_t norm_sum) {
     uint32_t i, j, sum=0;
     
-    for (i=0; i<=ANS_MVAL && sum<NORM_SUM ;) {
+    for (i=0; i<=ANS_MVAL && sum<norm_sum ;) {
         uint16_t code, len, h1, h2, h3, he=0xFFFF, h0;
         
         h0 = (uint16_t)hist[i];
@@ -460,152 +858,185 @@ static void encodeHist (uint16_t **pp_buf, uint32_t hist[]) {
 
 
 
-#define   TITLE    "Q0.2"
+#define   TITLE      "Q0.2"                // legacy stream : one 32-bit rANS state
+#define   TITLE_EXT  "Q0.3"                // extended stream : an option word follows the image size
+
+#define   HDR1       ( (((uint16_t)TITLE[1])<<8)     + ((uint16_t)TITLE[0]) )
+#define   HDR2       ( (((uint16_t)TITLE[3])<<8)     + ((uint16_t)TITLE[2]) )
+#define   HDR2_EXT   ( (((uint16_t)TITLE_EXT[3])<<8) + ((uint16_t)TITLE_EXT[2]) )
+
+// bit fields of the option word in extended stream
+#define   OPT_LANE_SHIFT     0             // 2 bits : log2 of the number of interleaved rANS lanes
+#define   OPT_LANE_MASK      0x0003
+#define   OPT_STRIPE         0x0004        // 1 bit  : independent stripes. a 16-bit stripe height follows the option word
+#define   OPT_NORM_SHIFT     3             // 3 bits : NORM_BITS minus the histogram precision, can be 0 ~ (NORM_BITS-MIN_NORM_BITS)
+#define   OPT_NORM_MASK      0x0038
+#define   OPT_BLOCK          0x0040        // 1 bit  : blocks with their own histograms. a 16-bit block height follows the option word (and the stripe height)
+#define   OPT_LARGE          0x0080        // 1 bit  : 32-bit image size. the image size words are the low halves, the high halves follow the block height
+#define   OPT_RESERVED_MASK  0xFF00        // must be 0
+
+#define   MAX_ROWS_WORD      65535         // the stripe height and the block height are 16-bit words
 
-#define   HDR1     ( (((uint16_t)TITLE[1])<<8) + ((uint16_t)TITLE[0]) )
-#define   HDR2     ( (((uint16_t)TITLE[3])<<8) + ((uint16_t)TITLE[2]) )
 
-#define   WHEADER(p_buf,height,width) {     \
-    W16BIT(p_buf, HDR1);                    \
-    W16BIT(p_buf, HDR2);                    \
-    W16BIT(p_buf, height);                  \
-    W16BIT(p_buf, width);                   \
+// get the stream format from user's parameters, all zeros means legacy stream
+// a large image (see isLargeImage) without stripes is coded in blocks, and the blocks are limited to QNBLIC_MAX_IMG_SIZE pixels
+static QNBLICparam_t getFormat (const QNBLICparam_t *p_param, int height, int width) {
+    QNBLICparam_t fmt = {0};
+    if (p_param != NULL)
+        fmt = *p_param;
+    if (fmt.norm_bits <= 0)
+        fmt.norm_bits = NORM_BITS;
+    if (isLargeImage(height, width) && fmt.stripe_rows <= 0 && width > 0) {
+        const int max_rows = CLIP(QNBLIC_MAX_IMG_SIZE / width, 1, MAX_ROWS_WORD);
+        fmt.block_rows = (fmt.block_rows > 0) ? MIN(fmt.block_rows, max_rows) : max_rows;
+    }
+    if ((fmt.stripe_rows > 0 || fmt.block_rows > 0 || fmt.norm_bits != NORM_BITS || height > 0xFFFF || width > 0xFFFF) && fmt.n_lane <= 0)   // extended stream always has at least 1 lane
+        fmt.n_lane = 1;
+    return fmt;
 }
 
-#define   RHEADER(p_buf,height,width,ret) { \
-    uint16_t hdr1, hdr2;                    \
-    R16BIT(p_buf, hdr1);                    \
-    R16BIT(p_buf, hdr2);                    \
-    if (hdr1 == HDR1 && hdr2 == HDR2) {     \
-        R16BIT(p_buf, height);              \
-        R16BIT(p_buf, width);               \
-        ret = checkSize(height, width);     \
-    } else {                                \
-        ret =  -1;                          \
-    }                                       \
+
+// return:  -1:failed  0:success
+static int checkParam (const QNBLICparam_t *p_param, int height, int width) {
+    if (isLargeImage(height, width) && p_param != NULL && p_param->stripe_rows > 0)   // the stripes keep the whole image, see isLargeImage
+        return -1;
+    if (p_param == NULL)
+        return 0;
+    if (p_param->n_lane < 0 || p_param->n_lane > MAX_N_LANE || (p_param->n_lane & (p_param->n_lane-1)))   // lane count must be 0, 1, 2, 4, or 8
+        return -1;
+    if (p_param->stripe_rows < 0 || p_param->stripe_rows > MAX_ROWS_WORD)
+        return -1;
+    if (p_param->norm_bits != 0 && (p_param->norm_bits < MIN_NORM_BITS || p_param->norm_bits > NORM_BITS))
+        return -1;
+    if (p_param->block_rows < 0 || p_param->block_rows > MAX_ROWS_WORD)
+        return -1;
+    if (p_param->block_rows > 0 && p_param->stripe_rows > 0)  // stripes and blocks cannot be used together
+        return -1;
+    return 0;
 }
 
 
+// return:  log2 of the lane count
+static int getLaneBits (int n_lane) {
+    int bits;
+    for (bits=0; (1<<bits)<MAX_N_LANE && (1<<bits)<n_lane; bits++);
+    return bits;
+}
 
-// return :
-//                 0 : success
-//                -1 : failed
-int QNBLICdecompress (uint16_t *p_buf, UI8 *p_img, int *p_height, int *p_width) {
-    int  i, j;
-    int  ctx_array [N_CONTEXT] = {0};
-    UI8  tab_qd    [152];
-    UI8  tab_pt    [608];
-    uint32_t ans;
-    
-    uint32_t hist     [N_QD][ANS_MVAL+1];
-    uint32_t hist_acc [N_QD][ANS_MVAL+1];
-    
-    UI8 tab_dec [N_QD][NORM_SUM];
-    
-    RHEADER(p_buf, (*p_height), (*p_width), i);
-    
-    if (i) return -1;
-    
-    initQDLookupTable(tab_qd);
-    initPTLookupTable(tab_pt);
-    
-    for (i=0; i<N_QD; i++) {
-        decodeHist(&p_buf, hist[i]);
-        initHistAcc(hist[i], hist_acc[i]);
-        initDecodeLookupTable(tab_dec[i], hist_acc[i]);
+
+// a height or width above 65535 needs the high words of the extended header, getFormat makes sure that the stream is extended
+static void writeHeader (uint16_t **pp_buf, int height, int width, QNBLICparam_t *p_fmt) {
+    const int large = (height > 0xFFFF || width > 0xFFFF);
+    W16BIT(*pp_buf, HDR1);
+    if (p_fmt->n_lane <= 0) {
+        W16BIT(*pp_buf, HDR2);
+        W16BIT(*pp_buf, height);
+        W16BIT(*pp_buf, width);
+    } else {
+        W16BIT(*pp_buf, HDR2_EXT);
+        W16BIT(*pp_buf, height);
+        W16BIT(*pp_buf, width);
+        W16BIT(*pp_buf, ((getLaneBits(p_fmt->n_lane) << OPT_LANE_SHIFT) | ((p_fmt->stripe_rows > 0) ? OPT_STRIPE : 0) | ((NORM_BITS - p_fmt->norm_bits) << OPT_NORM_SHIFT) | ((p_fmt->block_rows > 0) ? OPT_BLOCK : 0) | (large ? OPT_LARGE : 0)) );
+        if (p_fmt->stripe_rows > 0)
+            W16BIT(*pp_buf, p_fmt->stripe_rows);
+        if (p_fmt->block_rows > 0)
+            W16BIT(*pp_buf, p_fmt->block_rows);
+        if (large) {
+            W16BIT(*pp_buf, (height >> 16));
+            W16BIT(*pp_buf, (width  >> 16));
+        }
     }
-    
-    ANS_DEC_START(ans, p_buf);
-    
-    for (i=0; i<(*p_height); i++) {
-        int x=0, a=0, b=0, c=0, d=0, e=0, f=0, g=0, h=0, q=0, r=0, s=0;
-        int err = 0;
-        
-        SAMPLE_PIXELS(p_img, (*p_width), i, 0, a, b, c, d, e, f, g, h, q, r, s);
-        
-        for (j=0; j<(*p_width); j++) {
-            int px0, px, qd, adr, ctx, sign, y;
-            
-            px0 = simplePredict(a, b, c, d, e, f, g, h, q, r, s, tab_pt);
-            
-            qd = ABS(a-e) + ABS(b-c) + ABS(b-d) + ABS(a-c) + ABS(b-f) + ABS(d-g) + 2*ABS(err);
-            qd = MIN(qd, 152-1);
-            qd = tab_qd[qd];
-            
-            GET_CONTEXT_ADDRESS(adr, a, b, c, d, e, f, px0, qd);
-            
-            ctx = ctx_array[adr];
-            CORRECT_PX(ctx, px0, px, sign);
-            
-            ANS_DEC(ans, p_buf, y, hist[qd], hist_acc[qd], tab_dec[qd]);
-            
-            x = mapYtoX(y, px, sign);
-            G2D(p_img, (*p_width), i, j) = (UI8)x;
-            
-            err = x - px0;
-            
-            UPDATE_CONTEXT(ctx, err);
-            ctx_array[adr] = ctx;
-            
-            SAMPLE_PIXELS_NEXT(p_img, (*p_width), i, j, x, a, b, c, d, e, f, g, h, q, r, s);
+}
+
+
+// return:  -1:failed  0:success
+// for legacy stream, n_lane=0, stripe_rows=0, block_rows=0, and norm_bits=NORM_BITS
+static int readHeader (uint16_t **pp_buf, int *p_height, int *p_width, QNBLICparam_t *p_fmt) {
+    uint16_t hdr1, hdr2, opt=0;
+    R16BIT(*pp_buf, hdr1);
+    R16BIT(*pp_buf, hdr2);
+    if (hdr1 != HDR1 || (hdr2 != HDR2 && hdr2 != HDR2_EXT))
+        return -1;
+    R16BIT(*pp_buf, *p_height);
+    R16BIT(*pp_buf, *p_width);
+    p_fmt->n_lane = 0;
+    p_fmt->stripe_rows = 0;
+    p_fmt->block_rows = 0;
+    p_fmt->norm_bits = NORM_BITS;
+    if (hdr2 == HDR2_EXT) {
+        R16BIT(*pp_buf, opt);
+        if (opt & OPT_RESERVED_MASK)
+            return -1;
+        p_fmt->n_lane = 1 << ((opt & OPT_LANE_MASK) >> OPT_LANE_SHIFT);
+        p_fmt->norm_bits = NORM_BITS - ((opt & OPT_NORM_MASK) >> OPT_NORM_SHIFT);
+        if (p_fmt->norm_bits < MIN_NORM_BITS)
+            return -1;
+        if (opt & OPT_STRIPE) {
+            R16BIT(*pp_buf, p_fmt->stripe_rows);
+            if (p_fmt->stripe_rows <= 0)
+                return -1;
+        }
+        if (opt & OPT_BLOCK) {
+            R16BIT(*pp_buf, p_fmt->block_rows);
+            if (p_fmt->block_rows <= 0 || p_fmt->stripe_rows > 0)
+                return -1;
+        }
+        if (opt & OPT_LARGE) {
+            int high_h, high_w;
+            R16BIT(*pp_buf, high_h);
+            R16BIT(*pp_buf, high_w);
+            if (high_h > 0x7FFF || high_w > 0x7FFF)
+                return -1;
+            *p_height |= (high_h << 16);
+            *p_width  |= (high_w << 16);
         }
     }
-    
+    if (checkSize(*p_height, *p_width))
+        return -1;
+    if (isLargeImage(*p_height, *p_width) && (p_fmt->block_rows <= 0 || (int64_t)p_fmt->block_rows * (*p_width) > QNBLIC_MAX_IMG_SIZE))
+        return -1;
     return 0;
 }
 
 
 
-// return :
-//    positive value : compressed stream length
-//                -1 : failed
-int QNBLICcompress (uint16_t *p_buf, UI8 *p_img, int height, int width) {
+typedef struct {
+    UI8 qd;
+    UI8 y;
+} Symbol_t;
+
+
+// run prediction and context modeling on the rows i_begin ~ i_end-1 of an image (or a stripe), get the symbols and add them to the histograms.
+// ctx_array is carried from the previous rows, and updated.
+// the prediction of a row is done by predictRow first, only the context correction is done pixel by pixel.
+// return:  -1:failed  0:success
+static int modelRows (UI8 *p_img, int width, int i_begin, int i_end, int ctx_array[], Symbol_t *py, uint32_t hist[][ANS_MVAL+1]) {
     int  i, j;
-    int  ctx_array [N_CONTEXT] = {0};
     UI8  tab_qd    [152]; 
     UI8  tab_pt    [608];
     
-    uint32_t hist     [N_QD][ANS_MVAL+1] = {{0}};
-    uint32_t hist_acc [N_QD][ANS_MVAL+1];
-    
-    uint16_t *p_buf_base = p_buf;
-    
-    struct { UI8 qd; UI8 y; } *py_base, *py;
-    
-    if (checkSize(height, width))
-        return -1;
-    
-    py_base = py = malloc(sizeof(*py_base) * height * width);
+    RowWork_t work;
     
-    if (py_base == NULL)
+    if (initRowWork(&work, width))
         return -1;
     
     initQDLookupTable(tab_qd);
     initPTLookupTable(tab_pt);
     
-    for (i=0; i<height; i++) {
-        int x=0, a=0, b=0, c=0, d=0, e=0, f=0, g=0, h=0, q=0, r=0, s=0;
-        int err = 0;
-        
-        SAMPLE_PIXELS(p_img, width, i, 0, a, b, c, d, e, f, g, h, q, r, s);
+    for (i=i_begin; i<i_end; i++) {
+        predictRow(p_img, i, &work, tab_qd, tab_pt);
         
         for (j=0; j<width; j++) {
-            int px, qd, adr, ctx, sign, y;
-            
-            x = G2D(p_img, width, i, j);
-            
-            px = simplePredict(a, b, c, d, e, f, g, h, q, r, s, tab_pt);
-            
-            qd = ABS(a-e) + ABS(b-c) + ABS(b-d) + ABS(a-c) + ABS(b-f) + ABS(d-g) + 2*ABS(err);
-            qd = MIN(qd, 152-1);
-            qd = tab_qd[qd];
+            int x, px0, px, qd, adr, ctx, sign, y;
             
-            err = x - px;
+            x   = G2D(p_img, width, i, j);
+            px0 = work.p_px [j];
+            adr = work.p_adr[j];
             
-            GET_CONTEXT_ADDRESS(adr, a, b, c, d, e, f, px, qd);
+            qd = adr >> 8;
             
             ctx = ctx_array[adr];
-            CORRECT_PX(ctx, px, px, sign);
+            CORRECT_PX(ctx, px0, px, sign);
             
             y = mapXtoY(x, px, sign);
             
@@ -615,131 +1046,1031 @@ int QNBLICcompress (uint16_t *p_buf, UI8 *p_img, int height, int width) {
             
             hist[qd][y] ++;
             
-            UPDATE_CONTEXT(ctx, err);
+            UPDATE_CONTEXT(ctx, (x-px0));
             ctx_array[adr] = ctx;
-            
-            SAMPLE_PIXELS_NEXT(p_img, width, i, j, x, a, b, c, d, e, f, g, h, q, r, s);
         }
     }
     
-    WHEADER(p_buf, height, width);
+    freeRowWork(&work);
     
+    return 0;
+}
+    
+
+// normalize the histograms and write them
+static void writeHists (uint16_t **pp_buf, uint32_t hist[][ANS_MVAL+1], uint32_t hist_acc[][ANS_MVAL+1], int norm_bits) {
+    int i;
     for (i=0; i<N_QD; i++) {
-        normHist(hist[i]);
+        normHist(hist[i], (1<<norm_bits));
         initHistAcc(hist[i], hist_acc[i]);
-        encodeHist(&p_buf, hist[i]);
+        encodeHist(pp_buf, hist[i], (1<<norm_bits));
     }
+}
+
+
+// decoding tables of the N_QD histograms.
+// when norm_bits <= PACK_MAX_BITS, only tab_pack is used : a decoding step reads a single 4-byte entry,
+// and the N_QD tables take 192 KiB instead of 12 x 32 KiB of tab_dec plus hist and hist_acc.
+typedef struct {
+    int       norm_bits;
+    uint32_t  hist     [N_QD][ANS_MVAL+1];
+    uint32_t  hist_acc [N_QD][ANS_MVAL+1];
+    UI8       tab_dec  [N_QD][NORM_SUM];
+    uint32_t  tab_pack [N_QD][1<<PACK_MAX_BITS];
+} DecodeTable_t;
+
+
+static void readHists (uint16_t **pp_buf, DecodeTable_t *p_tab, int norm_bits) {
+    int i;
+    p_tab->norm_bits = norm_bits;
+    for (i=0; i<N_QD; i++) {
+        decodeHist(pp_buf, p_tab->hist[i], (1<<norm_bits));
+        initHistAcc(p_tab->hist[i], p_tab->hist_acc[i]);
+        if (norm_bits <= PACK_MAX_BITS)
+            initPackedLookupTable(p_tab->tab_pack[i], p_tab->hist[i], p_tab->hist_acc[i], (1<<norm_bits));
+        else
+            initDecodeLookupTable(p_tab->tab_dec[i], p_tab->hist_acc[i], (1<<norm_bits));
+    }
+}
+
+
+// rANS encode symbols, n_lane=0 means legacy single 32-bit state
+// return : the buffer pointer after the stream
+static uint16_t *encodeSymbols (uint16_t *p_buf, Symbol_t *p_sym_base, int n_sym, uint32_t hist[][ANS_MVAL+1], uint32_t hist_acc[][ANS_MVAL+1], int n_lane, int norm_bits) {
+    uint16_t *p_buf_start = p_buf;
+    Symbol_t *p_sym;
+    int i;
     
-    //printf("    header+hist length = %ld B\n", 2*(p_buf-p_buf_base));
-    
-    {
-        uint16_t *p_buf_start = p_buf;
+    if (n_lane <= 0) {
         uint32_t ans = ANS_ENC_INIT_VALUE;
         
-        for (py--; py>=py_base; py--) {
-            UI8 qd = py->qd;
-            UI8 y  = py->y;
-            uint32_t h  = hist[qd][y];
-            uint32_t ha = hist_acc[qd][y];
+        for (p_sym=p_sym_base+n_sym-1; p_sym>=p_sym_base; p_sym--) {
+            uint32_t h  = hist    [p_sym->qd][p_sym->y];
+            uint32_t ha = hist_acc[p_sym->qd][p_sym->y];
             ANS_ENC(ans, p_buf, h, ha);
         }
         
         ANS_ENC_FIN(ans, p_buf);
+    
+    } else {                                                   // interleaved lanes : symbol k is coded by lane (k % n_lane)
+        uint64_t ans [MAX_N_LANE];
+        
+        for (i=0; i<n_lane; i++)
+            ans[i] = ANS64_ENC_INIT_VALUE;
+        
+        for (i=n_sym-1; i>=0; i--) {
+            uint32_t h  = hist    [p_sym_base[i].qd][p_sym_base[i].y];
+            uint32_t ha = hist_acc[p_sym_base[i].qd][p_sym_base[i].y];
+            ANS64_ENC(ans[i & (n_lane-1)], p_buf, h, ha, norm_bits);
+        }
         
-        reverseWords(p_buf_start, p_buf);
+        for (i=n_lane-1; i>=0; i--)                           // the decoder will read lane 0 first
+            ANS64_ENC_FIN(ans[i], p_buf);
     }
     
-    free(py_base);
+    reverseWords(p_buf_start, p_buf);
     
-    return p_buf - p_buf_base;
+    return p_buf;
 }
 
 
-
-
-#if       WINDOWS_MULTITHREAD
-
-#include <Windows.h>
-#include <process.h>
-
-#define N_THREAD  4
-
-typedef struct {
+// decode the rows i_begin ~ i_end-1 of an image (or a stripe) from a rANS stream, n_lane=0 means legacy single 32-bit state.
+// ctx_array is carried from the previous rows, and updated.
+// the neighbours of the rows>=2 are read from a line buffer. if the line buffer cannot be allocated, all rows use SAMPLE_PIXELS.
+// return : the buffer pointer after the stream
+static uint16_t *decodeRows (uint16_t *p_buf, UI8 *p_img, int width, int i_begin, int i_end, int ctx_array[], int n_lane, const DecodeTable_t *p_tab) {
+    const int norm_bits = p_tab->norm_bits;
+    int  i, j, lane=0;
+    UI8  tab_qd    [152];
+    UI8  tab_pt    [608];
+    UI8 *p_lines;
+    uint32_t ans = 0;
+    uint64_t ans_lane [MAX_N_LANE];
+    
+    initQDLookupTable(tab_qd);
+    initPTLookupTable(tab_pt);
+    
+    p_lines = (UI8*)malloc(3 * LINE_LEN(width));
+    
+    if (p_lines != NULL) {                                     // load the two rows above i_begin, which are decoded before
+        for (i=MAX(i_begin-2, 0); i<i_begin; i++)
+            for (j=0; j<width; j++)
+                LINE(p_lines, width, i)[j] = G2D(p_img, width, i, j);
+    }
+    
+    if (n_lane <= 0) {
+        ANS_DEC_START(ans, p_buf);
+    } else {
+        for (i=0; i<n_lane; i++)
+            ANS64_DEC_START(ans_lane[i], p_buf);
+    }
+    
+    for (i=i_begin; i<i_end; i++) {
+        int x=0, a=0, b=0, c=0, d=0, e=0, f=0, g=0, h=0, q=0, r=0, s=0;
+        int err = 0;
+        const int fast = (p_lines != NULL) && (i >= 2);
+        UI8 *pc=NULL, *p1=NULL, *p2=NULL;
+        
+        if (fast) {
+            pc = LINE(p_lines, width, i  );
+            p1 = LINE(p_lines, width, i-1);
+            p2 = LINE(p_lines, width, i-2);
+            padLines(p_lines, width, i);
+        } else {
+            SAMPLE_PIXELS(p_img, width, i, 0, a, b, c, d, e, f, g, h, q, r, s);
+        }
+        
+        for (j=0; j<width; j++) {
+            int px0, px, qd, adr, ctx, sign, y;
+            
+            if (fast) {
+                a = pc[j-1];  e = pc[j-2];
+                b = p1[j];    c = p1[j-1];  d = p1[j+1];  q = p1[j-2];
+                f = p2[j];    g = p2[j+1];  h = p2[j-1];  r = p2[j+2];  s = p2[j-2];
+            }
+            
+            px0 = simplePredict(a, b, c, d, e, f, g, h, q, r, s, tab_pt);
+            
+            qd = ABS(a-e) + ABS(b-c) + ABS(b-d) + ABS(a-c) + ABS(b-f) + ABS(d-g) + 2*ABS(err);
+            qd = MIN(qd, 152-1);
+            qd = tab_qd[qd];
+            
+            GET_CONTEXT_ADDRESS(adr, a, b, c, d, e, f, px0, qd);
+            
+            ctx = ctx_array[adr];
+            CORRECT_PX(ctx, px0, px, sign);
+            
+            if (n_lane <= 0) {
+                ANS_DEC(ans, p_buf, y, p_tab->hist[qd], p_tab->hist_acc[qd], p_tab->tab_dec[qd]);
+            } else {
+                if (norm_bits <= PACK_MAX_BITS) {
+                    ANS64_DEC_PACK(ans_lane[lane], p_buf, y, p_tab->tab_pack[qd], norm_bits);
+                } else {
+                    ANS64_DEC(ans_lane[lane], p_buf, y, p_tab->hist[qd], p_tab->hist_acc[qd], p_tab->tab_dec[qd], norm_bits);
+                }
+                lane = (lane + 1) & (n_lane - 1);
+            }
+            
+            x = mapYtoX(y, px, sign);
+            G2D(p_img, width, i, j) = (UI8)x;
+            
+            err = x - px0;
+            
+            UPDATE_CONTEXT(ctx, err);
+            ctx_array[adr] = ctx;
+            
+            if (fast)
+                pc[j] = (UI8)x;
+            else
+                SAMPLE_PIXELS_NEXT(p_img, width, i, j, x, a, b, c, d, e, f, g, h, q, r, s);
+        }
+        
+        if (p_lines != NULL && !fast) {                        // rows 0 and 1 are also kept in the line buffer
+            for (j=0; j<width; j++)
+                LINE(p_lines, width, i)[j] = G2D(p_img, width, i, j);
+        }
+    }
+    
+    free(p_lines);
+    
+    return p_buf;
+}
+
+
+
+// Stripe mode --------------------------------------------------------------------------------------------
+// the image is split into horizontal stripes of stripe_rows rows. each stripe is predicted as an independent image,
+// with its own context array and its own rANS stream. all the stripes share the same histograms.
+// stream layout :  header | histograms | lengths of stripes (32-bit each, in 16-bit words) | stripe streams
+//
+// the extra words of a stripe stream beyond its symbol count : the final states of lanes, and the partial renormalization words
+#define   STRIPE_EXTRA_WORDS   (4*MAX_N_LANE + 4)
+
+typedef struct {
+    UI8       *p_img;
+    int        height;
+    int        width;
+    int        stripe_rows;
+    int        n_lane;
+    int        norm_bits;
+    Symbol_t  *py_base;
+    uint32_t (*p_hists)[N_QD][ANS_MVAL+1];   // encode: histograms of each stripe
+    uint32_t (*hist)[ANS_MVAL+1];            // encode: shared histograms
+    uint32_t (*hist_acc)[ANS_MVAL+1];
+    DecodeTable_t *p_tab;                    // decode: shared decoding tables
+    uint16_t **pp_stripe;                    // start of each stripe stream
+    int       *p_stripe_len;                 // encode only: length of each stripe stream
+} StripeJob_t;
+
+
+#define   STRIPE_ROW0(p_job,i_stripe)   ((i_stripe) * (p_job)->stripe_rows)
+#define   STRIPE_ROWS(p_job,i_stripe)   MIN((p_job)->stripe_rows, (p_job)->height - STRIPE_ROW0(p_job,i_stripe))
+
+
+static void modelStripeTask (void *arg, int i_stripe) {
+    StripeJob_t *p_job = (StripeJob_t*)arg;
+    int i0 = STRIPE_ROW0(p_job, i_stripe);
+    int ctx_array [N_CONTEXT] = {0};                          // each stripe starts from an empty context
+    if (modelRows(p_job->p_img + i0*p_job->width, p_job->width, 0, STRIPE_ROWS(p_job, i_stripe), ctx_array, p_job->py_base + i0*p_job->width, p_job->p_hists[i_stripe]))
+        p_job->p_stripe_len[i_stripe] = -1;                    // failed
+}
+
+
+static void encodeStripeTask (void *arg, int i_stripe) {
+    StripeJob_t *p_job = (StripeJob_t*)arg;
+    int i0 = STRIPE_ROW0(p_job, i_stripe);
+    uint16_t *p_end = encodeSymbols(p_job->pp_stripe[i_stripe], p_job->py_base + i0*p_job->width, STRIPE_ROWS(p_job, i_stripe) * p_job->width, p_job->hist, p_job->hist_acc, p_job->n_lane, p_job->norm_bits);
+    p_job->p_stripe_len[i_stripe] = p_end - p_job->pp_stripe[i_stripe];
+}
+
+
+static void decodeStripeTask (void *arg, int i_stripe) {
+    StripeJob_t *p_job = (StripeJob_t*)arg;
+    int i0 = STRIPE_ROW0(p_job, i_stripe);
+    int ctx_array [N_CONTEXT] = {0};                          // each stripe starts from an empty context
+    decodeRows(p_job->pp_stripe[i_stripe], p_job->p_img + i0*p_job->width, p_job->width, 0, STRIPE_ROWS(p_job, i_stripe), ctx_array, p_job->n_lane, p_job->p_tab);
+}
+
+
+// return :
+//    positive value : compressed stream length
+//                -1 : failed
+static int compressStripes (uint16_t *p_buf, UI8 *p_img, int height, int width, QNBLICparam_t *p_fmt, int n_thread) {
+    const int n_stripe = (height + p_fmt->stripe_rows - 1) / p_fmt->stripe_rows;
+    
+    uint32_t hist     [N_QD][ANS_MVAL+1] = {{0}};
+    uint32_t hist_acc [N_QD][ANS_MVAL+1];
+    
+    uint16_t *p_buf_base = p_buf;
+    uint16_t *p_scratch;
+    
+    StripeJob_t job;
+    int i, j, k;
+    
+    job.p_img        = p_img;
+    job.height       = height;
+    job.width        = width;
+    job.stripe_rows  = p_fmt->stripe_rows;
+    job.n_lane       = p_fmt->n_lane;
+    job.norm_bits    = p_fmt->norm_bits;
+    job.py_base      = (Symbol_t*)malloc(sizeof(Symbol_t) * height * width);
+    job.p_hists      = calloc(n_stripe, sizeof(*job.p_hists));
+    job.hist         = hist;
+    job.hist_acc     = hist_acc;
+    job.p_tab        = NULL;
+    job.pp_stripe    = (uint16_t**)malloc(sizeof(uint16_t*) * n_stripe);
+    job.p_stripe_len = (int*)malloc(sizeof(int) * n_stripe);
+    p_scratch        = (uint16_t*)malloc(sizeof(uint16_t) * (height * width + n_stripe * STRIPE_EXTRA_WORDS));
+    
+    if (job.py_base == NULL || job.p_hists == NULL || job.pp_stripe == NULL || job.p_stripe_len == NULL || p_scratch == NULL) {
+        free(job.py_base);
+        free(job.p_hists);
+        free(job.pp_stripe);
+        free(job.p_stripe_len);
+        free(p_scratch);
+        return -1;
+    }
+    
+    for (k=0; k<n_stripe; k++)
+        job.p_stripe_len[k] = 0;
+    
+    runParallel(n_thread, n_stripe, modelStripeTask, (void*)&job);
+    
+    for (k=0; k<n_stripe; k++) {
+        if (job.p_stripe_len[k] < 0) {                         // modeling of a stripe failed
+            free(job.py_base);
+            free(job.p_hists);
+            free(job.pp_stripe);
+            free(job.p_stripe_len);
+            free(p_scratch);
+            return -1;
+        }
+    }
+    
+    for (k=0; k<n_stripe; k++)                                 // merge the histograms of all stripes
+        for (i=0; i<N_QD; i++)
+            for (j=0; j<=ANS_MVAL; j++)
+                hist[i][j] += job.p_hists[k][i][j];
+    
+    writeHeader(&p_buf, height, width, p_fmt);
+    writeHists(&p_buf, hist, hist_acc, p_fmt->norm_bits);
+    
+    for (k=0; k<n_stripe; k++)                                 // each stripe gets a scratch space which can hold its worst case stream
+        job.pp_stripe[k] = p_scratch + STRIPE_ROW0(&job, k) * width + k * STRIPE_EXTRA_WORDS;
+    
+    runParallel(n_thread, n_stripe, encodeStripeTask, (void*)&job);
+    
+    for (k=0; k<n_stripe; k++) {                               // write the length table
+        W16BIT(p_buf, (job.p_stripe_len[k] >> 16));
+        W16BIT(p_buf,  job.p_stripe_len[k]       );
+    }
+    
+    for (k=0; k<n_stripe; k++)                                 // concatenate the stripe streams
+        for (i=0; i<job.p_stripe_len[k]; i++)
+            W16BIT(p_buf, job.pp_stripe[k][i]);
+    
+    free(job.py_base);
+    free(job.p_hists);
+    free(job.pp_stripe);
+    free(job.p_stripe_len);
+    free(p_scratch);
+    
+    return p_buf - p_buf_base;
+}
+
+
+
+// Block mode ---------------------------------------------------------------------------------------------
+// the rows are grouped into blocks of block_rows rows. the prediction and the context are carried across blocks as usual,
+// but each block writes its own normalized histograms and its own rANS segment, and the block is output as soon as it is encoded.
+// so that the encoder only keeps the symbols of one block, and the output starts before the whole image is modeled.
+// stream layout :  header | histograms of block 0 | rANS segment of block 0 | histograms of block 1 | ...
+// a rANS segment needs no length, since the decoder consumes exactly the words which the encoder writes.
+
+// the write callback used by QNBLICcompress : append the words to the buffer
+static int writeToBuffer (void *p_user, const uint16_t *p_words, int n_word) {
+    uint16_t **pp_end = (uint16_t**)p_user;
+    for (; n_word>0; n_word--)
+        W16BIT(*pp_end, *(p_words++));
+    return 0;
+}
+
+
+// the worst case of the output of a block : histograms and rANS segment
+#define   BLOCK_OUT_WORDS(block_rows,width)   ((int64_t)(block_rows) * (width) + STRIPE_EXTRA_WORDS + N_QD * (ANS_MVAL+1))
+
+
+// model the rows i_begin ~ i_end-1 of p_img as a block, and pass its histograms and rANS segment to p_write.
+// py_base has room for the symbols of the block, and p_out has BLOCK_OUT_WORDS words.
+// return:  -1:failed  0:success
+static int encodeBlock (UI8 *p_img, int width, int i_begin, int i_end, int ctx_array[], Symbol_t *py_base, uint16_t *p_out, const QNBLICparam_t *p_fmt, QNBLICwrite_t p_write, void *p_user) {
+    uint32_t hist     [N_QD][ANS_MVAL+1] = {{0}};          // each block has its own histograms
+    uint32_t hist_acc [N_QD][ANS_MVAL+1];
+    
+    uint16_t *p_end = p_out;
+    
+    if (modelRows(p_img, width, i_begin, i_end, ctx_array, py_base, hist))
+        return -1;
+    
+    writeHists(&p_end, hist, hist_acc, p_fmt->norm_bits);
+    p_end = encodeSymbols(p_end, py_base, (i_end-i_begin)*width, hist, hist_acc, p_fmt->n_lane, p_fmt->norm_bits);
+    
+    return p_write(p_user, p_out, p_end-p_out) ? -1 : 0;
+}
+
+
+// return:  -1:failed  0:success
+static int compressBlocks (UI8 *p_img, int height, int width, QNBLICparam_t *p_fmt, QNBLICwrite_t p_write, void *p_user) {
+    const int block_rows = MIN(p_fmt->block_rows, height);
+    
+    int  ctx_array [N_CONTEXT] = {0};
+    
+    Symbol_t *py_base;
+    uint16_t *p_out, *p_end;
+    
+    int i, failed = 0;
+    
+    py_base = (Symbol_t*)malloc(sizeof(Symbol_t) * block_rows * width);
+    p_out   = (uint16_t*)malloc(sizeof(uint16_t) * BLOCK_OUT_WORDS(block_rows, width));
+    
+    if (py_base == NULL || p_out == NULL) {
+        free(py_base);
+        free(p_out);
+        return -1;
+    }
+    
+    p_end = p_out;
+    writeHeader(&p_end, height, width, p_fmt);
+    failed = p_write(p_user, p_out, p_end-p_out);
+    
+    for (i=0; i<height && !failed; i+=block_rows)
+        failed = encodeBlock(p_img, width, i, MIN(i+block_rows, height), ctx_array, py_base, p_out, p_fmt, p_write, p_user);
+    
+    free(py_base);
+    free(p_out);
+    
+    return failed ? -1 : 0;
+}
+
+
+
+// return :
+//                 0 : success
+//                -1 : failed
+int QNBLICdecompressMultiThread (uint16_t *p_buf, UI8 *p_img, int *p_height, int *p_width, int n_thread) {
+    QNBLICparam_t  fmt;
+    DecodeTable_t *p_tab;
+    
+    int i;
+    
+    if (readHeader(&p_buf, p_height, p_width, &fmt))
+        return -1;
+    
+    p_tab = (DecodeTable_t*)malloc(sizeof(DecodeTable_t));
+    
+    if (p_tab == NULL)
+        return -1;
+    
+    if (fmt.block_rows > 0) {                                  // block mode : each block has its own histograms and rANS segment, the context is carried
+        int ctx_array [N_CONTEXT] = {0};
+    
+        for (i=0; i<(*p_height); i+=fmt.block_rows) {
+            readHists(&p_buf, p_tab, fmt.norm_bits);
+            p_buf = decodeRows(p_buf, p_img, (*p_width), i, MIN(i+fmt.block_rows, (*p_height)), ctx_array, fmt.n_lane, p_tab);
+        }
+    
+    } else if (fmt.stripe_rows <= 0) {
+        int ctx_array [N_CONTEXT] = {0};
+        
+        readHists(&p_buf, p_tab, fmt.norm_bits);
+        decodeRows(p_buf, p_img, (*p_width), 0, (*p_height), ctx_array, fmt.n_lane, p_tab);
+    
+    } else {
+        const int n_stripe = ((*p_height) + fmt.stripe_rows - 1) / fmt.stripe_rows;
+        StripeJob_t job;
+        uint16_t *p_stream;
+        
+        job.p_img        = p_img;
+        job.height       = (*p_height);
+        job.width        = (*p_width);
+        job.stripe_rows  = fmt.stripe_rows;
+        job.n_lane       = fmt.n_lane;
+        job.norm_bits    = fmt.norm_bits;
+        job.p_tab        = p_tab;
+        job.pp_stripe    = (uint16_t**)malloc(sizeof(uint16_t*) * n_stripe);
+        
+        if (job.pp_stripe == NULL) {
+            free(p_tab);
+            return -1;
+        }
+        
+        readHists(&p_buf, p_tab, fmt.norm_bits);
+        
+        p_stream = p_buf + 2 * n_stripe;                       // the stripe streams follows the length table
+        
+        for (i=0; i<n_stripe; i++) {
+            uint32_t len;
+            R16BIT(p_buf, len);
+            len <<= 16;
+            ROR16BIT(p_buf, len);
+            job.pp_stripe[i] = p_stream;
+            p_stream += len;
+        }
+        
+        #if ENABLE_MULTITHREAD
+        if (n_thread <= 0)
+            n_thread = getCPUCount();                          // auto : use all CPU cores
+        #else
+        n_thread = 1;
+        #endif
+        
+        runParallel(n_thread, n_stripe, decodeStripeTask, (void*)&job);
+        
+        free(job.pp_stripe);
+    }
+    
+    free(p_tab);
+    
+    return 0;
+}
+
+
+
+#define   MAX_HEADER_WORDS   9
+
+// return :
+//                 0 : success
+//                -1 : failed
+int QNBLICgetImageSize (const uint16_t *p_buf, int64_t n_word, int *p_height, int *p_width) {
+    uint16_t  head [MAX_HEADER_WORDS] = {0};
+    uint16_t *p_head = head;
+    QNBLICparam_t fmt;
+    int i;
+    
+    for (i=0; i<MAX_HEADER_WORDS && i<n_word; i++)
+        head[i] = p_buf[i];
+    
+    if (readHeader(&p_head, p_height, p_width, &fmt) || (p_head - head) > n_word)
+        return -1;
+    
+    return 0;
+}
+
+
+
+// the worst case of the symbols is a word per pixel (see compressStripes and compressBlocks), and the histograms are N_QD*(ANS_MVAL+1) words at most
+int64_t QNBLICgetStreamBound (int height, int width, const QNBLICparam_t *p_param) {
+    const QNBLICparam_t fmt = getFormat(p_param, height, width);
+    const int64_t hist_words = N_QD * (ANS_MVAL+1);
+    int64_t n_word = MAX_HEADER_WORDS + (int64_t)height * width;
+    
+    if (fmt.stripe_rows > 0)                                   // shared histograms, and the length and the extra words of each stripe
+        n_word += hist_words + (int64_t)((height + fmt.stripe_rows - 1) / fmt.stripe_rows) * (2 + STRIPE_EXTRA_WORDS);
+    else if (fmt.block_rows > 0)                               // the histograms and the extra words of each block
+        n_word += (int64_t)((height + fmt.block_rows - 1) / fmt.block_rows) * (hist_words + STRIPE_EXTRA_WORDS);
+    else
+        n_word += hist_words + STRIPE_EXTRA_WORDS;
+    
+    return n_word;
+}
+
+
+
+// return :
+//                 0 : success
+//                -1 : failed
+int QNBLICdecompress (uint16_t *p_buf, UI8 *p_img, int *p_height, int *p_width) {
+    return QNBLICdecompressMultiThread(p_buf, p_img, p_height, p_width, 1);
+}
+
+
+
+// return :
+//    positive value : compressed stream length
+//                -1 : failed
+int64_t QNBLICcompress (uint16_t *p_buf, UI8 *p_img, int height, int width, const QNBLICparam_t *p_param) {
+    QNBLICparam_t fmt = getFormat(p_param, height, width);
+    
+    uint32_t hist     [N_QD][ANS_MVAL+1] = {{0}};
+    uint32_t hist_acc [N_QD][ANS_MVAL+1];
+    
+    int ctx_array [N_CONTEXT] = {0};
+    
+    uint16_t *p_buf_base = p_buf;
+    
+    Symbol_t *py_base;
+    
+    if (checkSize(height, width) || checkParam(p_param, height, width))
+        return -1;
+    
+    if (fmt.stripe_rows > 0)
+        return compressStripes(p_buf, p_img, height, width, &fmt, 1);
+    
+    if (fmt.block_rows > 0) {
+        uint16_t *p_end = p_buf;
+        if (compressBlocks(p_img, height, width, &fmt, writeToBuffer, (void*)&p_end))
+            return -1;
+        return p_end - p_buf_base;
+    }
+    
+    py_base = (Symbol_t*)malloc(sizeof(Symbol_t) * height * width);
+    
+    if (py_base == NULL)
+        return -1;
+    
+    if (modelRows(p_img, width, 0, height, ctx_array, py_base, hist)) {
+        free(py_base);
+        return -1;
+    }
+    
+    writeHeader(&p_buf, height, width, &fmt);
+    writeHists(&p_buf, hist, hist_acc, fmt.norm_bits);
+    
+    //printf("    header+hist length = %ld B\n", 2*(p_buf-p_buf_base));
+    
+    p_buf = encodeSymbols(p_buf, py_base, height*width, hist, hist_acc, fmt.n_lane, fmt.norm_bits);
+    
+    free(py_base);
+    
+    return p_buf - p_buf_base;
+}
+
+
+
+// return :
+//                 0 : success
+//                -1 : failed
+int QNBLICcompressStream (UI8 *p_img, int height, int width, const QNBLICparam_t *p_param, QNBLICwrite_t p_write, void *p_user) {
+    QNBLICparam_t fmt = getFormat(p_param, height, width);
+    
+    if (checkSize(height, width) || checkParam(p_param, height, width) || fmt.block_rows <= 0 || p_write == NULL)
+        return -1;
+    
+    return compressBlocks(p_img, height, width, &fmt, p_write, p_user);
+}
+
+
+
+// Streaming block encoder --------------------------------------------------------------------------------
+// the rows are pushed in raster order, and each block is passed to the write callback as soon as its last row is pushed.
+// the rows are kept in a window of the current block and the WIN_ABOVE rows above it (which the prediction reads), so the memory
+// depends on block_rows*width instead of the image size. the stream is the same as QNBLICcompressStream.
+// image row i is window row (i - base + MIN(base,WIN_ABOVE)), where base is the first row of the current block. so the window rows
+// of the rows 0 and 1 are also 0 and 1 (which have their own border rules), and the other rows are window rows >= 2.
+#define   WIN_ABOVE    2
+
+#define   WIN_OFFSET(base)   MIN((base), WIN_ABOVE)
+
+struct QNBLICencoder_t {
+    QNBLICparam_t fmt;
+    QNBLICwrite_t p_write;
+    void         *p_user;
+    int           height, width, block_rows;
+    int           base;                       // the first row of the current block
+    int           i;                          // the next row to push
+    int           failed;
+    int64_t       n_word;                     // words passed to p_write
+    UI8          *p_win;                      // window of (block_rows + WIN_ABOVE) rows
+    Symbol_t     *py_base;                    // symbols of a block
+    uint16_t     *p_out;                      // output of a block
+    int           ctx_array [N_CONTEXT];
+};
+
+
+// the write callback of the streaming encoder : count the words, and pass them to the user's callback
+static int writeCounted (void *p_user, const uint16_t *p_words, int n_word) {
+    QNBLICencoder_t *p_enc = (QNBLICencoder_t*)p_user;
+    p_enc->n_word += n_word;
+    return p_enc->p_write(p_enc->p_user, p_words, n_word);
+}
+
+
+QNBLICencoder_t *QNBLICencoderBegin (int height, int width, const QNBLICparam_t *p_param, QNBLICwrite_t p_write, void *p_user) {
+    QNBLICparam_t fmt = getFormat(p_param, height, width);
+    
+    QNBLICencoder_t *p_enc;
+    
+    uint16_t *p_end;
+    
+    if (checkSize(height, width) || checkParam(p_param, height, width) || fmt.block_rows <= 0 || p_write == NULL)
+        return NULL;
+    
+    p_enc = (QNBLICencoder_t*)malloc(sizeof(QNBLICencoder_t));
+    
+    if (p_enc == NULL)
+        return NULL;
+    
+    p_enc->fmt        = fmt;
+    p_enc->p_write    = p_write;
+    p_enc->p_user     = p_user;
+    p_enc->height     = height;
+    p_enc->width      = width;
+    p_enc->block_rows = MIN(fmt.block_rows, height);
+    p_enc->base       = 0;
+    p_enc->i          = 0;
+    p_enc->failed     = 0;
+    p_enc->n_word     = 0;
+    p_enc->p_win      = (UI8*)     malloc(sizeof(UI8)      * (p_enc->block_rows + WIN_ABOVE) * width);
+    p_enc->py_base    = (Symbol_t*)malloc(sizeof(Symbol_t) * p_enc->block_rows * width);
+    p_enc->p_out      = (uint16_t*)malloc(sizeof(uint16_t) * BLOCK_OUT_WORDS(p_enc->block_rows, width));
+    
+    if (p_enc->p_win == NULL || p_enc->py_base == NULL || p_enc->p_out == NULL) {
+        QNBLICencoderEnd(p_enc);
+        return NULL;
+    }
+    
+    memset(p_enc->ctx_array, 0, sizeof(p_enc->ctx_array));
+    
+    p_end = p_enc->p_out;
+    writeHeader(&p_end, height, width, &p_enc->fmt);
+    p_enc->failed = writeCounted((void*)p_enc, p_enc->p_out, p_end-p_enc->p_out);
+    
+    if (p_enc->failed) {
+        QNBLICencoderEnd(p_enc);
+        return NULL;
+    }
+    
+    return p_enc;
+}
+
+
+int QNBLICencoderPushRows (QNBLICencoder_t *p_enc, const UI8 *p_rows, int n_row) {
+    const int width = (p_enc != NULL) ? p_enc->width : 0;
+    
+    if (p_enc == NULL || p_rows == NULL || n_row < 0 || n_row > p_enc->height - p_enc->i)
+        return -1;
+    
+    for (; n_row>0 && !p_enc->failed; n_row--) {
+        const int off   = WIN_OFFSET(p_enc->base);
+        const int i_end = MIN(p_enc->base + p_enc->block_rows, p_enc->height);
+        
+        memcpy(p_enc->p_win + (int64_t)(p_enc->i - p_enc->base + off) * width, p_rows, width);
+        p_rows += width;
+        p_enc->i ++;
+        
+        if (p_enc->i == i_end) {                               // the last row of the block : encode it, and keep the rows above the next block
+            const int next_off = WIN_OFFSET(i_end);
+            
+            p_enc->failed = encodeBlock(p_enc->p_win, width, off, off + (i_end - p_enc->base), p_enc->ctx_array, p_enc->py_base, p_enc->p_out, &p_enc->fmt, writeCounted, (void*)p_enc);
+            
+            memmove(p_enc->p_win, p_enc->p_win + (int64_t)(off + (i_end - p_enc->base) - next_off) * width, (size_t)next_off * width);
+            p_enc->base = i_end;
+        }
+    }
+    
+    return p_enc->failed ? -1 : 0;
+}
+
+
+int64_t QNBLICencoderEnd (QNBLICencoder_t *p_enc) {
+    int64_t ret = -1;
+    
+    if (p_enc == NULL)
+        return -1;
+    
+    if (p_enc->i == p_enc->height && !p_enc->failed)
+        ret = p_enc->n_word;
+    
+    free(p_enc->p_win);
+    free(p_enc->py_base);
+    free(p_enc->p_out);
+    free(p_enc);
+    
+    return ret;
+}
+
+
+
+// Streaming block decoder --------------------------------------------------------------------------------
+// the rows are decoded on demand, one block at a time, into a window of the block and the WIN_ABOVE rows above it (see the streaming encoder).
+// the stream is read from a buffer, or from a read callback into an input buffer, which is refilled before each block with the worst case
+// words of a block. the worst case is also for a corrupted stream (a 64-bit lane reads at most 2 words per symbol), so the decoder
+// never reads out of the input buffer. the words after the end of the input are decoded as zeros.
+#define   BLOCK_IN_WORDS(block_rows,width)   (2 * (int64_t)(block_rows) * (width) + 4 * MAX_N_LANE + N_QD * (ANS_MVAL+1))
+
+struct QNBLICdecoder_t {
+    QNBLICparam_t  fmt;
+    QNBLICread_t   p_read;                    // NULL : the stream is read from the user's buffer
+    void          *p_user;
+    int            height, width, block_rows;
+    int            base;                      // the first row of the current block
+    int            i_end;                     // the end row of the current block, the rows base ~ i_end-1 are decoded in the window
+    int            i;                         // the next row to read
+    int            eof;                       // the read callback has reached the end of the input
+    UI8           *p_win;                     // window of (block_rows + WIN_ABOVE) rows
+    uint16_t      *p_in;                      // the next word of the stream
+    uint16_t      *p_in_buf;                  // the input buffer of BLOCK_IN_WORDS words (read callback only)
+    int64_t        n_in;                      // the words read into p_in_buf
+    DecodeTable_t *p_tab;
+    int            ctx_array [N_CONTEXT];
+};
+
+
+// read the words of the input buffer up to n_max, and fill the rest with zeros
+// return:  -1:failed  0:success
+static int fillInput (QNBLICdecoder_t *p_dec, int64_t n_max) {
+    while (!p_dec->eof && p_dec->n_in < n_max) {
+        int n_read = p_dec->p_read(p_dec->p_user, p_dec->p_in_buf + p_dec->n_in, (int)MIN(n_max - p_dec->n_in, 0x10000000));
+        if (n_read < 0)
+            return -1;
+        if (n_read == 0)
+            p_dec->eof = 1;
+        p_dec->n_in += n_read;
+    }
+    memset(p_dec->p_in_buf + p_dec->n_in, 0, sizeof(uint16_t) * (n_max - p_dec->n_in));
+    return 0;
+}
+
+
+// decode the next block into the window, after keeping the rows above it
+// return:  -1:failed  0:success
+static int decodeNextBlock (QNBLICdecoder_t *p_dec) {
+    const int width    = p_dec->width;
+    const int off      = WIN_OFFSET(p_dec->base);
+    const int next_off = WIN_OFFSET(p_dec->i_end);
+    
+    memmove(p_dec->p_win, p_dec->p_win + (int64_t)(off + (p_dec->i_end - p_dec->base) - next_off) * width, (size_t)next_off * width);
+    p_dec->base  = p_dec->i_end;
+    p_dec->i_end = MIN(p_dec->base + p_dec->block_rows, p_dec->height);
+    
+    if (p_dec->p_read) {                                       // move the unused words to the start of the input buffer, and refill it
+        const int64_t n_keep = MAX(p_dec->n_in - (p_dec->p_in - p_dec->p_in_buf), 0);
+        memmove(p_dec->p_in_buf, p_dec->p_in, sizeof(uint16_t) * n_keep);
+        p_dec->p_in = p_dec->p_in_buf;
+        p_dec->n_in = n_keep;
+        if (fillInput(p_dec, BLOCK_IN_WORDS(p_dec->block_rows, width)))
+            return -1;
+    }
+    
+    readHists(&p_dec->p_in, p_dec->p_tab, p_dec->fmt.norm_bits);
+    p_dec->p_in = decodeRows(p_dec->p_in, p_dec->p_win, width, next_off, next_off + (p_dec->i_end - p_dec->base), p_dec->ctx_array, p_dec->fmt.n_lane, p_dec->p_tab);
+    
+    return 0;
+}
+
+
+// p_read : the read callback, or NULL to read the stream from p_buf
+static QNBLICdecoder_t *openDecoder (QNBLICread_t p_read, void *p_user, uint16_t *p_buf, int *p_height, int *p_width) {
+    uint16_t  head [MAX_HEADER_WORDS] = {0};
+    uint16_t *p_head = p_buf;
+    int64_t   n_head = 0;
+    
+    QNBLICdecoder_t *p_dec = (QNBLICdecoder_t*)malloc(sizeof(QNBLICdecoder_t));
+    
+    if (p_dec == NULL)
+        return NULL;
+    
+    p_dec->p_read   = p_read;
+    p_dec->p_user   = p_user;
+    p_dec->eof      = 0;
+    p_dec->p_win    = NULL;
+    p_dec->p_in_buf = NULL;
+    p_dec->p_tab    = NULL;
+    
+    if (p_read) {                                              // the header is read into head, and the words after it are moved to the input buffer
+        p_dec->p_in_buf = head;
+        p_dec->n_in     = 0;
+        n_head = fillInput(p_dec, MAX_HEADER_WORDS);
+        p_dec->p_in_buf = NULL;
+        if (n_head) {
+            QNBLICdecoderClose(p_dec);
+            return NULL;
+        }
+        p_head = head;
+    }
+    
+    if (readHeader(&p_head, p_height, p_width, &p_dec->fmt) || p_dec->fmt.block_rows <= 0) {   // only the block streams are decoded block by block
+        QNBLICdecoderClose(p_dec);
+        return NULL;
+    }
+    
+    p_dec->height     = *p_height;
+    p_dec->width      = *p_width;
+    p_dec->block_rows = MIN(p_dec->fmt.block_rows, p_dec->height);
+    p_dec->base       = 0;
+    p_dec->i_end      = 0;
+    p_dec->i          = 0;
+    p_dec->p_win      = (UI8*)          malloc(sizeof(UI8) * (p_dec->block_rows + WIN_ABOVE) * p_dec->width);
+    p_dec->p_tab      = (DecodeTable_t*)malloc(sizeof(DecodeTable_t));
+    
+    if (p_read) {
+        n_head = p_dec->n_in - (p_head - head);                // the words read after the header
+        p_dec->p_in_buf = (uint16_t*)malloc(sizeof(uint16_t) * BLOCK_IN_WORDS(p_dec->block_rows, p_dec->width));
+    }
+    
+    if (p_dec->p_win == NULL || p_dec->p_tab == NULL || (p_read && p_dec->p_in_buf == NULL)) {
+        QNBLICdecoderClose(p_dec);
+        return NULL;
+    }
+    
+    if (p_read) {
+        n_head = MAX(n_head, 0);
+        memcpy(p_dec->p_in_buf, p_head, sizeof(uint16_t) * n_head);
+        p_dec->p_in = p_dec->p_in_buf;
+        p_dec->n_in = n_head;
+    } else {
+        p_dec->p_in = p_head;
+    }
+    
+    memset(p_dec->ctx_array, 0, sizeof(p_dec->ctx_array));
+    
+    return p_dec;
+}
+
+
+QNBLICdecoder_t *QNBLICdecoderOpen (QNBLICread_t p_read, void *p_user, int *p_height, int *p_width) {
+    if (p_read == NULL)
+        return NULL;
+    return openDecoder(p_read, p_user, NULL, p_height, p_width);
+}
+
+
+QNBLICdecoder_t *QNBLICdecoderOpenBuffer (uint16_t *p_buf, int *p_height, int *p_width) {
+    if (p_buf == NULL)
+        return NULL;
+    return openDecoder(NULL, NULL, p_buf, p_height, p_width);
+}
+
+
+int QNBLICdecoderReadRows (QNBLICdecoder_t *p_dec, UI8 *p_rows, int n_row) {
+    int n_done = 0;
+    
+    if (p_dec == NULL || p_rows == NULL || n_row < 0)
+        return -1;
+    
+    while (n_done < n_row && p_dec->i < p_dec->height) {
+        int n;
+        
+        if (p_dec->i == p_dec->i_end && decodeNextBlock(p_dec))
+            return -1;
+        
+        n = MIN(n_row - n_done, p_dec->i_end - p_dec->i);
+        memcpy(p_rows, p_dec->p_win + (int64_t)(p_dec->i - p_dec->base + WIN_OFFSET(p_dec->base)) * p_dec->width, (size_t)n * p_dec->width);
+        p_rows    += (int64_t)n * p_dec->width;
+        p_dec->i  += n;
+        n_done    += n;
+    }
+    
+    return n_done;
+}
+
+
+void QNBLICdecoderClose (QNBLICdecoder_t *p_dec) {
+    if (p_dec != NULL) {
+        free(p_dec->p_win);
+        free(p_dec->p_in_buf);
+        free(p_dec->p_tab);
+        free(p_dec);
+    }
+}
+
+
+
+#if       ENABLE_MULTITHREAD
+
+#define   RING_DEPTH   4                          // each subthread can be at most RING_DEPTH units ahead of the main thread
+#define   RING_SPIN    1024                       // a waiting thread polls the ring this many times, then yields its time slice between the polls
+
+typedef struct {
     UI8     x;
     UI8     px;
     int16_t adr;
 } MetaData_t;
 
+
+// a lock-free single-producer single-consumer ring of row units.
+// the producer (a predict subthread) and the consumer (the main thread) each writes only its own counter, and reads the other one,
+// unit k is in slot (k % RING_DEPTH). the producer fills it when n_released >= k-RING_DEPTH+1, and the consumer reads it when n_filled >= k+1.
+typedef struct {
+    MetaData_t *p_slots;                          // RING_DEPTH slots, each slot holds a unit (row_per_unit rows)
+    AtomicInt_t n_filled;                         // count of units filled by the producer
+    char        pad [64];                         // keep the two counters in different cache lines
+    AtomicInt_t n_released;                       // count of units released by the consumer
+} UnitRing_t;
+
+
 typedef struct {
     int         height;
     int         width;
     int         row_per_unit;
+    int         n_thread;
     int         i_thd;
     UI8        *p_img;
-    MetaData_t *p_meta;
-    HANDLE      semaphore;
+    RowWork_t   work;                             // buffers of predictRow
+    UnitRing_t  ring;
 } ThreadArg_t;
 
-static void PredictThreadFuncWindows (void* arg) {
+
+// return:  -1:failed  0:success
+static int initUnitRing (UnitRing_t *p_ring, int unit_size) {
+    p_ring->p_slots = (MetaData_t*)malloc(RING_DEPTH * unit_size * sizeof(MetaData_t));
+    if (p_ring->p_slots == NULL)
+        return -1;
+    atomicStore(&p_ring->n_filled  , 0);
+    atomicStore(&p_ring->n_released, 0);
+    return 0;
+}
+
+
+static void freeUnitRing (UnitRing_t *p_ring) {
+    free(p_ring->p_slots);
+}
+
+
+// wait until the counter written by the other thread reaches count
+static void waitUnitRing (AtomicInt_t *p_counter, int count) {
+    int spin;
+    for (spin=0; atomicLoad(p_counter) < count; spin++)
+        if (spin >= RING_SPIN)
+            threadYield();
+}
+
+
+static void PredictThreadFunc (void* arg) {
     UI8  tab_qd [152]; 
     UI8  tab_pt [608];
     
-    int i, j, height, width, row_per_unit, i_thd;
+    int i, j, i_end, k, height, width, row_per_unit, n_thread, i_thd;
     UI8        *p_img;
-    MetaData_t *p_meta;
-    HANDLE      semaphore;
+    UnitRing_t *p_ring;
+    RowWork_t  *p_work;
     
     height       = ((ThreadArg_t*)arg)->height;
     width        = ((ThreadArg_t*)arg)->width;
     row_per_unit = ((ThreadArg_t*)arg)->row_per_unit;
+    n_thread     = ((ThreadArg_t*)arg)->n_thread;
     i_thd        = ((ThreadArg_t*)arg)->i_thd;
     p_img        = ((ThreadArg_t*)arg)->p_img;
-    p_meta       = ((ThreadArg_t*)arg)->p_meta;
-    semaphore    = ((ThreadArg_t*)arg)->semaphore;
+    p_ring       = &((ThreadArg_t*)arg)->ring;
+    p_work       = &((ThreadArg_t*)arg)->work;
     
     initQDLookupTable(tab_qd);
     initPTLookupTable(tab_pt);
     
-    for (i=i_thd*row_per_unit; i<height; ) {
-        int x=0, a=0, b=0, c=0, d=0, e=0, f=0, g=0, h=0, q=0, r=0, s=0;
-        int err = 0;
+    for (k=0, i=i_thd*row_per_unit; i<height; k++, i+=(n_thread-1)*row_per_unit) {
+        MetaData_t *p_meta = p_ring->p_slots + ((k % RING_DEPTH) * row_per_unit * width);
         
-        SAMPLE_PIXELS(p_img, width, i, 0, a, b, c, d, e, f, g, h, q, r, s);
+        waitUnitRing(&p_ring->n_released, k-RING_DEPTH+1);    // wait until the main thread releases this slot
         
-        for (j=0; j<width; j++) {
-            int px, qd, adr;
-            
-            x = G2D(p_img, width, i, j);
-            
-            px = simplePredict(a, b, c, d, e, f, g, h, q, r, s, tab_pt);
-            
-            qd = ABS(a-e) + ABS(b-c) + ABS(b-d) + ABS(a-c) + ABS(b-f) + ABS(d-g) + 2*ABS(err);
-            qd = MIN(qd, 152-1);
-            qd = tab_qd[qd];
-            
-            err = x - px;
+        for (i_end=MIN(i+row_per_unit, height); i<i_end; i++) {
+            predictRow(p_img, i, p_work, tab_qd, tab_pt);
             
-            GET_CONTEXT_ADDRESS(adr, a, b, c, d, e, f, px, qd);
-            
-            p_meta->x   = (UI8)x;
-            p_meta->px  = (UI8)px;
-            p_meta->adr = (int16_t)adr;
-            p_meta ++;
-            
-            SAMPLE_PIXELS_NEXT(p_img, width, i, j, x, a, b, c, d, e, f, g, h, q, r, s);
+            for (j=0; j<width; j++) {
+                p_meta->x   = G2D(p_img, width, i, j);
+                p_meta->px  = (UI8)p_work->p_px[j];
+                p_meta->adr = p_work->p_adr[j];
+                p_meta ++;
+            }
         }
         
-        i++;
-        
-        if ((i%row_per_unit) == 0 || i==height) {
-            ReleaseSemaphore(semaphore, 1, NULL);
-            i += (N_THREAD-1) * row_per_unit;
-        }
+        atomicStore(&p_ring->n_filled, k+1);                   // hand over this slot to the main thread
     }
 }
 
-static int QNBLICcompressMultiThreadWindows (uint16_t *p_buf, UI8 *p_img, int height, int width) {
-    int  i, j, i_thd, row_per_unit, unit_count, units_per_thread, row_per_thread;
+static int64_t QNBLICcompressMultiThreadImpl (uint16_t *p_buf, UI8 *p_img, int height, int width, const QNBLICparam_t *p_param, int n_thread) {
+    QNBLICparam_t fmt = getFormat(p_param, height, width);
+    
+    int  i, j, k, i_thd, row_per_unit, n_started=0;
     int  ctx_array [N_CONTEXT] = {0};
     
     uint32_t hist     [N_QD][ANS_MVAL+1] = {{0}};
@@ -747,21 +2078,14 @@ static int QNBLICcompressMultiThreadWindows (uint16_t *p_buf, UI8 *p_img, int he
     
     uint16_t *p_buf_base = p_buf;
     
-    MetaData_t *p_meta_base [N_THREAD];
-    MetaData_t *p_meta      [N_THREAD];
+    MetaData_t *p_meta = NULL;
     
-    ThreadArg_t threads_arg       [N_THREAD];
-    HANDLE      threads_semaphore [N_THREAD];
-    HANDLE      threads_handle    [N_THREAD];
+    ThreadArg_t threads_arg    [MAX_N_THREAD];
+    Thread_t    threads_handle [MAX_N_THREAD];
     
-    struct { UI8 qd; UI8 y; } *py_base, *py;
-    
-    if (checkSize(height, width))
-        return -1;
+    Symbol_t *py_base, *py;
     
-    py_base = py = malloc(height * width * sizeof(*py_base));
-    
-    if (py_base == NULL)
+    if (checkSize(height, width) || checkParam(p_param, height, width))
         return -1;
     
     if      (width <= 2048)
@@ -775,43 +2099,77 @@ static int QNBLICcompressMultiThreadWindows (uint16_t *p_buf, UI8 *p_img, int he
     else
         row_per_unit = 1;
     
-    unit_count       = (height - 1 + row_per_unit) / row_per_unit;
-    units_per_thread = (unit_count  - 1 + N_THREAD) / N_THREAD;
-    row_per_thread   = units_per_thread * row_per_unit;
+    //printf("    multithread config:  thd=%d  rpu=%d  ring=%d\n", n_thread, row_per_unit, RING_DEPTH);
     
-    //printf("    multithread config:  rpu=%d  u=%d  upt=%d  rpt=%d\n", row_per_unit, unit_count, units_per_thread, row_per_thread);
+    py_base = py = malloc(height * width * sizeof(*py_base));
     
-    for (i_thd=0; i_thd<N_THREAD; i_thd++) {
-        p_meta_base[i_thd] = p_meta[i_thd] = malloc(row_per_thread * width * sizeof(MetaData_t));
-        if ( p_meta[i_thd] == NULL)
-            return -1;
-        threads_semaphore[i_thd] = CreateSemaphore(NULL, 0, units_per_thread, NULL);
+    if (py_base == NULL)
+        return -1;
+    
+    for (i_thd=0; i_thd<n_thread; i_thd++) {
+        if (initRowWork(&threads_arg[i_thd].work, width))
+            break;
+        if (initUnitRing(&threads_arg[i_thd].ring, row_per_unit*width)) {
+            freeRowWork(&threads_arg[i_thd].work);
+            break;
+        }
     }
     
-    for (i_thd=0; i_thd<N_THREAD; i_thd++) {
+    if (i_thd < n_thread) {                                    // failed to allocate the buffers of all subthreads
+        for (i_thd--; i_thd>=0; i_thd--) {
+            freeUnitRing(&threads_arg[i_thd].ring);
+            freeRowWork(&threads_arg[i_thd].work);
+        }
+        free(py_base);
+        return -1;
+    }
+    
+    for (i_thd=0; i_thd<n_thread; i_thd++) {
         threads_arg[i_thd].height       = height;
         threads_arg[i_thd].width        = width;
         threads_arg[i_thd].row_per_unit = row_per_unit;
+        threads_arg[i_thd].n_thread     = n_thread;
         threads_arg[i_thd].i_thd        = i_thd;
         threads_arg[i_thd].p_img        = p_img;
-        threads_arg[i_thd].p_meta       = p_meta[i_thd];
-        threads_arg[i_thd].semaphore    = threads_semaphore[i_thd];
-        threads_handle[i_thd] = (HANDLE)_beginthread(PredictThreadFuncWindows, 0, (void*)(&threads_arg[i_thd]));
+        if (threadCreate(&threads_handle[i_thd], PredictThreadFunc, (void*)(&threads_arg[i_thd])))
+            break;
+        n_started ++;
+    }
+    
+    if (n_started < n_thread) {                                // failed to start all subthreads, fall back to single thread
+        for (i_thd=0; i_thd<n_started; i_thd++) {              // drain the units of the started subthreads, so that they can run to the end
+            for (k=0, i=i_thd*row_per_unit; i<height; k++, i+=n_thread*row_per_unit) {
+                waitUnitRing(&threads_arg[i_thd].ring.n_filled, k+1);
+                atomicStore(&threads_arg[i_thd].ring.n_released, k+1);
+            }
+            threadJoin(threads_handle[i_thd]);
+        }
+        for (i_thd=0; i_thd<n_thread; i_thd++) {
+            freeUnitRing(&threads_arg[i_thd].ring);
+            freeRowWork(&threads_arg[i_thd].work);
+        }
+        free(py_base);
+        return QNBLICcompress(p_buf, p_img, height, width, p_param);
     }
     
     for (i=0; i<height; i++) {
-        i_thd = (i/row_per_unit) % N_THREAD;
+        int i_unit = i / row_per_unit;
+        UnitRing_t *p_ring = &threads_arg[i_unit%n_thread].ring;
         
-        if ((i%row_per_unit) == 0)
-            WaitForSingleObject(threads_semaphore[i_thd], INFINITE);
+        if ((i%row_per_unit) == 0) {
+            if (i > 0)
+                atomicStore(&threads_arg[(i_unit-1)%n_thread].ring.n_released, (i_unit-1)/n_thread+1);   // release the previous unit's slot
+            waitUnitRing(&p_ring->n_filled, i_unit/n_thread+1);
+            p_meta = p_ring->p_slots + (((i_unit/n_thread) % RING_DEPTH) * row_per_unit * width);
+        }
         
         for (j=0; j<width; j++) {
             int x, px0, px, qd, adr, ctx, sign, y;
             
-            x   = p_meta[i_thd]->x;
-            px0 = p_meta[i_thd]->px;
-            adr = p_meta[i_thd]->adr;
-            p_meta[i_thd] ++;
+            x   = p_meta->x;
+            px0 = p_meta->px;
+            adr = p_meta->adr;
+            p_meta ++;
             
             qd = adr >> 8;
             
@@ -830,55 +2188,49 @@ static int QNBLICcompressMultiThreadWindows (uint16_t *p_buf, UI8 *p_img, int he
         }
     }
     
-    for (i_thd=0; i_thd<N_THREAD; i_thd++) {
-        WaitForSingleObject(threads_handle[i_thd], INFINITE);  // end of subthreads
-        free(p_meta_base[i_thd]);
+    for (i_thd=0; i_thd<n_thread; i_thd++) {
+        threadJoin(threads_handle[i_thd]);                     // end of subthreads
+        freeUnitRing(&threads_arg[i_thd].ring);
+        freeRowWork(&threads_arg[i_thd].work);
     }
     
-    WHEADER(p_buf, height, width);
+    writeHeader(&p_buf, height, width, &fmt);
+    writeHists(&p_buf, hist, hist_acc, fmt.norm_bits);
     
-    for (i=0; i<N_QD; i++) {
-        normHist(hist[i]);
-        initHistAcc(hist[i], hist_acc[i]);
-        encodeHist(&p_buf, hist[i]);
-    }
-    
-    {
-        uint16_t *p_buf_start = p_buf;
-        uint32_t ans = ANS_ENC_INIT_VALUE;
-        
-        for (py--; py>=py_base; py--) {
-            UI8 qd = py->qd;
-            UI8 y  = py->y;
-            uint32_t h  = hist[qd][y];
-            uint32_t ha = hist_acc[qd][y];
-            ANS_ENC(ans, p_buf, h, ha);
-        }
-        
-        ANS_ENC_FIN(ans, p_buf);
-        
-        reverseWords(p_buf_start, p_buf);
-    }
+    p_buf = encodeSymbols(p_buf, py_base, height*width, hist, hist_acc, fmt.n_lane, fmt.norm_bits);
     
     free(py_base);
     
     return p_buf - p_buf_base;
 }
 
-#endif // WINDOWS_MULTITHREAD
+#endif // ENABLE_MULTITHREAD
 
 
 
-int QNBLICcompressMultiThread (uint16_t *p_buf, UI8 *p_img, int height, int width) {
-    if (height >= 512 && (height*width) > (512*512)) {  // use multithread only when image is large enough
-        #if WINDOWS_MULTITHREAD
-        return QNBLICcompressMultiThreadWindows(p_buf, p_img, height, width);
-        #else
-        // linux multithread compressor is to be implemented later.
-        return QNBLICcompress(p_buf, p_img, height, width);
-        #endif
-    } else {
-        return QNBLICcompress(p_buf, p_img, height, width);
+// return :
+//    positive value : compressed stream length
+//                -1 : failed
+int64_t QNBLICcompressMultiThread (uint16_t *p_buf, UI8 *p_img, int height, int width, const QNBLICparam_t *p_param, int n_thread) {
+    #if ENABLE_MULTITHREAD
+    if (n_thread <= 0)
+        n_thread = getCPUCount();                              // auto : use all CPU cores
+    n_thread = MIN(n_thread, MAX_N_THREAD);
+    
+    if (p_param != NULL && p_param->stripe_rows > 0) {         // stripe mode : stripes are modeled and encoded in parallel
+        QNBLICparam_t fmt = getFormat(p_param, height, width);
+        if (checkSize(height, width) || checkParam(p_param, height, width))
+            return -1;
+        return compressStripes(p_buf, p_img, height, width, &fmt, n_thread);
     }
+    
+    if ((p_param != NULL && p_param->block_rows > 0) || isLargeImage(height, width))   // block mode is single thread, since its purpose is bounded memory
+        return QNBLICcompress(p_buf, p_img, height, width, p_param);
+    
+    if (n_thread > 1 && height >= 512 && (int64_t)height*width > (512*512))    // use multithread only when image is large enough
+        return QNBLICcompressMultiThreadImpl(p_buf, p_img, height, width, p_param, n_thread);
+    #endif
+    
+    return QNBLICcompress(p_buf, p_img, height, width, p_param);
 }
 
@@ -6,15 +6,85 @@
 #include <stdint.h>
 
 
-#define    QNBLIC_MAX_HEIGHT    65535
-#define    QNBLIC_MAX_WIDTH     65535
-#define    QNBLIC_MAX_IMG_SIZE  100000000
+#define    QNBLIC_MAX_HEIGHT    1048576
+#define    QNBLIC_MAX_WIDTH     1048576
+#define    QNBLIC_MAX_IMG_SIZE  100000000   // an image of more pixels is always compressed in blocks (block_rows is chosen if not given, and stripes cannot be used),
+                                            // and each block has at most this many pixels
 
 
-extern int QNBLICdecompress          (uint16_t *p_buf, unsigned char *p_img, int *p_height, int *p_width);
+// stream format parameters of compression. the decompressor parses them from the stream header.
+// passing p_param=NULL (or all fields=0) generates the legacy "Q0.2" stream.
+typedef struct {
+    int n_lane;      // number of interleaved rANS lanes : 1, 2, 4, or 8.  0 : legacy single 32-bit rANS state
+    int stripe_rows; // rows per independent stripe, stripes can be encoded and decoded in parallel.  0 : whole image as one stripe
+    int norm_bits;   // histogram precision : 11 ~ 15. a lower precision (<=12) decodes faster with packed tables.  0 : default (15)
+    int block_rows;  // rows per block, each block has its own histograms and is output once encoded (cannot be used with stripes).  0 : no blocks
+} QNBLICparam_t;
 
-extern int QNBLICcompress            (uint16_t *p_buf, unsigned char *p_img, int height, int width);
 
-extern int QNBLICcompressMultiThread (uint16_t *p_buf, unsigned char *p_img, int height, int width);
+// output callback of QNBLICcompressStream : write n_word 16-bit words. return 0 on success, -1 on failure
+typedef int (*QNBLICwrite_t) (void *p_user, const uint16_t *p_words, int n_word);
+
+
+// get the image size from the header of a stream (or its first n_word words), without decoding it. return 0 on success, -1 on failure
+extern int QNBLICgetImageSize          (const uint16_t *p_buf, int64_t n_word, int *p_height, int *p_width);
+
+// get the worst case length (in 16-bit words) of the stream of QNBLICcompress and QNBLICcompressMultiThread with these parameters, to allocate p_buf
+extern int64_t QNBLICgetStreamBound    (int height, int width, const QNBLICparam_t *p_param);
+
+extern int QNBLICdecompress            (uint16_t *p_buf, unsigned char *p_img, int *p_height, int *p_width);
+
+// n_thread : number of threads, 0 means using all CPU cores. only the streams with stripes are decoded in parallel
+extern int QNBLICdecompressMultiThread (uint16_t *p_buf, unsigned char *p_img, int *p_height, int *p_width, int n_thread);
+
+// return : the compressed stream length in 16-bit words, or -1 on failure
+extern int64_t QNBLICcompress          (uint16_t *p_buf, unsigned char *p_img, int height, int width, const QNBLICparam_t *p_param);
+
+// n_thread : number of threads, 0 means using all CPU cores
+extern int64_t QNBLICcompressMultiThread (uint16_t *p_buf, unsigned char *p_img, int height, int width, const QNBLICparam_t *p_param, int n_thread);
+
+// block-streaming compression, p_param->block_rows must be >0 (except for an image of more than QNBLIC_MAX_IMG_SIZE pixels). each block is passed to p_write as soon as it is encoded,
+// so the memory usage depends on block_rows*width instead of the image size. return 0 on success, -1 on failure
+extern int QNBLICcompressStream        (unsigned char *p_img, int height, int width, const QNBLICparam_t *p_param, QNBLICwrite_t p_write, void *p_user);
+
+
+// streaming block encoder : the rows are pushed in raster order, one or more at a time, and each block is passed to p_write as soon as its last row is pushed.
+// it only keeps the rows of one block (and 2 rows above it), so the memory depends on block_rows*width, even for the input image. the stream is the same as QNBLICcompressStream.
+typedef struct QNBLICencoder_t QNBLICencoder_t;
+
+// begin to compress an image, the parameters are the same as QNBLICcompressStream. the header is passed to p_write at once.
+// return : the encoder, or NULL if failed (invalid parameters, out of memory, or the write callback failed)
+extern QNBLICencoder_t *QNBLICencoderBegin (int height, int width, const QNBLICparam_t *p_param, QNBLICwrite_t p_write, void *p_user);
+
+// push the next n_row rows. p_rows has n_row*width pixels in raster scan order, and is not used after the call returns.
+// return 0 on success, -1 on failure (the rows exceed the image height, or the write callback failed)
+extern int QNBLICencoderPushRows       (QNBLICencoder_t *p_enc, const unsigned char *p_rows, int n_row);
+
+// finish the stream, and destroy the encoder. it is also used to abort an encoder before all rows are pushed.
+// return : the compressed stream length in 16-bit words, or -1 on failure (not all rows were pushed, or the write callback failed)
+extern int64_t QNBLICencoderEnd        (QNBLICencoder_t *p_enc);
+
+
+// streaming block decoder : the rows of a block stream are decoded on demand in raster order, one block at a time,
+// so the memory depends on block_rows*width instead of the image size. only the block streams (block_rows > 0) are supported.
+typedef struct QNBLICdecoder_t QNBLICdecoder_t;
+
+// input callback of QNBLICdecoderOpen : read up to n_word 16-bit words into p_words. return the number of words read, 0 at the end of the input, or -1 on failure
+typedef int (*QNBLICread_t) (void *p_user, uint16_t *p_words, int n_word);
+
+// open a stream, which is read by p_read about a block at a time. the callback may be asked for more words than the stream has,
+// and like QNBLICdecompress, the stream is not checked : the words after the end of the input are decoded as zeros.
+// return : the decoder, or NULL if failed (invalid header, not a block stream, out of memory, or the read callback failed)
+extern QNBLICdecoder_t *QNBLICdecoderOpen       (QNBLICread_t p_read, void *p_user, int *p_height, int *p_width);
+
+// open a stream in a buffer, which is read until the decoder is closed. the others are the same as QNBLICdecoderOpen
+extern QNBLICdecoder_t *QNBLICdecoderOpenBuffer (uint16_t *p_buf, int *p_height, int *p_width);
+
+// decode the next n_row rows into p_rows (n_row*width pixels in raster scan order). fewer rows are decoded at the end of the image.
+// return : the number of decoded rows (0 after the last row), or -1 on failure (the read callback failed, the rows of this call are not valid)
+extern int QNBLICdecoderReadRows       (QNBLICdecoder_t *p_dec, unsigned char *p_rows, int n_row);
+
+// close the decoder, and release its memory. it may be closed before all rows are decoded.
+extern void QNBLICdecoderClose         (QNBLICdecoder_t *p_dec);
 
 #endif // __QNBLIC_H__
@@ -0,0 +1,263 @@
+
+#include <stdlib.h>
+
+#include "Thread.h"
+
+
+typedef struct {
+    void (*p_func)(void*);
+    void  *p_arg;
+} ThreadEntry_t;
+
+
+
+#if defined(_WIN32)
+
+#include <process.h>
+
+
+int getCPUCount (void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (info.dwNumberOfProcessors > 0) ? (int)info.dwNumberOfProcessors : 1;
+}
+
+
+static unsigned __stdcall threadEntry (void *arg) {
+    ThreadEntry_t entry = *(ThreadEntry_t*)arg;
+    free(arg);
+    entry.p_func(entry.p_arg);
+    return 0;
+}
+
+
+// return:
+//     -1 : failed
+//      0 : success
+int threadCreate (Thread_t *p_thread, void (*p_func)(void*), void *p_arg) {
+    ThreadEntry_t *p_entry = (ThreadEntry_t*)malloc(sizeof(ThreadEntry_t));
+    
+    if (p_entry == NULL)
+        return -1;
+    
+    p_entry->p_func = p_func;
+    p_entry->p_arg  = p_arg;
+    
+    *p_thread = (HANDLE)_beginthreadex(NULL, 0, threadEntry, (void*)p_entry, 0, NULL);
+    
+    if (*p_thread == 0) {
+        free(p_entry);
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+void threadJoin (Thread_t thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+
+// return:
+//     -1 : failed
+//      0 : success
+int semaphoreInit (Semaphore_t *p_sem, int init_count, int max_count) {
+    *p_sem = CreateSemaphore(NULL, init_count, max_count, NULL);
+    return (*p_sem == NULL) ? -1 : 0;
+}
+
+
+void semaphoreDestroy (Semaphore_t *p_sem) {
+    CloseHandle(*p_sem);
+}
+
+
+void semaphorePost (Semaphore_t *p_sem) {
+    ReleaseSemaphore(*p_sem, 1, NULL);
+}
+
+
+void semaphoreWait (Semaphore_t *p_sem) {
+    WaitForSingleObject(*p_sem, INFINITE);
+}
+
+
+int atomicLoad (AtomicInt_t *p_value) {
+    return (int)InterlockedCompareExchange(p_value, 0, 0);       // a full barrier
+}
+
+
+void atomicStore (AtomicInt_t *p_value, int value) {
+    InterlockedExchange(p_value, (LONG)value);                   // a full barrier
+}
+
+
+void threadYield (void) {
+    SwitchToThread();
+}
+
+
+
+#else // POSIX threads
+
+#include <unistd.h>
+#include <sched.h>
+
+
+int getCPUCount (void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+}
+
+
+static void *threadEntry (void *arg) {
+    ThreadEntry_t entry = *(ThreadEntry_t*)arg;
+    free(arg);
+    entry.p_func(entry.p_arg);
+    return NULL;
+}
+
+
+// return:
+//     -1 : failed
+//      0 : success
+int threadCreate (Thread_t *p_thread, void (*p_func)(void*), void *p_arg) {
+    ThreadEntry_t *p_entry = (ThreadEntry_t*)malloc(sizeof(ThreadEntry_t));
+    
+    if (p_entry == NULL)
+        return -1;
+    
+    p_entry->p_func = p_func;
+    p_entry->p_arg  = p_arg;
+    
+    if (pthread_create(p_thread, NULL, threadEntry, (void*)p_entry)) {
+        free(p_entry);
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+void threadJoin (Thread_t thread) {
+    pthread_join(thread, NULL);
+}
+
+
+// return:
+//     -1 : failed
+//      0 : success
+int semaphoreInit (Semaphore_t *p_sem, int init_count, int max_count) {
+    (void)max_count;                // a POSIX counting semaphore has no upper limit, the caller never exceeds it anyway
+    p_sem->count = init_count;
+    if (pthread_mutex_init(&p_sem->mutex, NULL))
+        return -1;
+    if (pthread_cond_init(&p_sem->cond, NULL)) {
+        pthread_mutex_destroy(&p_sem->mutex);
+        return -1;
+    }
+    return 0;
+}
+
+
+void semaphoreDestroy (Semaphore_t *p_sem) {
+    pthread_cond_destroy(&p_sem->cond);
+    pthread_mutex_destroy(&p_sem->mutex);
+}
+
+
+void semaphorePost (Semaphore_t *p_sem) {
+    pthread_mutex_lock(&p_sem->mutex);
+    p_sem->count ++;
+    pthread_cond_signal(&p_sem->cond);
+    pthread_mutex_unlock(&p_sem->mutex);
+}
+
+
+void semaphoreWait (Semaphore_t *p_sem) {
+    pthread_mutex_lock(&p_sem->mutex);
+    while (p_sem->count <= 0)
+        pthread_cond_wait(&p_sem->cond, &p_sem->mutex);
+    p_sem->count --;
+    pthread_mutex_unlock(&p_sem->mutex);
+}
+
+
+int atomicLoad (AtomicInt_t *p_value) {
+    return __atomic_load_n(p_value, __ATOMIC_ACQUIRE);
+}
+
+
+void atomicStore (AtomicInt_t *p_value, int value) {
+    __atomic_store_n(p_value, value, __ATOMIC_RELEASE);
+}
+
+
+void threadYield (void) {
+    sched_yield();
+}
+
+#endif
+
+
+
+typedef struct {
+    void      (*p_func)(void*, int);
+    void       *p_arg;
+    int         n_task;
+    int         i_task;          // next task to run
+    Semaphore_t lock;            // protects i_task
+} ParallelJob_t;
+
+
+static void parallelWorker (void *arg) {
+    ParallelJob_t *p_job = (ParallelJob_t*)arg;
+    int i_task;
+    
+    for (;;) {
+        semaphoreWait(&p_job->lock);
+        i_task = p_job->i_task ++;
+        semaphorePost(&p_job->lock);
+        
+        if (i_task >= p_job->n_task)
+            break;
+        
+        p_job->p_func(p_job->p_arg, i_task);
+    }
+}
+
+
+void runParallel (int n_thread, int n_task, void (*p_func)(void*, int), void *p_arg) {
+    Thread_t      threads [MAX_N_THREAD];
+    ParallelJob_t job;
+    int i, n_started = 0;
+    
+    if (n_thread > MAX_N_THREAD)
+        n_thread = MAX_N_THREAD;
+    if (n_thread > n_task)
+        n_thread = n_task;
+    
+    job.p_func = p_func;
+    job.p_arg  = p_arg;
+    job.n_task = n_task;
+    job.i_task = 0;
+    
+    if (n_thread <= 1 || semaphoreInit(&job.lock, 1, 1)) {   // single thread, or failed to create the lock
+        for (i=0; i<n_task; i++)
+            p_func(p_arg, i);
+        return;
+    }
+    
+    for (i=1; i<n_thread; i++)                                 // the calling thread is also a worker, so start n_thread-1 subthreads
+        if (threadCreate(&threads[n_started], parallelWorker, (void*)&job) == 0)
+            n_started ++;
+    
+    parallelWorker((void*)&job);
+    
+    for (i=0; i<n_started; i++)
+        threadJoin(threads[i]);
+    
+    semaphoreDestroy(&job.lock);
+}
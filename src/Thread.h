@@ -0,0 +1,79 @@
+
+#ifndef   __THREAD_H__
+#define   __THREAD_H__
+
+
+#define    MAX_N_THREAD    64
+
+
+#if defined(_WIN32)
+
+#include <Windows.h>
+
+typedef HANDLE Thread_t;
+typedef HANDLE Semaphore_t;
+
+typedef volatile LONG AtomicInt_t;
+
+#else
+
+#include <pthread.h>
+
+typedef pthread_t Thread_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    int             count;
+} Semaphore_t;
+
+typedef volatile int AtomicInt_t;
+
+#endif
+
+
+// return:
+//     number of CPU cores which are available for this process (at least 1)
+extern int  getCPUCount      (void);
+
+
+// return:
+//     -1 : failed
+//      0 : success
+extern int  threadCreate     (Thread_t *p_thread, void (*p_func)(void*), void *p_arg);
+
+
+// wait for a thread to exit, and release it
+extern void threadJoin       (Thread_t thread);
+
+
+// return:
+//     -1 : failed
+//      0 : success
+extern int  semaphoreInit    (Semaphore_t *p_sem, int init_count, int max_count);
+
+
+extern void semaphoreDestroy (Semaphore_t *p_sem);
+
+extern void semaphorePost    (Semaphore_t *p_sem);
+
+extern void semaphoreWait    (Semaphore_t *p_sem);
+
+
+// an integer shared by threads without any lock : atomicLoad has acquire ordering and atomicStore has release ordering,
+// so the data written before atomicStore is visible to the thread which reads the stored value by atomicLoad
+extern int  atomicLoad       (AtomicInt_t *p_value);
+
+extern void atomicStore      (AtomicInt_t *p_value, int value);
+
+
+// give up the rest of the time slice of the calling thread, for a spin-wait loop
+extern void threadYield      (void);
+
+
+// run p_func(p_arg, i_task) for i_task = 0 ~ n_task-1 on n_thread threads (including the calling thread)
+// tasks are dispatched dynamically, one at a time, in ascending order. returns after all tasks are done.
+extern void runParallel      (int n_thread, int n_task, void (*p_func)(void*, int), void *p_arg);
+
+
+#endif // __THREAD_H__